@@ -39,8 +39,10 @@ void on_illegal_operation() { printf("ILLEGAL!\n"); }
 template<segment_id_t MAX_QUEUES = GLOBAL_MAX_QUEUES, memory_policy TMemoryPolicy = standard_memory_policy>
 class queue_pool_adapter_t {
     using pool_t = queue_pool_t<TMemoryPolicy>;
+    using counters_t = pool_t::queue_counters_t;
 public:
     using Q = pool_t::queue_handle_t;
+    static_assert(!std::is_same_v<TMemoryPolicy, standard_memory_policy> || sizeof(Q) == 1, "Handles are expected to take just 1 byte");
     template<typename ...Args>
     queue_pool_adapter_t(byte_t* buffer_, buffersize_t buffer_size_, Args ...args)
         : buffer(reinterpret_cast<buffer_view_t*>(buffer_))
@@ -52,16 +54,19 @@ public:
     /// Initializes the pool. Should be called before it's used for the first time.
     /// </summary>
     void init() {
-        for (buffersize_t t = 0; t < MAX_QUEUES; ++t)
+        for (buffersize_t t = 0; t < MAX_QUEUES; ++t) {
             buffer->header.handles[t] = pool_t::queue_handle_t::uninitialized();
+            buffer->header.counters[t] = counters_t();
+        }
         pool.init();
     }
 
     Q* create_queue() {
-        //MAX_QUEUES=64 -> this fits in a single cacheline if the compiler alligns the buffer alright -> probably doesn't make sense to optimize this further unless profiling says otherwise xD
+        //MAX_QUEUES=64 and handles take 1 byte each -> this fits in a single cacheline if the compiler alligns the buffer alright -> probably doesn't make sense to optimize this further unless profiling says otherwise xD
         //still it's pretty dumb that I even have to waste buffer space for these handles (if just this function returned Q instead of Q*, that wouldn't be a problem)
         for (buffersize_t t = 0; t < MAX_QUEUES; ++t) {
             if (buffer->header.handles[t].is_uninitialized()) {
+                buffer->header.counters[t] = counters_t();
                 return &(buffer->header.handles[t] = pool.make_queue());
             }
         }
@@ -74,7 +79,7 @@ public:
             on_illegal_operation();
             return;
         }
-        pool.destroy_queue(q);
+        pool.destroy_queue(q, get_counters(q));
         *q = Q::uninitialized();
     }
 
@@ -84,7 +89,17 @@ public:
             on_illegal_operation();
             return;
         }
-        if (!pool.try_enqueue_byte(q, b)) {
+        if (!pool.try_enqueue_byte(q, b, get_counters(q))) {
+            out_of_memory();
+            return;
+        }
+    }
+    void enqueue_bytes(Q* q, const byte_t* data, buffersize_t count) {
+        if (!is_valid_handle(q) || (!data && count > 0)) {
+            on_illegal_operation();
+            return;
+        }
+        if (!pool.try_enqueue_bytes(q, data, count, get_counters(q))) {
             out_of_memory();
             return;
         }
@@ -95,21 +110,50 @@ public:
             return -1;
         }
         byte_t ret;
-        if (!pool.try_dequeue_byte(q, &ret)) {
+        if (!pool.try_dequeue_byte(q, &ret, get_counters(q))) {
             on_illegal_operation();
             return -1;
         }
         return ret;
     }
+    buffersize_t dequeue_bytes(Q* q, byte_t* out_data, buffersize_t max_count) {
+        if (!is_valid_handle(q) || (!out_data && max_count > 0)) {
+            on_illegal_operation();
+            return 0;
+        }
+        return pool.try_dequeue_bytes(q, out_data, max_count, get_counters(q));
+    }
+
+    buffersize_t size(Q* q) {
+        if (!is_valid_handle(q)) {
+            on_illegal_operation();
+            return 0;
+        }
+        return pool.size(*get_counters(q));
+    }
+    buffersize_t used_blocks() { return pool.used_blocks(); }
+    buffersize_t free_blocks() { return pool.free_blocks(); }
+
+    /// <summary>
+    /// Incrementally defragments the pool, keeping all the queue handles valid.
+    /// </summary>
+    /// <returns>How many segments were moved or merged - 0 means there is nothing left to compact</returns>
+    buffersize_t compact(buffersize_t step_budget) {
+        return pool.compact(step_budget, std::span<Q>(buffer->header.handles, MAX_QUEUES));
+    }
 
 private:
     bool is_valid_handle(Q* q) {
         return q && q>=buffer->header.handles && q<(buffer->header.handles + MAX_QUEUES) && !q->is_uninitialized();
     }
+    counters_t* get_counters(Q* q) { return &buffer->header.counters[q - buffer->header.handles]; }
 
     struct buffer_view_t {
         struct header_t {
             Q handles[MAX_QUEUES];
+            //side table of the queues' counters, indexed the same way as the handles - keeps `size()` O(1) while the handles themselves stay 1 byte each
+            // (costs 8 bytes per queue slot with the standard memory policy)
+            counters_t counters[MAX_QUEUES];
         } header;
         byte_t data[];
     } *buffer;
@@ -0,0 +1,287 @@
+#ifndef ASYNC_QUEUE_POOL__guard___h6g5f4d9s8a7f4g6h5j4k9l8d7
+#define ASYNC_QUEUE_POOL__guard___h6g5f4d9s8a7f4g6h5j4k9l8d7
+
+#include<coroutine>
+#include<deque>
+#include<exception>
+#include<span>
+
+#include "queue_pool.h"
+
+
+
+namespace markussecundus::queue_pooling{
+
+/// <summary>
+/// Wraps a `queue_pool_t` with C++20 coroutine awaitables and a minimal single-threaded run loop,
+/// so that many handlers can share one pool without a thread each and without polling.
+///
+/// `co_await async_dequeue(q, out)` suspends until the queue holds at least `out.size()` bytes,
+/// `co_await async_enqueue(q, data)` suspends while the pool is out of memory.
+/// Waiters are served in FIFO order by whichever operation makes them satisfiable (enqueue into their queue, or any release of blocks):
+/// that operation already performs the waiter's dequeue/enqueue, so a resumed coroutine never needs to retry.
+/// Resumed coroutines only get scheduled - they run from `run()`, never from inside the operation that served them.
+///
+/// All operations on the queues must go through this object (not through the underlying pool directly), otherwise waiters won't get served.
+/// Not thread-safe - everything, including `run()`, must happen on a single thread.
+/// </summary>
+template<memory_policies::memory_policy TMemoryPolicy = memory_policies::standard_memory_policy>
+class async_queue_pool_t {
+public:
+    using pool_t = queue_pool_t<TMemoryPolicy>;
+
+    /// <summary>
+    /// Return type of coroutines that can be started by `spawn()`. Fire-and-forget - the frame destroys itself once the coroutine finishes.
+    /// </summary>
+    struct task_t {
+        struct promise_type {
+            task_t get_return_object() { return task_t{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    class dequeue_awaiter_t;
+    class enqueue_awaiter_t;
+
+    /// <summary>
+    /// Queue handle that also keeps the queue's counters and the list of coroutines waiting for data in the queue.
+    /// Must stay at the same address while any coroutine waits on it.
+    /// </summary>
+    struct async_queue_t {
+        buffersize_t get_length()const { return counters.get_length(); }
+    private:
+        friend class async_queue_pool_t;
+        typename pool_t::queue_handle_t handle = pool_t::queue_handle_t::uninitialized();
+        typename pool_t::queue_counters_t counters;
+        dequeue_awaiter_t* waiters_head = nullptr;
+        dequeue_awaiter_t* waiters_tail = nullptr;
+    };
+
+    /// <summary>
+    /// Result of `async_dequeue()`. `co_await` yields how many bytes were dequeued - `out.size()`, or 0 if the queue got destroyed in the meantime.
+    /// </summary>
+    class dequeue_awaiter_t {
+    public:
+        bool await_ready() { return owner->try_serve_dequeue(this, true); }
+        void await_suspend(std::coroutine_handle<> h) { waiting = h; owner->push_dequeue_waiter(this); }
+        buffersize_t await_resume() { return result; }
+    private:
+        friend class async_queue_pool_t;
+        dequeue_awaiter_t(async_queue_pool_t* owner_, async_queue_t* q_, std::span<byte_t> out_) : owner(owner_), q(q_), out(out_) {}
+        async_queue_pool_t* owner;
+        async_queue_t* q;
+        std::span<byte_t> out;
+        buffersize_t result = 0;
+        std::coroutine_handle<> waiting;
+        dequeue_awaiter_t* next = nullptr;
+        //neighbours in the list of dequeue waiters of all the queues
+        dequeue_awaiter_t* all_next = nullptr;
+        dequeue_awaiter_t* all_last = nullptr;
+    };
+    /// <summary>
+    /// Result of `async_enqueue()`. `co_await` yields whether the bytes were enqueued - `false` only if the queue got destroyed in the meantime.
+    /// </summary>
+    class enqueue_awaiter_t {
+    public:
+        bool await_ready() { return owner->try_serve_enqueue(this, true); }
+        void await_suspend(std::coroutine_handle<> h) { waiting = h; owner->push_enqueue_waiter(this); }
+        bool await_resume() { return result; }
+    private:
+        friend class async_queue_pool_t;
+        enqueue_awaiter_t(async_queue_pool_t* owner_, async_queue_t* q_, std::span<const byte_t> data_) : owner(owner_), q(q_), data(data_) {}
+        async_queue_pool_t* owner;
+        async_queue_t* q;
+        std::span<const byte_t> data;
+        bool result = false;
+        std::coroutine_handle<> waiting;
+        enqueue_awaiter_t* next = nullptr;
+    };
+
+
+    template<typename ...Args>
+    async_queue_pool_t(Args ...args) : pool(args...) {}
+    async_queue_pool_t(const async_queue_pool_t&) = delete;
+    async_queue_pool_t& operator=(const async_queue_pool_t&) = delete;
+    /// <summary>
+    /// Destroys frames of all coroutines that didn't finish - both the scheduled and the waiting ones.
+    /// </summary>
+    ~async_queue_pool_t() {
+        for (auto h : ready) h.destroy();
+        for (auto w = enqueue_waiters_head; w; ) { auto next = w->next; w->waiting.destroy(); w = next; }
+        for (auto w = dequeue_waiters_head; w; ) { auto next = w->all_next; w->waiting.destroy(); w = next; }
+    }
+
+    /// <summary>
+    /// Initializes the pool. Should be called before it's used for the first time.
+    /// </summary>
+    void init() { pool.init(); }
+    /// <summary>
+    /// The underlying pool, e.g. for its statistics. Queues must not be modified through it.
+    /// </summary>
+    pool_t& get_pool() { return pool; }
+
+    /// <summary>
+    /// Schedules a coroutine to be started by `run()`.
+    /// </summary>
+    void spawn(task_t task) { ready.push_back(task.handle); }
+    /// <summary>
+    /// Resumes scheduled coroutines until there are none left - i.e. until every coroutine either finished or waits for something.
+    /// </summary>
+    /// <returns>How many times a coroutine got resumed</returns>
+    buffersize_t run() {
+        buffersize_t ret = 0;
+        for (; !ready.empty(); ++ret) {
+            auto h = ready.front();
+            ready.pop_front();
+            h.resume();
+        }
+        return ret;
+    }
+    /// <summary>
+    /// Whether some coroutine waits in `async_enqueue()` for memory to be released.
+    /// </summary>
+    bool has_enqueue_waiters() { return enqueue_waiters_head != nullptr; }
+
+    async_queue_t make_queue() {
+        async_queue_t ret;
+        ret.handle = pool.make_queue();
+        return ret;
+    }
+    /// <summary>
+    /// Destroys the queue. Coroutines waiting to dequeue from it / enqueue into it get resumed with a failure result.
+    /// </summary>
+    void destroy_queue(async_queue_t* q) {
+        pool.destroy_queue(&q->handle, &q->counters);
+        while (auto w = q->waiters_head) {
+            q->waiters_head = w->next;
+            w->result = 0;
+            unlink_dequeue_waiter(w);
+            ready.push_back(w->waiting);
+        }
+        q->waiters_tail = nullptr;
+        for (auto w = &enqueue_waiters_head; *w; ) {
+            if ((*w)->q != q) { w = &(*w)->next; continue; }
+            (*w)->result = false;
+            ready.push_back((*w)->waiting);
+            *w = (*w)->next;
+        }
+        enqueue_waiters_tail = nullptr;
+        for (auto w = enqueue_waiters_head; w; w = w->next) enqueue_waiters_tail = w;
+        serve_enqueue_waiters();
+    }
+    buffersize_t size(const async_queue_t& q) { return pool.size(q.counters); }
+
+    /// <summary>
+    /// Awaitable that dequeues exactly `out.size()` bytes, suspending until the queue holds enough of them.
+    /// </summary>
+    dequeue_awaiter_t async_dequeue(async_queue_t* q, std::span<byte_t> out) { return dequeue_awaiter_t(this, q, out); }
+    /// <summary>
+    /// Awaitable that enqueues all of `data` at once, suspending while the pool doesn't have enough free memory for it.
+    /// </summary>
+    enqueue_awaiter_t async_enqueue(async_queue_t* q, std::span<const byte_t> data) { return enqueue_awaiter_t(this, q, data); }
+
+    /// <summary>
+    /// Same as `queue_pool_t::try_enqueue_bytes()`, serving the coroutines waiting for data in the queue.
+    /// </summary>
+    bool try_enqueue_bytes(async_queue_t* q, const byte_t* data, buffersize_t count) {
+        if (!pool.try_enqueue_bytes(&q->handle, data, count, &q->counters)) return false;
+        serve_dequeue_waiters(q);
+        return true;
+    }
+    /// <summary>
+    /// Same as `queue_pool_t::try_dequeue_bytes()`, serving the coroutines waiting for memory.
+    /// Bytes can't be taken ahead of the coroutines already waiting on the queue - 0 is returned then.
+    /// </summary>
+    buffersize_t try_dequeue_bytes(async_queue_t* q, byte_t* out_data, buffersize_t max_count) {
+        if (q->waiters_head) return 0;
+        auto ret = pool.try_dequeue_bytes(&q->handle, out_data, max_count, &q->counters);
+        serve_enqueue_waiters();
+        return ret;
+    }
+
+private:
+    pool_t pool;
+    std::deque<std::coroutine_handle<>> ready;
+    //waiters for memory of all the queues, in the order they arrived in
+    enqueue_awaiter_t* enqueue_waiters_head = nullptr;
+    enqueue_awaiter_t* enqueue_waiters_tail = nullptr;
+    //waiters for data of all the queues (in no particular order), so that the destructor can reach their coroutines
+    dequeue_awaiter_t* dequeue_waiters_head = nullptr;
+
+    void push_dequeue_waiter(dequeue_awaiter_t* w) {
+        (w->q->waiters_tail ? w->q->waiters_tail->next : w->q->waiters_head) = w;
+        w->q->waiters_tail = w;
+        w->all_next = dequeue_waiters_head;
+        if (dequeue_waiters_head) dequeue_waiters_head->all_last = w;
+        dequeue_waiters_head = w;
+    }
+    //once the waiter's coroutine is scheduled to be resumed
+    void unlink_dequeue_waiter(dequeue_awaiter_t* w) {
+        (w->all_last ? w->all_last->all_next : dequeue_waiters_head) = w->all_next;
+        if (w->all_next) w->all_next->all_last = w->all_last;
+        w->all_next = w->all_last = nullptr;
+    }
+    void push_enqueue_waiter(enqueue_awaiter_t* w) {
+        (enqueue_waiters_tail ? enqueue_waiters_tail->next : enqueue_waiters_head) = w;
+        enqueue_waiters_tail = w;
+    }
+
+    /// <summary>
+    /// Performs the awaited dequeue if the queue holds enough bytes (and, for a new awaiter, nobody waits on the queue ahead of it).
+    /// </summary>
+    bool try_serve_dequeue(dequeue_awaiter_t* w, bool is_new) {
+        if (is_new && w->q->waiters_head) return false;
+        if (pool.size(w->q->counters) < w->out.size()) return false;
+        w->result = pool.try_dequeue_bytes(&w->q->handle, w->out.data(), w->out.size(), &w->q->counters);
+        serve_enqueue_waiters();
+        return true;
+    }
+    /// <summary>
+    /// Performs the awaited enqueue if it fits (and, for a new awaiter, nobody waits for memory ahead of it).
+    /// </summary>
+    bool try_serve_enqueue(enqueue_awaiter_t* w, bool is_new) {
+        if (is_new && enqueue_waiters_head) return false;
+        if (!pool.try_enqueue_bytes(&w->q->handle, w->data.data(), w->data.size(), &w->q->counters)) return false;
+        w->result = true;
+        serve_dequeue_waiters(w->q);
+        return true;
+    }
+
+    //waiter is detached from its list while being served - serving it might recursively serve other waiters
+    void serve_dequeue_waiters(async_queue_t* q) {
+        while (auto w = q->waiters_head) {
+            q->waiters_head = w->next;
+            if (!q->waiters_head) q->waiters_tail = nullptr;
+            if (!try_serve_dequeue(w, false)) {
+                w->next = q->waiters_head;
+                q->waiters_head = w;
+                if (!q->waiters_tail) q->waiters_tail = w;
+                return;
+            }
+            unlink_dequeue_waiter(w);
+            ready.push_back(w->waiting);
+        }
+    }
+    //strictly FIFO - a waiter that doesn't fit blocks the ones behind it, so that big enqueues don't starve
+    void serve_enqueue_waiters() {
+        while (auto w = enqueue_waiters_head) {
+            enqueue_waiters_head = w->next;
+            if (!enqueue_waiters_head) enqueue_waiters_tail = nullptr;
+            if (!try_serve_enqueue(w, false)) {
+                w->next = enqueue_waiters_head;
+                enqueue_waiters_head = w;
+                if (!enqueue_waiters_tail) enqueue_waiters_tail = w;
+                return;
+            }
+            ready.push_back(w->waiting);
+        }
+    }
+};
+
+}
+
+#endif
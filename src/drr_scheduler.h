@@ -0,0 +1,185 @@
+#ifndef DRR_SCHEDULER__guard___k4j5h6g7f8d9s1a2s3d4f5g6h7
+#define DRR_SCHEDULER__guard___k4j5h6g7f8d9s1a2s3d4f5g6h7
+
+#include<algorithm>
+#include<array>
+#include<span>
+
+#include "queue_pool.h"
+#include "utils/linked_list.h"
+
+
+
+namespace markussecundus::queue_pooling{
+
+/// <summary>
+/// Drains a set of queues of a `queue_pool_t` fairly, in deficit round robin order.
+///
+/// Every registered queue gets `base_quantum * weight` bytes of credit per round; bytes it doesn't use because the batch ran out stay to its credit,
+/// credit of a queue that got emptied is dropped. Queues that have nothing to dequeue are not part of the round at all
+/// - only queues marked active by `activate()` (done automatically by `try_enqueue_bytes()` of the scheduler) are kept in a cyclic list,
+/// so an empty queue costs nothing, no matter how many of them there are.
+///
+/// Queue handles (and counters, if provided) are referenced by pointer - they must stay at the same address while registered.
+/// Sizes of queues registered with their counters are read in O(1) time, others are summed over their segments.
+/// </summary>
+/// <typeparam name="MAX_QUEUES">How many queues can be registered at once.</typeparam>
+/// <typeparam name="TMemoryPolicy">Memory policy of the scheduled pool.</typeparam>
+template<segment_id_t MAX_QUEUES, memory_policies::memory_policy TMemoryPolicy = memory_policies::standard_memory_policy>
+class drr_scheduler_t {
+public:
+    using pool_t = queue_pool_t<TMemoryPolicy>;
+    static constexpr segment_id_t INVALID_INDEX = ~segment_id_t(0);
+
+    /// <summary>
+    /// Contiguous run of bytes dequeued from a single queue by `next_batch()`.
+    /// </summary>
+    struct run_t {
+        segment_id_t queue_index;
+        std::span<byte_t> data;
+    };
+
+    /// <summary>
+    /// Base quantum 0 is treated as 1 - a queue with no credit would never get its turn over, so `next_batch()` would never return.
+    /// </summary>
+    drr_scheduler_t(pool_t* pool_, buffersize_t base_quantum_) : pool(pool_), base_quantum(std::max<buffersize_t>(1, base_quantum_)) {}
+
+    /// <summary>
+    /// Registers a queue to be scheduled. It's active right away if it's not empty. Weight 0 is treated as 1.
+    /// Counters of the queue, if the caller keeps them, get updated by the scheduler's operations on the queue.
+    /// </summary>
+    /// <returns>Index of the queue within the scheduler, `INVALID_INDEX` if all `MAX_QUEUES` slots are taken</returns>
+    segment_id_t add_queue(typename pool_t::queue_handle_t* handle, buffersize_t weight = 1, typename pool_t::queue_counters_t* counters = nullptr) {
+        for (segment_id_t t = 0; t < MAX_QUEUES; ++t) {
+            if (entries[t].handle) continue;
+            entries[t] = entry_t{ .handle = handle, .counters = counters, .quantum = get_quantum(weight) };
+            activate(t);
+            return t;
+        }
+        return INVALID_INDEX;
+    }
+    /// <summary>
+    /// Unregisters a queue. Runs in O(1) time.
+    /// </summary>
+    void remove_queue(segment_id_t index) {
+        deactivate(index);
+        entries[index] = entry_t();
+    }
+    /// <summary>
+    /// Changes the share of a queue. Takes effect from its next turn. Weight 0 is treated as 1.
+    /// </summary>
+    void set_weight(segment_id_t index, buffersize_t weight) { entries[index].quantum = get_quantum(weight); }
+
+    /// <summary>
+    /// Puts a queue into the round if it's not empty and not there yet. Must be called after something gets enqueued into a registered queue
+    /// other than by `try_enqueue_bytes()` of the scheduler. Runs in O(1) time.
+    /// </summary>
+    void activate(segment_id_t index) {
+        auto& e = entries[index];
+        if (e.is_active || get_size(e) <= 0) return;
+        e.is_active = true;
+        ll().init_node(index);
+        if (active_head == INVALID_INDEX) active_head = index;
+        else ll().prepend_list(active_head, index); //at the end of the round
+    }
+    /// <summary>
+    /// Same as `queue_pool_t::try_enqueue_bytes()` on a registered queue, putting it into the round.
+    /// </summary>
+    bool try_enqueue_bytes(segment_id_t index, const byte_t* data, buffersize_t count) {
+        if (!pool->try_enqueue_bytes(entries[index].handle, data, count, entries[index].counters)) return false;
+        activate(index);
+        return true;
+    }
+
+    /// <summary>
+    /// Whether some registered queue has anything to dequeue. Runs in O(1) time.
+    /// </summary>
+    bool has_active_queues() { return active_head != INVALID_INDEX; }
+
+    /// <summary>
+    /// Dequeues up to `budget` bytes into `out` from the active queues, each taking as much as its credit allows before it's the next one's turn.
+    /// Every visited queue produces a single run - unless `out_runs` gets full, the batch ends only when the budget is spent or all queues are empty.
+    ///
+    /// Runs in O(number of runs + bytes) time.
+    /// </summary>
+    /// <returns>How many runs were written into `out_runs`</returns>
+    buffersize_t next_batch(std::span<byte_t> out, buffersize_t budget, std::span<run_t> out_runs) {
+        budget = std::min<buffersize_t>(budget, out.size());
+        buffersize_t used = 0, runs_count = 0;
+        while (active_head != INVALID_INDEX && used < budget && runs_count < out_runs.size()) {
+            auto index = active_head;
+            auto& e = entries[index];
+            if (!is_head_turn_started) {
+                e.deficit += e.quantum;
+                is_head_turn_started = true;
+            }
+            auto count = std::min({ e.deficit, get_size(e), budget - used });
+            count = pool->try_dequeue_bytes(e.handle, out.data() + used, count, e.counters);
+            if (count > 0) out_runs[runs_count++] = run_t{ .queue_index = index, .data = out.subspan(used, count) };
+            used += count;
+            e.deficit -= count;
+
+            if (get_size(e) <= 0) { //emptied - leaves the round together with its credit
+                e.deficit = 0;
+                deactivate(index);
+            }
+            else if (e.deficit <= 0) { //turn is over
+                active_head = ll().next(index);
+                is_head_turn_started = false;
+            }
+        }
+        return runs_count;
+    }
+
+private:
+    struct entry_t {
+        typename pool_t::queue_handle_t* handle = nullptr;
+        typename pool_t::queue_counters_t* counters = nullptr;
+        buffersize_t quantum = 0;
+        buffersize_t deficit = 0;
+        bool is_active = false;
+        segment_id_t next = INVALID_INDEX, last = INVALID_INDEX;
+    };
+
+    pool_t* pool;
+    buffersize_t base_quantum;
+
+    //never 0, so that every turn dequeues something
+    buffersize_t get_quantum(buffersize_t weight) const { return base_quantum * std::max<buffersize_t>(1, weight); }
+    std::array<entry_t, MAX_QUEUES> entries{};
+    //queue whose turn it is; INVALID_INDEX if no queue is active
+    segment_id_t active_head = INVALID_INDEX;
+    //whether the head queue already got its quantum for the current turn (the turn might span multiple batches)
+    bool is_head_turn_started = false;
+
+    buffersize_t get_size(const entry_t& e) { return e.counters ? pool->size(*e.counters) : pool->size(*e.handle); }
+
+    void deactivate(segment_id_t index) {
+        auto& e = entries[index];
+        if (!e.is_active) return;
+        e.is_active = false;
+        auto next = ll().is_single_node(index) ? INVALID_INDEX : ll().disconnect_node(index);
+        if (active_head == index) {
+            active_head = next;
+            is_head_turn_started = false;
+        }
+    }
+
+    struct entry_linked_list_access_policy {
+        entry_linked_list_access_policy(drr_scheduler_t* scheduler_) :scheduler(scheduler_) {}
+
+        segment_id_t get_next(segment_id_t a) { return scheduler->entries[a].next; }
+        segment_id_t get_last(segment_id_t a) { return scheduler->entries[a].last; }
+        void set_next(segment_id_t node, segment_id_t to_set) { scheduler->entries[node].next = to_set; }
+        void set_last(segment_id_t node, segment_id_t to_set) { scheduler->entries[node].last = to_set; }
+        bool is_same_node(segment_id_t a, segment_id_t b) { return a == b; }
+        bool is_null(segment_id_t a) { return a == INVALID_INDEX; }
+    private:
+        drr_scheduler_t* scheduler;
+    };
+    auto ll() { return linked_lists::linked_list_manipulator_t<segment_id_t, entry_linked_list_access_policy>(this); }
+};
+
+}
+
+#endif
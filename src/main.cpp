@@ -22,6 +22,26 @@ int main(){
     //tests::ll_randomized_test();
     tests::QueuePoolTest{}.test_queue_randomized();
     tests::QueuePoolTest{}.test_queue_randomized_with_destroy();
+    tests::QueuePoolTest{}.test_queue_randomized_bulk();
+    tests::QueuePoolTest{}.test_fd_io();
+    tests::QueuePoolTest{}.test_coalescing();
+    tests::QueuePoolTest{}.test_compaction();
+    tests::QueuePoolTest{}.test_wide_memory_policy();
+    tests::QueuePoolTest{}.test_side_table_memory_policy();
+    tests::QueuePoolTest{}.test_aligned_memory_policy();
+    tests::QueuePoolTest{}.test_uncounted_queues();
+    tests::QueuePoolTest{}.test_fat_handles();
+    tests::QueuePoolTest{}.test_ready_bitmap();
+    tests::QueuePoolTest{}.test_typed_queue_view();
+    tests::QueuePoolTest{}.test_messages();
+    tests::QueuePoolTest{}.test_drr_scheduler();
+    tests::QueuePoolTest{}.test_spsc();
+    tests::QueuePoolTest{}.test_concurrent_regular_queues();
+    tests::QueuePoolTest{}.test_spsc_magazines();
+    tests::QueuePoolTest{}.test_spsc_wait();
+    tests::QueuePoolTest{}.test_async();
+    tests::QueuePoolTest{}.test_sharded_pool();
+    tests::QueuePoolTest{}.test_persistent_pool();
 
 
     adapter_test();
@@ -1,7 +1,14 @@
 #ifndef MEMORY_POLICY__guard____ASfd1456ADShfgjffdsdf654g98g4d6f5fd
 #define MEMORY_POLICY__guard____ASfd1456ADShfgjffdsdf654g98g4d6f5fd
 
+#include<concepts>
+#include<cstddef>
+#include<cstdint>
+#include<type_traits>
+
 #include "basic_definitions.h"
+#include "utils/math_utils.h"
+#include "utils/memory_utils.h"
 
 namespace markussecundus::queue_pooling::memory_policies{
         
@@ -45,6 +52,17 @@ namespace markussecundus::queue_pooling::memory_policies{
         //gets an invalid header_view instance
         {THeaderView::invalid()} -> std::convertible_to<THeaderView>;
     };
+    /// <summary>
+    /// Builds a tag identifying the header encoding of a memory policy - FNV-1a hash of its name, followed by its template parameters packed into an integer.
+    /// </summary>
+    constexpr std::uint64_t make_policy_tag(const char* name, std::uint64_t parameters = 0) {
+        constexpr std::uint64_t FNV_OFFSET = 0xCBF29CE484222325ull, FNV_PRIME = 0x100000001B3ull;
+        std::uint64_t ret = FNV_OFFSET;
+        for (; *name; ++name) ret = (ret ^ (std::uint8_t)*name) * FNV_PRIME;
+        for (std::size_t t = 0; t < sizeof(parameters); ++t, parameters >>= 8) ret = (ret ^ (parameters & 0xFF)) * FNV_PRIME;
+        return ret;
+    }
+
     /// <summary>
     /// Object specifying details about how memory shall be handled (block size, header encoding etc.) by a queue pool.
     /// </summary>
@@ -58,9 +76,28 @@ namespace markussecundus::queue_pooling::memory_policies{
         {pol.get_block_size_bytes()} -> std::convertible_to<buffersize_t>;
         //how many blocks can be addressed in total considering the data types used by the header
         {pol.get_addressable_blocks_count()} -> std::convertible_to<segment_id_t>;
+        //max value of segment length that the header is able to encode
+        {THeaderPolicy::get_max_segment_length()} -> std::convertible_to<buffersize_t>;
         //create a header view, starting in a specified segment, displaying specified segment id
         {pol.make_header_view(byteptr, segment_id)} -> std::convertible_to<typename THeaderPolicy::segment_header_view_t>;
     }
+    //optionally, the policy can require the blocks to be aligned - it provides `get_block_alignment()` (power of 2, block size must be its multiple)
+    //  and `get_unaligned_block_size_bytes()` (block size that would be used without the alignment, to report how much capacity got lost)
+    && (!requires{ THeaderPolicy::get_block_alignment(); } || requires (THeaderPolicy pol) {
+        {THeaderPolicy::get_block_alignment()} -> std::convertible_to<buffersize_t>;
+        {pol.get_unaligned_block_size_bytes()} -> std::convertible_to<buffersize_t>;
+    })
+    //optionally, the policy can ask for a side table of fixed size per block (e.g. to store headers out of the blocks)
+    // - it provides `get_side_table_bytes_per_block()` and `set_side_table(byte_t*, segment_id_t blocks_count)`; queue pool then reserves the memory in its header area
+    && (!requires{ THeaderPolicy::get_side_table_bytes_per_block(); } || requires (THeaderPolicy pol, byte_t* byteptr, typename THeaderPolicy::segment_id_t segment_id) {
+        {THeaderPolicy::get_side_table_bytes_per_block()} -> std::convertible_to<buffersize_t>;
+        {pol.set_side_table(byteptr, segment_id)} -> std::convertible_to<void>;
+    })
+    //optionally, the policy can identify its header encoding by `get_policy_tag()` (see `make_policy_tag()`) - required by `persistent_queue_pool_t`,
+    //  which refuses to attach a buffer laid out by a different policy
+    && (!requires{ THeaderPolicy::get_policy_tag(); } || requires {
+        {THeaderPolicy::get_policy_tag()} -> std::convertible_to<std::uint64_t>;
+    })
     //type big enough for storing segment_ids in memory (important to save as much space as possible in adapter.cpp's handle pool)
     && std::convertible_to<typename THeaderPolicy::packed_segment_id_t, typename THeaderPolicy::segment_id_t>
     //type safe for performing arithmetics on segment_ids
@@ -177,12 +214,255 @@ namespace markussecundus::queue_pooling::memory_policies{
         static constexpr buffersize_t get_header_size_bytes() { return sizeof(typename segment_header_view_t::packed_header_t); }
         buffersize_t get_block_size_bytes() { return block_size; }
         static constexpr segment_id_t get_addressable_blocks_count() { return 1<<8; }
+        static constexpr buffersize_t get_max_segment_length() { return (1 << 12) - 1; }
+        static constexpr std::uint64_t get_policy_tag() { return make_policy_tag("standard_memory_policy"); }
         segment_header_view_t make_header_view(byte_t* segment_start, segment_id_t segment_index) { return segment_header_view_t(segment_start, segment_index); }
 
     private:
         buffersize_t block_size;
     };
 
+
+    /// <summary>
+    /// Memory policy whose headers store every field explicitly in a fixed-width integer, so that a single pool can address a lot more blocks 
+    /// (and longer segments) than with `standard_memory_policy`, for the price of bigger header overhead.
+    /// 
+    /// Header is `2*sizeof(TSegmentId) + 2*sizeof(TLength)` bytes (8 bytes for 16bit ids and lengths, 16 bytes for 32bit ones), 
+    /// the `is_free` flag is packed into the most significant bit of the length field - or, with `SEPARATE_FREE_FLAG`, 
+    /// kept in a byte of its own (plus padding), so that no getter needs to mask anything and the length field can use all of its bits.
+    /// Fields are accessed through memcpy, so blocks don't need to be aligned in any way.
+    /// Block size is specified as a runtime argument and must be small enough for the length field to encode it.
+    /// </summary>
+    /// <typeparam name="TSegmentId">Type for storing segment ids - decides how many blocks are addressable</typeparam>
+    /// <typeparam name="TLength">Type for storing segment begin and length - decides how long a single segment can get</typeparam>
+    /// <typeparam name="SEPARATE_FREE_FLAG">Whether the `is_free` flag gets a byte of its own instead of the top bit of the length field</typeparam>
+    template<std::unsigned_integral TSegmentId, std::unsigned_integral TLength, bool SEPARATE_FREE_FLAG = false>
+    struct wide_memory_policy {
+    public:
+        using packed_segment_id_t = TSegmentId;
+        //must be able to hold the addressable blocks count, which is 1 more than the max value of TSegmentId
+        using segment_id_t = std::conditional_t<(sizeof(TSegmentId) < sizeof(std::uint32_t)), std::uint32_t, std::uint64_t>;
+
+        struct segment_header_view_t {
+        private:
+            friend wide_memory_policy;
+            segment_header_view_t(byte_t* segment_start, segment_id_t segment_index) : header_ptr_raw(segment_start), segment_id(segment_index) {}
+        public:
+            bool operator==(segment_header_view_t other)const { return this->header_ptr_raw == other.header_ptr_raw; }
+
+            segment_id_t get_next_segment_id() { return load<TSegmentId>(offsetof(packed_header_t, next_segment)); }
+            void set_next_segment_id(segment_id_t value) { store<TSegmentId>(offsetof(packed_header_t, next_segment), (TSegmentId)value); }
+            segment_id_t get_last_segment_id() { return load<TSegmentId>(offsetof(packed_header_t, last_segment)); }
+            void set_last_segment_id(segment_id_t value) { store<TSegmentId>(offsetof(packed_header_t, last_segment), (TSegmentId)value); }
+
+            buffersize_t get_segment_begin() { return load<TLength>(offsetof(packed_header_t, segment_begin)); }
+            void set_segment_begin(buffersize_t value) { store<TLength>(offsetof(packed_header_t, segment_begin), (TLength)value); }
+
+            buffersize_t get_segment_length() { return load<TLength>(offsetof(packed_header_t, segment_length_and_flag)) & LENGTH_MASK; }
+            void set_segment_length(buffersize_t value) {
+                if constexpr (SEPARATE_FREE_FLAG) {
+                    store<TLength>(offsetof(packed_header_t, segment_length_and_flag), (TLength)value);
+                    return;
+                }
+                auto old = load<TLength>(offsetof(packed_header_t, segment_length_and_flag));
+                store<TLength>(offsetof(packed_header_t, segment_length_and_flag), (TLength)((old & FREE_FLAG) | (value & LENGTH_MASK)));
+            }
+            bool get_is_free_segment() {
+                if constexpr (SEPARATE_FREE_FLAG) return load<std::uint8_t>(offsetof(packed_header_t, is_free_segment));
+                return load<TLength>(offsetof(packed_header_t, segment_length_and_flag)) & FREE_FLAG;
+            }
+            void set_is_free_segment(bool value) {
+                if constexpr (SEPARATE_FREE_FLAG) {
+                    store<std::uint8_t>(offsetof(packed_header_t, is_free_segment), value);
+                    return;
+                }
+                auto old = load<TLength>(offsetof(packed_header_t, segment_length_and_flag));
+                store<TLength>(offsetof(packed_header_t, segment_length_and_flag), (TLength)(value ? (old | FREE_FLAG) : (old & LENGTH_MASK)));
+            }
+
+            byte_t* get_segment_data() { return header_ptr_raw + get_header_size_bytes(); }
+
+            segment_id_t get_segment_id() { return segment_id; }
+
+            bool is_valid() { return (bool)header_ptr_raw; }
+            static segment_header_view_t invalid() { return segment_header_view_t(NULL, 0); }
+        private:
+            static constexpr TLength FREE_FLAG = SEPARATE_FREE_FLAG ? TLength(0) : (TLength)(TLength(1) << (sizeof(TLength) * 8 - 1));
+            static constexpr TLength LENGTH_MASK = (TLength)~FREE_FLAG;
+
+            struct packed_header_with_flag_bit_t {
+                TSegmentId next_segment;
+                TSegmentId last_segment;
+                TLength segment_begin;
+                TLength segment_length_and_flag;
+            };
+            struct packed_header_with_flag_byte_t {
+                TSegmentId next_segment;
+                TSegmentId last_segment;
+                std::uint8_t is_free_segment;
+                TLength segment_begin;
+                TLength segment_length_and_flag;
+            };
+            using packed_header_t = std::conditional_t<SEPARATE_FREE_FLAG, packed_header_with_flag_byte_t, packed_header_with_flag_bit_t>;
+
+            byte_t* header_ptr_raw;
+            segment_id_t segment_id;
+
+            template<typename T> T load(std::size_t offset) { return utils::memory::load_unaligned<T>(header_ptr_raw + offset); }
+            template<typename T> void store(std::size_t offset, T value) { utils::memory::store_unaligned(header_ptr_raw + offset, value); }
+        };
+
+
+        wide_memory_policy(buffersize_t block_size_) : block_size(block_size_) {}
+
+        static constexpr buffersize_t get_header_size_bytes() { return sizeof(typename segment_header_view_t::packed_header_t); }
+        buffersize_t get_block_size_bytes() { return block_size; }
+        static constexpr segment_id_t get_addressable_blocks_count() { return segment_id_t(1) << (sizeof(TSegmentId) * 8); }
+        static constexpr buffersize_t get_max_segment_length() { return segment_header_view_t::LENGTH_MASK; }
+        static constexpr std::uint64_t get_policy_tag() { return make_policy_tag("wide_memory_policy", sizeof(TSegmentId) | (sizeof(TLength) << 8) | (SEPARATE_FREE_FLAG << 16)); }
+        segment_header_view_t make_header_view(byte_t* segment_start, segment_id_t segment_index) { return segment_header_view_t(segment_start, segment_index); }
+
+    private:
+        buffersize_t block_size;
+    };
+
+    /// <summary>
+    /// 8 byte headers, up to 65534 blocks per pool (e.g. 256MB with 4KB blocks), segments up to 32KB long.
+    /// </summary>
+    using wide16_memory_policy = wide_memory_policy<std::uint16_t, std::uint16_t>;
+    /// <summary>
+    /// 16 byte headers, practically unlimited number of blocks and segment length.
+    /// </summary>
+    using wide32_memory_policy = wide_memory_policy<std::uint32_t, std::uint32_t>;
+    /// <summary>
+    /// Drop-in alternative to `standard_memory_policy` (same addressable blocks count) that trades 4 more bytes of header 
+    /// for branch-free decoding - every field is a plain integer on its natural offset, nothing is bit-packed or borrowed from the payload.
+    /// Every getter is a single load (unaligned blocks are still fine, they are just not as fast). Header is 8 bytes, segments up to 64KB long.
+    /// </summary>
+    using fast_memory_policy = wide_memory_policy<std::uint8_t, std::uint16_t, true>;
+    static_assert(fast_memory_policy::get_header_size_bytes() == 8, "Segment header of fast_memory_policy is supposed to take exactly 8 bytes");
+
+
+    /// <summary>
+    /// Memory policy that keeps segment headers out of the blocks, in a dense struct-of-arrays table (separate arrays for next ids, last ids, begins and lengths)
+    /// placed by the queue pool in front of the blocks. Blocks thus contain nothing but payload - with block size being a multiple of N, 
+    /// payload of every block is aligned to N as well (relative to the start of the blocks area).
+    /// 
+    /// List walks only touch the small table instead of one cache line per block. Table costs `get_side_table_bytes_per_block()` per block, 
+    /// same as the headers of `wide_memory_policy` would.
+    /// 
+    /// Queue pool detects the policy needs a side table by the presence of `get_side_table_bytes_per_block()` and hands it the memory through `set_side_table()`.
+    /// </summary>
+    /// <typeparam name="TSegmentId">Type for storing segment ids - decides how many blocks are addressable</typeparam>
+    /// <typeparam name="TLength">Type for storing segment begin and length - decides how long a single segment can get</typeparam>
+    template<std::unsigned_integral TSegmentId, std::unsigned_integral TLength>
+    struct side_table_memory_policy {
+    public:
+        using packed_segment_id_t = TSegmentId;
+        using segment_id_t = std::conditional_t<(sizeof(TSegmentId) < sizeof(std::uint32_t)), std::uint32_t, std::uint64_t>;
+
+        struct segment_header_view_t {
+        private:
+            friend side_table_memory_policy;
+            segment_header_view_t(byte_t* segment_start_, byte_t* table_, segment_id_t table_length_, segment_id_t segment_index) 
+                : segment_start(segment_start_), table(table_), table_length(table_length_), segment_id(segment_index) {}
+        public:
+            bool operator==(segment_header_view_t other)const { return this->segment_start == other.segment_start; }
+
+            segment_id_t get_next_segment_id() { return load<TSegmentId>(NEXT_ARRAY); }
+            void set_next_segment_id(segment_id_t value) { store<TSegmentId>(NEXT_ARRAY, (TSegmentId)value); }
+            segment_id_t get_last_segment_id() { return load<TSegmentId>(LAST_ARRAY); }
+            void set_last_segment_id(segment_id_t value) { store<TSegmentId>(LAST_ARRAY, (TSegmentId)value); }
+
+            buffersize_t get_segment_begin() { return load<TLength>(BEGIN_ARRAY); }
+            void set_segment_begin(buffersize_t value) { store<TLength>(BEGIN_ARRAY, (TLength)value); }
+
+            buffersize_t get_segment_length() { return load<TLength>(LENGTH_ARRAY) & LENGTH_MASK; }
+            void set_segment_length(buffersize_t value) { store<TLength>(LENGTH_ARRAY, (TLength)((load<TLength>(LENGTH_ARRAY) & FREE_FLAG) | (value & LENGTH_MASK))); }
+            bool get_is_free_segment() { return load<TLength>(LENGTH_ARRAY) & FREE_FLAG; }
+            void set_is_free_segment(bool value) {
+                auto old = load<TLength>(LENGTH_ARRAY);
+                store<TLength>(LENGTH_ARRAY, (TLength)(value ? (old | FREE_FLAG) : (old & LENGTH_MASK)));
+            }
+
+            byte_t* get_segment_data() { return segment_start; }
+
+            segment_id_t get_segment_id() { return segment_id; }
+
+            bool is_valid() { return (bool)segment_start; }
+            static segment_header_view_t invalid() { return segment_header_view_t(NULL, NULL, 0, 0); }
+        private:
+            static constexpr TLength FREE_FLAG = (TLength)(TLength(1) << (sizeof(TLength) * 8 - 1));
+            static constexpr TLength LENGTH_MASK = (TLength)~FREE_FLAG;
+            enum array_t { NEXT_ARRAY, LAST_ARRAY, BEGIN_ARRAY, LENGTH_ARRAY };
+
+            byte_t* segment_start;
+            byte_t* table;
+            segment_id_t table_length;
+            segment_id_t segment_id;
+
+            //arrays are laid out one after another: next ids | last ids | begins | lengths
+            byte_t* get_field_ptr(array_t array) {
+                buffersize_t array_offset = (array <= LAST_ARRAY) 
+                    ? array * sizeof(TSegmentId) * table_length 
+                    : 2 * sizeof(TSegmentId) * table_length + (array - BEGIN_ARRAY) * sizeof(TLength) * table_length;
+                return table + array_offset + (array <= LAST_ARRAY ? sizeof(TSegmentId) : sizeof(TLength)) * segment_id;
+            }
+            template<typename T> T load(array_t array) { return utils::memory::load_unaligned<T>(get_field_ptr(array)); }
+            template<typename T> void store(array_t array, T value) { utils::memory::store_unaligned(get_field_ptr(array), value); }
+        };
+
+
+        side_table_memory_policy(buffersize_t block_size_) : block_size(block_size_) {}
+
+        static constexpr buffersize_t get_header_size_bytes() { return 0; }
+        buffersize_t get_block_size_bytes() { return block_size; }
+        static constexpr segment_id_t get_addressable_blocks_count() { return segment_id_t(1) << (sizeof(TSegmentId) * 8); }
+        static constexpr buffersize_t get_max_segment_length() { return segment_header_view_t::LENGTH_MASK; }
+        static constexpr std::uint64_t get_policy_tag() { return make_policy_tag("side_table_memory_policy", sizeof(TSegmentId) | (sizeof(TLength) << 8)); }
+        segment_header_view_t make_header_view(byte_t* segment_start, segment_id_t segment_index) { return segment_header_view_t(segment_start, table, table_length, segment_index); }
+
+        static constexpr buffersize_t get_side_table_bytes_per_block() { return 2 * sizeof(TSegmentId) + 2 * sizeof(TLength); }
+        void set_side_table(byte_t* table_, segment_id_t blocks_count) { table = table_; table_length = blocks_count; }
+
+    private:
+        buffersize_t block_size;
+        byte_t* table = nullptr;
+        segment_id_t table_length = 0;
+    };
+
+    /// <summary>
+    /// 8 bytes of side table per block, up to 65534 blocks per pool, segments up to 32KB long.
+    /// </summary>
+    using side_table16_memory_policy = side_table_memory_policy<std::uint16_t, std::uint16_t>;
+
+
+    /// <summary>
+    /// Wraps another memory policy so that every block starts on an address aligned to `ALIGNMENT` (e.g. 64 for a cache line):
+    /// block size gets rounded up to a multiple of `ALIGNMENT` and the queue pool aligns the start of its blocks area.
+    /// With inline headers (e.g. `standard_memory_policy`) no block then straddles a cache line boundary more than necessary,
+    /// with `side_table_memory_policy` the payload itself is aligned.
+    /// 
+    /// Paid for by the padding - queue pool reports how many bytes got lost by `get_alignment_loss_bytes()`.
+    /// </summary>
+    /// <typeparam name="TBase">The policy being wrapped</typeparam>
+    /// <typeparam name="ALIGNMENT">Required alignment of blocks, must be a power of 2</typeparam>
+    template<typename TBase, buffersize_t ALIGNMENT>
+    struct aligned_memory_policy : public TBase {
+        static_assert(ALIGNMENT > 0 && (ALIGNMENT & (ALIGNMENT - 1)) == 0, "Alignment must be a power of 2");
+
+        template<typename ...Args>
+        aligned_memory_policy(buffersize_t block_size_, Args ...args) 
+            : TBase(utils::math::round_up(block_size_, ALIGNMENT), args...)
+            , unaligned_block_size(block_size_)
+            {}
+
+        static constexpr buffersize_t get_block_alignment() { return ALIGNMENT; }
+        buffersize_t get_unaligned_block_size_bytes() { return unaligned_block_size; }
+    private:
+        buffersize_t unaligned_block_size;
+    };
+
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,285 @@
+#ifndef PERSISTENT_QUEUE_POOL__guard___m3n4b5v6c7x8z9l1k2j3h4g5f6
+#define PERSISTENT_QUEUE_POOL__guard___m3n4b5v6c7x8z9l1k2j3h4g5f6
+
+#include "queue_pool.h"
+
+#if __has_include(<sys/mman.h>) && __has_include(<fcntl.h>) && __has_include(<unistd.h>)
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+#define QUEUE_POOL_MMAP_SUPPORTED
+#endif
+
+#ifdef QUEUE_POOL_MMAP_SUPPORTED
+
+#include<cstdint>
+#include<optional>
+
+
+
+namespace markussecundus::queue_pooling{
+
+/// <summary>
+/// `queue_pool_t` whose buffer is a memory-mapped file, so that its queues survive restarts of the process.
+///
+/// File layout: superblock | table of queue handles | table of their counters | pool's buffer.
+/// The superblock records the format version and everything the layout of the pool's buffer depends on 
+/// (memory policy's tag and header parameters, block size and alignment, options),
+/// so that `attach()` can validate it and take the pool over as it is - free list, segment links and queues included - instead of initializing it again.
+/// Handles of the queues and their counters live in mapped tables as well (indexed `0..queues_count-1`), so they persist together with the blocks they point to.
+///
+/// Durability points are `sync()` calls (msync of the whole mapping); operations done through this object also trigger one automatically
+/// once `sync_batch` of them accumulate since the last one - 0 leaves it all up to explicit `sync()` calls.
+/// Process crash between operations loses nothing (the mapping is shared), a crash of the whole machine loses operations since the last durability point.
+/// A crash in the middle of an operation might leave the pool inconsistent - `was_closed_cleanly()` tells the attaching process whether that could have happened.
+///
+/// Only regular queues referenced by the handle table persist; blocks cached by magazines of the spsc queues are lost, unless flushed before closing.
+/// Not thread-safe by itself - same rules as for the underlying pool apply.
+/// </summary>
+template<memory_policies::memory_policy TMemoryPolicy = memory_policies::standard_memory_policy>
+class persistent_queue_pool_t {
+    static_assert(requires{ TMemoryPolicy::get_policy_tag(); }, "Memory policy must provide get_policy_tag(), so that a file laid out by a different policy can be recognized");
+public:
+    using pool_t = queue_pool_t<TMemoryPolicy>;
+    using queue_handle_t = typename pool_t::queue_handle_t;
+    using queue_counters_t = typename pool_t::queue_counters_t;
+    static constexpr std::uint64_t MAGIC = 0x4C4F4F5045555551ull; //"QUEUPOOL"
+    static constexpr std::uint32_t FORMAT_VERSION = 3;
+
+    persistent_queue_pool_t() = default;
+    persistent_queue_pool_t(const persistent_queue_pool_t&) = delete;
+    persistent_queue_pool_t& operator=(const persistent_queue_pool_t&) = delete;
+    ~persistent_queue_pool_t() { close(); }
+
+    /// <summary>
+    /// Creates (or overwrites) the file, maps it and initializes a new pool in it, with all the queues uninitialized.
+    /// </summary>
+    /// <param name="file_size">Size of the whole file, including the superblock and the handle and counters tables.</param>
+    /// <param name="queues_count">How many persistent queue handles to reserve.</param>
+    /// <param name="args">Parameters of the memory policy (e.g. block size).</param>
+    /// <returns>`false` if the file couldn't be created/mapped or is too small</returns>
+    template<typename ...Args>
+    bool create(const char* path, buffersize_t file_size, segment_id_t queues_count, queue_pool_options_t options, Args ...args) {
+        close();
+        if (file_size < get_pool_offset(queues_count)) return false;
+        int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        bool ok = ::ftruncate(fd, (off_t)file_size) == 0 && map(fd, file_size);
+        ::close(fd);
+        if (!ok) return false;
+
+        auto sb = get_superblock();
+        *sb = make_superblock(queues_count, options, TMemoryPolicy(args...));
+        sb->file_size = file_size;
+        for (segment_id_t t = 0; t < queues_count; ++t) {
+            get_handles()[t] = queue_handle_t::uninitialized();
+            get_counters_table()[t] = queue_counters_t();
+        }
+        pool.emplace(mapping + get_pool_offset(queues_count), file_size - get_pool_offset(queues_count), options, args...);
+        pool->init();
+        //magic goes in last, so that a file whose creation got interrupted is never mistaken for a valid one
+        sb->magic = MAGIC;
+        sb->is_open = 1;
+        return sync();
+    }
+    /// <summary>
+    /// Maps an existing file and takes over the pool persisted in it, without initializing it again.
+    /// Runs in O(1) time (+ whatever it takes the OS to map the file).
+    /// </summary>
+    /// <param name="args">Parameters of the memory policy (e.g. block size) - must be the same as those the file was created with.</param>
+    /// <returns>`false` if the file couldn't be mapped or its superblock doesn't match (wrong magic/version, different memory policy, block size, block alignment or size)</returns>
+    template<typename ...Args>
+    bool attach(const char* path, Args ...args) {
+        close();
+        int fd = ::open(path, O_RDWR);
+        if (fd < 0) return false;
+        struct stat st;
+        bool ok = ::fstat(fd, &st) == 0 && (buffersize_t)st.st_size >= sizeof(superblock_t) && map(fd, (buffersize_t)st.st_size);
+        ::close(fd);
+        if (!ok) return false;
+
+        auto sb = get_superblock();
+        auto options = sb->get_options();
+        if (sb->magic != MAGIC || sb->version != FORMAT_VERSION || sb->file_size != mapping_size
+            || mapping_size < get_pool_offset(sb->queues_count)
+            || !sb->has_same_layout(make_superblock(sb->queues_count, options, TMemoryPolicy(args...)))) {
+            unmap();
+            return false;
+        }
+        pool.emplace(mapping + get_pool_offset(sb->queues_count), mapping_size - get_pool_offset(sb->queues_count), options, args...);
+        pool->attach();
+        was_clean = !sb->is_open;
+        sb->is_open = 1;
+        return sync();
+    }
+    /// <summary>
+    /// Makes everything durable and unmaps the file, marking it as closed cleanly. Called automatically by the destructor.
+    /// </summary>
+    void close() {
+        if (!mapping) return;
+        sync();
+        get_superblock()->is_open = 0;
+        sync();
+        unmap();
+    }
+
+    bool is_open()const { return mapping != nullptr; }
+    /// <summary>
+    /// Whether the process that used the file before `attach()` closed it properly (always `true` after `create()`).
+    /// </summary>
+    bool was_closed_cleanly()const { return was_clean; }
+
+    /// <summary>
+    /// The underlying pool. Operations done directly on it don't count towards `sync_batch`.
+    /// </summary>
+    pool_t& get_pool() { return *pool; }
+    segment_id_t get_queues_count() { return get_superblock()->queues_count; }
+    /// <summary>
+    /// Persistent handle of a queue, living in the mapped file. `uninitialized` until `make_queue()` gets called for its index.
+    /// </summary>
+    queue_handle_t* get_queue(segment_id_t queue_index) { return &get_handles()[queue_index]; }
+    /// <summary>
+    /// Persistent counters of a queue, living in the mapped file - to be passed along with its handle to operations done directly on the pool.
+    /// </summary>
+    queue_counters_t* get_counters(segment_id_t queue_index) { return &get_counters_table()[queue_index]; }
+
+    /// <summary>
+    /// How many modifying operations done through this object trigger a durability point. 0 - only explicit `sync()` calls.
+    /// </summary>
+    void set_sync_batch(buffersize_t sync_batch_) { sync_batch = sync_batch_; }
+    /// <summary>
+    /// How many modifying operations were done through this object since the last durability point.
+    /// </summary>
+    buffersize_t get_unsynced_operations_count()const { return unsynced_operations_count; }
+    /// <summary>
+    /// Durability point - blocks until the whole mapping (pool, handles, superblock) is written to the file.
+    /// </summary>
+    /// <returns>`false` if msync failed</returns>
+    bool sync() {
+        unsynced_operations_count = 0;
+        return ::msync(mapping, mapping_size, MS_SYNC) == 0;
+    }
+
+    /// <summary>
+    /// (Re)creates the queue with given index as an empty one. Destroys the old one, if there was any.
+    /// </summary>
+    void make_queue(segment_id_t queue_index) {
+        pool->destroy_queue(get_queue(queue_index), get_counters(queue_index));
+        *get_queue(queue_index) = pool->make_queue();
+        on_operation_done();
+    }
+    /// <summary>
+    /// Same as `queue_pool_t::destroy_queue()`.
+    /// </summary>
+    void destroy_queue(segment_id_t queue_index) {
+        pool->destroy_queue(get_queue(queue_index), get_counters(queue_index));
+        on_operation_done();
+    }
+    /// <summary>
+    /// Same as `queue_pool_t::try_enqueue_bytes()`.
+    /// </summary>
+    bool try_enqueue_bytes(segment_id_t queue_index, const byte_t* data, buffersize_t count) {
+        if (!pool->try_enqueue_bytes(get_queue(queue_index), data, count, get_counters(queue_index))) return false;
+        on_operation_done();
+        return true;
+    }
+    /// <summary>
+    /// Same as `queue_pool_t::try_dequeue_bytes()`.
+    /// </summary>
+    buffersize_t try_dequeue_bytes(segment_id_t queue_index, byte_t* out_data, buffersize_t max_count) {
+        auto ret = pool->try_dequeue_bytes(get_queue(queue_index), out_data, max_count, get_counters(queue_index));
+        if (ret > 0) on_operation_done();
+        return ret;
+    }
+    buffersize_t size(segment_id_t queue_index) { return pool->size(*get_counters(queue_index)); }
+
+private:
+    struct superblock_t {
+        std::uint64_t magic;
+        std::uint32_t version;
+        std::uint32_t queues_count;
+        std::uint64_t file_size;
+        //everything the layout of the pool's buffer depends on
+        std::uint32_t header_size_bytes;
+        std::uint32_t block_size_bytes;
+        std::uint64_t addressable_blocks_count;
+        std::uint64_t max_segment_length;
+        //two policies might agree on all the sizes above and still encode headers differently
+        std::uint64_t policy_tag;
+        std::uint32_t block_alignment;
+        std::uint32_t queue_handle_size;
+        std::uint32_t queue_counters_size;
+        std::uint8_t use_multiblock_segments;
+        std::uint8_t use_free_block_bitmap;
+        std::uint8_t use_lock_free_block_stack;
+        std::uint8_t is_open;
+        std::uint16_t ready_slots_count;
+
+        queue_pool_options_t get_options()const {
+            return queue_pool_options_t{ .use_multiblock_segments = (bool)use_multiblock_segments, .use_free_block_bitmap = (bool)use_free_block_bitmap,
+                .use_lock_free_block_stack = (bool)use_lock_free_block_stack, .ready_slots_count = ready_slots_count };
+        }
+        bool has_same_layout(const superblock_t& other)const {
+            return header_size_bytes == other.header_size_bytes && block_size_bytes == other.block_size_bytes
+                && addressable_blocks_count == other.addressable_blocks_count && max_segment_length == other.max_segment_length
+                && policy_tag == other.policy_tag && block_alignment == other.block_alignment 
+                && queue_handle_size == other.queue_handle_size && queue_counters_size == other.queue_counters_size;
+        }
+    };
+
+    std::optional<pool_t> pool;
+    byte_t* mapping = nullptr;
+    buffersize_t mapping_size = 0;
+    buffersize_t sync_batch = 0;
+    buffersize_t unsynced_operations_count = 0;
+    bool was_clean = true;
+
+    static superblock_t make_superblock(segment_id_t queues_count, queue_pool_options_t options, TMemoryPolicy policy) {
+        return superblock_t{
+            .magic = 0, .version = FORMAT_VERSION, .queues_count = queues_count, .file_size = 0,
+            .header_size_bytes = (std::uint32_t)TMemoryPolicy::get_header_size_bytes(), .block_size_bytes = (std::uint32_t)policy.get_block_size_bytes(),
+            .addressable_blocks_count = TMemoryPolicy::get_addressable_blocks_count(), .max_segment_length = TMemoryPolicy::get_max_segment_length(),
+            .policy_tag = TMemoryPolicy::get_policy_tag(), .block_alignment = (std::uint32_t)get_block_alignment(), .queue_handle_size = sizeof(queue_handle_t),
+            .queue_counters_size = sizeof(queue_counters_t),
+            .use_multiblock_segments = options.use_multiblock_segments, .use_free_block_bitmap = options.use_free_block_bitmap,
+            .use_lock_free_block_stack = options.use_lock_free_block_stack, .is_open = 0, .ready_slots_count = options.ready_slots_count
+        };
+    }
+    static constexpr buffersize_t get_block_alignment() {
+        if constexpr (requires{ TMemoryPolicy::get_block_alignment(); }) return TMemoryPolicy::get_block_alignment();
+        else return 1;
+    }
+    //handle table right after the superblock, counters table after it, pool's buffer on the next cache line after that (mapping itself is page-aligned, so the pool's layout comes out the same in every process)
+    static buffersize_t get_handles_offset() { return math::round_up<buffersize_t>(sizeof(superblock_t), alignof(queue_handle_t)); }
+    static buffersize_t get_counters_offset(segment_id_t queues_count) { return math::round_up<buffersize_t>(get_handles_offset() + queues_count * sizeof(queue_handle_t), alignof(queue_counters_t)); }
+    static buffersize_t get_pool_offset(segment_id_t queues_count) { return math::round_up<buffersize_t>(get_counters_offset(queues_count) + queues_count * sizeof(queue_counters_t), 64); }
+
+    superblock_t* get_superblock() { return reinterpret_cast<superblock_t*>(mapping); }
+    queue_handle_t* get_handles() { return reinterpret_cast<queue_handle_t*>(mapping + get_handles_offset()); }
+    queue_counters_t* get_counters_table() { return reinterpret_cast<queue_counters_t*>(mapping + get_counters_offset(get_superblock()->queues_count)); }
+
+    bool map(int fd, buffersize_t size) {
+        void* ret = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ret == MAP_FAILED) return false;
+        mapping = reinterpret_cast<byte_t*>(ret);
+        mapping_size = size;
+        return true;
+    }
+    void unmap() {
+        pool.reset();
+        ::munmap(mapping, mapping_size);
+        mapping = nullptr;
+        mapping_size = 0;
+    }
+    void on_operation_done() {
+        ++unsynced_operations_count;
+        if (sync_batch > 0 && unsynced_operations_count >= sync_batch) sync();
+    }
+};
+
+}
+
+#endif
+
+#endif
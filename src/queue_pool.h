@@ -2,23 +2,70 @@
 #define QUEUE_POOL__guard___fds4g89dfv46ds51d6a4d9as4d6sagr
 
 #include<algorithm>
+#include<array>
+#include<atomic>
+#include<chrono>
+#include<cstdint>
+#include<cstring>
+#include<span>
+#include<thread>
 
 #include "basic_definitions.h"
+#include "utils/bitmap.h"
 #include "utils/linked_list.h"
 #include "utils/math_utils.h"
 #include "memory_policy.h"
 
+#if __has_include(<sys/uio.h>)
+#include<sys/uio.h>
+#define QUEUE_POOL_FD_IO_SUPPORTED
+#endif
+
+#if __has_include(<linux/futex.h>) && __has_include(<sys/syscall.h>)
+#include<ctime>
+#include<linux/futex.h>
+#include<sys/syscall.h>
+#include<unistd.h>
+#define QUEUE_POOL_FUTEX_SUPPORTED
+#endif
+
 
 
 namespace markussecundus::queue_pooling{
     using namespace markussecundus::utils;
 
+/// <summary>
+/// Optional features of a queue_pool_t that are decided when it's constructed.
+/// Must be the same for every queue_pool_t instance that is constructed over the same buffer.
+/// </summary>
+struct queue_pool_options_t {
+    /// when queue depletes space in its current block and there is a free block directly on its right, 
+    ///  it grows into it instead of allocating the next block that's in line in free list (saving header overhead)
+    bool use_multiblock_segments = false;
+    /// keep a bitmap with 1 bit per block marking which blocks are free, stored in the pool's header area
+    ///  - neighbour checks and searches for free space don't need to touch the (cold) headers of the blocks themselves
+    ///  - destroy_queue then needs to mark all the segments of the destroyed queue in the bitmap, thus is no longer O(1)
+    bool use_free_block_bitmap = false;
+    /// keep single blocks released by queues in a lock-free stack (stored in the pool's header area), that queues also allocate single blocks from
+    ///  - any thread can take/return blocks without taking the pool's lock; the lock is needed only once the stack runs empty
+    ///  - operations on regular queues then take the pool's lock themselves whenever they need the free list (stack ran empty, growing into the block to the right, destroy_queue)
+    ///    and must be called without holding it - different threads can create and grow their own queues in parallel
+    ///  - multiblock segments are then used only together with the free block bitmap, so that checks of the block to the right never read a header owned by another thread
+    ///  - blocks in the stack are counted as free, but are not part of the free list - `flush_block_stack()` moves them there
+    ///  - costs 4 bytes per block - the stack links its blocks through a separate array instead of their headers, so that they can be accessed atomically
+    bool use_lock_free_block_stack = false;
+    /// keep a bitmap of "ready slots" (stored in the pool's header area) - a queue whose counters were created by `queue_counters_t(ready_slot)` has its slot's bit set IFF it's not empty
+    ///  - `poll_ready()` then finds all queues with data by scanning the bitmap a whole word at a time, instead of checking every handle
+    std::uint16_t ready_slots_count = 0;
+};
+
 /// <summary>
 /// Builds a collection of FIFO queues on top of a provided bytearray. Provides functionality to create/destroy a queue 
 /// and to enqueue/dequeue bytes into/from a specific queue.
 /// 
 /// Queues are implemented as linked lists of fixed-size blocks with user specified block size. 
 /// Each block has an overhead of a header - by default 4 bytes, but different encoding can be provided as template parameter.
+/// (e.g. `wide16_memory_policy`/`wide32_memory_policy` for pools with more than 254 blocks)
 /// Manual tweaking of block size and header is advised to achieve the best memory efficiency in specific usecase.
 /// 
 /// 
@@ -27,15 +74,15 @@ namespace markussecundus::queue_pooling{
 ///       it grows into it, saving header overhead, instead of allocating the next block that's in line in free list.
 ///     - in practice doesn't seem to always perform better than not doing it - tweaking required
 ///     - switchable by the use_multiblock_segments constructor argument.
+/// Other optional features are listed in queue_pool_options_t.
 ///  
 /// Performance analysis...
-///   Enqueue/dequeue and create_queue are guaranteed to finish in O(1) time. 
-///   Destroy queue must iterate through all the segments to mark them as free, thus O(n) time, albeit with quite nice constants (dependent on block size). 
+///   Enqueue/dequeue, create_queue and destroy_queue are guaranteed to finish in O(1) time (destroy_queue only if it gets the queue's counters, see `queue_counters_t`). 
 ///   
-///   For future consideration: destroy_queue could be made run in O(1) time 
-///    - the linked list operation to add a queue to free_list is O(1) by itself, bottleneck is the marking of segments as free.
-///       Getting rid of it might make sense, but it would prevent us from doing the multiblock_segment optimization 
-///       (there would be no O(1) way of telling if a block directly to another block's right is a free_list block? (maybe could be done efficiently with union-find??)).
+///   Destroy queue just splices the whole queue into the free list, without marking its segments as free.
+///    - segments get normalized (marked as free, begin/length reset) lazily, once they are popped from the free list by an allocation.
+///    - the multiblock_segment optimization only recognizes segments that are already marked as free, 
+///       so a block released by destroy_queue can't be grown into until it has been allocated and released again - that's a missed opportunity, never an error.
 /// </summary>
 /// <typeparam name="TMemoryPolicy">Object specifying details about how memory shall be handled (block size, header encoding etc.) by a queue pool.</typeparam>
 template<memory_policies::memory_policy TMemoryPolicy= memory_policies::standard_memory_policy>
@@ -48,7 +95,7 @@ public:
     struct queue_handle_t {
 
         queue_handle_t() : queue_handle_t(uninitialized().get_segment_id()) {}
-        queue_handle_t(segment_id_t segment_id_) :segment_id(segment_id_) {}
+        queue_handle_t(segment_id_t segment_id_) :segment_id((packed_segment_id_t)segment_id_) {}
 
         static constexpr queue_handle_t from_header(typename queue_pool_t::header_view_t h) {
             return h.is_valid() ? queue_handle_t(h.get_segment_id()) : queue_handle_t::error();
@@ -65,25 +112,283 @@ public:
         bool is_valid() { return !(is_empty() || is_uninitialized()); }
         static constexpr segment_id_t SPECIAL_VALUES_COUNT = 2;
     private:
+        friend class queue_pool_t;
         packed_segment_id_t segment_id;
     };
 
+    /// <summary>
+    /// Counters of a queue that the pool keeps up to date, so that the queue's length and blocks count are known in O(1) time.
+    /// 
+    /// Kept apart from the handle, so that handles stay as small as a packed segment id and copies of a handle don't carry counters that go stale 
+    /// - the owner of the queue stores them wherever it likes (e.g. in a table indexed the same way as its handles) and passes a pointer to them to every operation on the queue.
+    /// Counters that miss an operation are no longer accurate. Functions of the pool that don't get the counters compute what they need from the headers instead.
+    /// </summary>
+    struct queue_counters_t {
+        queue_counters_t() = default;
+        /// <summary>
+        /// Counters of a new queue whose emptiness is tracked by a slot of the ready bitmap (see `queue_pool_options_t::ready_slots_count`).
+        /// A slot must not be shared by multiple queues at once.
+        /// </summary>
+        explicit queue_counters_t(std::uint16_t ready_slot_) : ready_slot(ready_slot_) {}
+
+        /// <summary>
+        /// How many bytes the queue holds.
+        /// </summary>
+        buffersize_t get_length()const { return length; }
+        /// <summary>
+        /// How many blocks the queue occupies (including the ones reserved but not committed yet).
+        /// </summary>
+        buffersize_t get_blocks_count()const { return blocks_count; }
+        std::uint16_t get_ready_slot()const { return ready_slot; }
+
+        static constexpr std::uint16_t NO_READY_SLOT = ~std::uint16_t(0);
+    private:
+        friend class queue_pool_t;
+        std::uint32_t length = 0;
+        packed_segment_id_t blocks_count = 0;
+        //bit of the ready bitmap tracking whether this queue is empty (fits into padding of the counters with the standard memory policy)
+        std::uint16_t ready_slot = NO_READY_SLOT;
+    };
+
+    /// <summary>
+    /// Queue handle that, on top of the plain one, caches ids of the queue's first and last segment and positions of its first and last byte,
+    /// so that `try_enqueue_byte`/`try_dequeue_byte` don't need to decode any header unless they cross a block boundary.
+    /// 
+    /// Headers of the queue are left outdated in the meantime - `release_fat_handle()` brings them up to date and must be called before the queue is accessed 
+    /// by anything else than the fat handle functions and `compact(step_budget, std::span<fat_queue_handle_t>)`.
+    /// 
+    /// Invariant: cached positions never change which blocks the queue occupies - the fast paths only move the first/last byte within the block 
+    /// the header's own begin/length already end in, anything that crosses a block boundary goes through the headers.
+    /// Block counts derived from the outdated headers thus stay exact, and compaction (which moves whole blocks and copies the header fields as they are)
+    /// keeps the cached offsets valid - only the cached segment ids need to be updated, which is what the fat `compact()` overload does.
+    /// Takes ~16 bytes instead of the 1 byte id of the plain handle.
+    /// </summary>
+    struct fat_queue_handle_t {
+    private:
+        friend class queue_pool_t;
+        queue_handle_t handle;
+        packed_segment_id_t tail_id = 0;
+        //position of the next byte to be dequeued, relative to the first segment's data
+        std::uint32_t head_read_offset = 0;
+        //end of the first segment's data (meaningful only if the queue has more than 1 segment - end of the last segment is `tail_write_offset` instead)
+        std::uint32_t head_end_offset = 0;
+        //position where the next enqueued byte goes, relative to the last segment's data
+        std::uint32_t tail_write_offset = 0;
+    };
+
+    /// <summary>
+    /// Queue in the single-producer/single-consumer mode - one thread may enqueue into it while another one dequeues from it, with no locking.
+    /// 
+    /// Unlike regular queues, it's a plain chain of single-block segments linked only by their `next` ids, whose positions are kept here instead of in the headers. 
+    /// Producer writes the data and links new blocks first and only then publishes the new total count of enqueued bytes with release semantics, 
+    /// consumer reads it with acquire semantics, so it never sees a byte or a link that was not fully written yet.
+    /// Only allocation and release of blocks goes through the pool's lock.
+    /// 
+    /// Must stay at the same address while in use. Not to be used with anything else than the spsc functions (and `size()`).
+    /// </summary>
+    struct spsc_queue_t {
+    private:
+        friend class queue_pool_t;
+        static constexpr std::size_t CACHE_LINE_SIZE = 64;
+        //owned by the producer
+        alignas(CACHE_LINE_SIZE) segment_id_t tail_id = 0;
+        buffersize_t tail_write_offset = 0;
+        std::atomic<std::uint64_t> enqueued_count = 0;
+        //owned by the consumer
+        alignas(CACHE_LINE_SIZE) segment_id_t head_id = 0;
+        buffersize_t head_read_offset = 0;
+        std::atomic<std::uint64_t> dequeued_count = 0;
+        //futex word - set by the consumer when it goes to sleep in `dequeue_wait()`, reset by whoever wakes it; 
+        //on its own cache line, as the producer reads it after every enqueue while the consumer rarely writes it
+        alignas(CACHE_LINE_SIZE) std::uint32_t consumer_sleeping = 0;
+    };
+
+    /// <summary>
+    /// Zero-copy view of a message dequeued by `try_dequeue_message()` - its payload as a list of spans pointing right into the queue's segments.
+    /// Stays valid until `release_message()` is called; the queue must not be dequeued from, destroyed or compacted in the meantime.
+    /// </summary>
+    struct message_view_t {
+        static constexpr buffersize_t MAX_SPANS = 8;
+        /// <summary>
+        /// Length of the payload in bytes.
+        /// </summary>
+        buffersize_t size()const { return length; }
+        std::span<const std::span<const byte_t>> get_spans()const { return std::span(spans.data(), spans_count); }
+    private:
+        friend class queue_pool_t;
+        std::array<std::span<const byte_t>, MAX_SPANS> spans;
+        buffersize_t spans_count = 0;
+        buffersize_t length = 0;
+        //payload + length prefix
+        buffersize_t frame_length = 0;
+    };
+
+    /// <summary>
+    /// Small cache of blocks, owned by a single thread and passed to the spsc functions and regular queue operations it calls.
+    /// 
+    /// Blocks are taken from the pool's free list (or the lock-free block stack) and returned to it in batches, 
+    /// so that most block allocations/releases done by the thread don't touch any shared state.
+    /// For regular queues this pays off only with the lock-free block stack, where operations on queues of different threads run concurrently
+    /// - without it, every operation holds the pool's lock as a whole anyway.
+    /// Cached blocks count as used by the pool - `flush_magazine()` returns them, e.g. before the thread exits.
+    /// </summary>
+    struct block_magazine_t {
+        static constexpr buffersize_t CAPACITY = 32;
+        buffersize_t size()const { return count; }
+    private:
+        friend class queue_pool_t;
+        //cached blocks stay linked into a list through their own headers - a batch then moves in or out by splicing lists, 
+        //instead of every block being unlinked into an array of ids and relinked later
+        segment_id_t head = queue_handle_t::empty().get_segment_id();
+        buffersize_t count = 0;
+    };
+
+    /// <summary>
+    /// Array of blocks shared by several pools (e.g. shards of `sharded_queue_pool_t`), each of them owning a part of it.
+    /// Segment ids are global to the whole array, so free blocks can be handed over between the pools by `donate_free_blocks()`.
+    /// </summary>
+    struct shared_blocks_t {
+        //must be aligned as required by the memory policy
+        byte_t* blocks;
+        segment_id_t blocks_count;
+    };
+
 
 
     template<typename ...Args>
     queue_pool_t(byte_t* buffer_, buffersize_t buffer_size_, bool use_multiblock_segments_, Args ...args) 
+        : queue_pool_t(buffer_, buffer_size_, queue_pool_options_t{ .use_multiblock_segments = use_multiblock_segments_ }, args...)
+        {}
+
+    template<typename ...Args>
+    queue_pool_t(byte_t* buffer_, buffersize_t buffer_size_, queue_pool_options_t options_, Args ...args)
         : TMemoryPolicy(args...)
         , buffer(reinterpret_cast<buffer_view_t*>(buffer_))
-        , buffer_size(buffer_size_ - sizeof(buffer_view_t::header))
-        , use_multiblock_segments(use_multiblock_segments_) 
-        {}
+        , use_multiblock_segments(options_.use_multiblock_segments && (!options_.use_lock_free_block_stack || options_.use_free_block_bitmap))
+    {
+        //header area (free list etc.) | ready bitmap (optional) | lock-free block stack + its links (optional) | free block bitmap (optional) | memory policy's side table (optional) | alignment padding (optional) | blocks...
+        buffersize_t buffer_size = buffer_size_ - sizeof(buffer_view_t::header) - (get_block_alignment() - 1); //worst case padding
+        metadata_data = buffer->data;
+        if (options_.ready_slots_count > 0) {
+            ready_bitmap = bitmaps::bitmap_view_t(metadata_data, options_.ready_slots_count);
+            metadata_data += bitmaps::bitmap_view_t::get_required_bytes(options_.ready_slots_count);
+            buffer_size -= bitmaps::bitmap_view_t::get_required_bytes(options_.ready_slots_count);
+        }
+        if (options_.use_lock_free_block_stack) {
+            metadata_data += (alignof(block_stack_t) - reinterpret_cast<std::uintptr_t>(metadata_data) % alignof(block_stack_t)) % alignof(block_stack_t);
+            block_stack = reinterpret_cast<block_stack_t*>(metadata_data);
+            metadata_data += sizeof(block_stack_t);
+            buffer_size -= sizeof(block_stack_t) + alignof(block_stack_t) - 1;
+        }
+        buffersize_t bytes_per_block = get_block_size_bytes() + get_side_table_bytes_per_block() + (block_stack ? sizeof(block_stack_link_t) : 0);
+        total_blocks_count = (segment_id_t)std::min<buffersize_t>(TMemoryPolicy::get_addressable_blocks_count() - queue_handle_t::SPECIAL_VALUES_COUNT, buffer_size / bytes_per_block);
+        buffersize_t free_block_bitmap_size = 0;
+        if (options_.use_free_block_bitmap) {
+            free_block_bitmap_size = bitmaps::bitmap_view_t::get_required_bytes(total_blocks_count);
+            total_blocks_count = (segment_id_t)std::min<buffersize_t>(total_blocks_count, (buffer_size - free_block_bitmap_size) / bytes_per_block);
+        }
+        if (block_stack) { //right behind the stack, which is aligned more than enough for them
+            block_stack_links = reinterpret_cast<block_stack_link_t*>(metadata_data);
+            metadata_data += total_blocks_count * sizeof(block_stack_link_t);
+        }
+        if (options_.use_free_block_bitmap)
+            free_block_bitmap = bitmaps::bitmap_view_t(metadata_data, total_blocks_count);
+        if constexpr (has_side_table())
+            TMemoryPolicy::set_side_table(metadata_data + free_block_bitmap_size, total_blocks_count);
+        blocks_data = metadata_data + free_block_bitmap_size + total_blocks_count * get_side_table_bytes_per_block();
+        blocks_data += (get_block_alignment() - reinterpret_cast<std::uintptr_t>(blocks_data) % get_block_alignment()) % get_block_alignment();
+        owned_blocks_count = total_blocks_count;
+    }
+
+    /// <summary>
+    /// Constructs one of several pools sharing a single array of blocks. `buffer_` holds just the pool's own header area (see `get_shared_header_area_bytes()`).
+    /// The pool owns no blocks until `init(first_block, blocks_count)` gets called.
+    /// 
+    /// Headers of blocks owned by other pools can't be told apart from the pool's own ones, so without the free block bitmap 
+    /// neither multiblock segments nor merges of neighbouring free segments happen, and `compact()` is never supported.
+    /// Lock-free block stack is not supported (the option is ignored), neither are memory policies with a side table.
+    /// </summary>
+    template<typename ...Args>
+    queue_pool_t(byte_t* buffer_, shared_blocks_t shared_blocks_, queue_pool_options_t options_, Args ...args)
+        : TMemoryPolicy(args...)
+        , buffer(reinterpret_cast<buffer_view_t*>(buffer_))
+        , use_multiblock_segments(options_.use_multiblock_segments)
+    {
+        static_assert(!has_side_table(), "Side table would have to be shared by all the pools as well");
+        //header area (free list etc.) | ready bitmap (optional) | free block bitmap over the whole shared array (optional)
+        metadata_data = buffer->data;
+        if (options_.ready_slots_count > 0) {
+            ready_bitmap = bitmaps::bitmap_view_t(metadata_data, options_.ready_slots_count);
+            metadata_data += bitmaps::bitmap_view_t::get_required_bytes(options_.ready_slots_count);
+        }
+        if (options_.use_free_block_bitmap)
+            free_block_bitmap = bitmaps::bitmap_view_t(metadata_data, shared_blocks_.blocks_count);
+        blocks_data = shared_blocks_.blocks;
+        total_blocks_count = shared_blocks_.blocks_count;
+        owned_blocks_count = 0;
+        shares_blocks = true;
+    }
+    /// <summary>
+    /// How many bytes the header area of a pool sharing an array of `blocks_count` blocks with other pools takes.
+    /// </summary>
+    static constexpr buffersize_t get_shared_header_area_bytes(segment_id_t blocks_count, queue_pool_options_t options) {
+        return sizeof(buffer_view_t::header) + bitmaps::bitmap_view_t::get_required_bytes(options.ready_slots_count)
+            + (options.use_free_block_bitmap ? bitmaps::bitmap_view_t::get_required_bytes(blocks_count) : 0);
+    }
+    /// <summary>
+    /// Alignment that the memory policy requires for the start of every block.
+    /// </summary>
+    static constexpr buffersize_t get_block_alignment() {
+        if constexpr (requires{ TMemoryPolicy::get_block_alignment(); }) return TMemoryPolicy::get_block_alignment();
+        else return 1;
+    }
 
     /// <summary>
     /// Initializes the pool. Should be called before it's used for the first time.
     /// </summary>
-    void init(){
-        buffer->header.free_list = init_free_list();
+    void init(){ init(0, get_total_blocks_count()); }
+    /// <summary>
+    /// Initializes a pool sharing its blocks with other pools (see `shared_blocks_t`), making it the owner of a range of them. 
+    /// Ranges owned by the pools must not overlap.
+    /// </summary>
+    void init(segment_id_t first_block, buffersize_t blocks_count){
+        if (free_block_bitmap.is_valid())
+            free_block_bitmap.clear();
+        if (ready_bitmap.is_valid())
+            ready_bitmap.clear();
+        buffer->header.free_list = init_free_list(first_block, blocks_count);
+        owned_blocks_count = (segment_id_t)blocks_count;
+        buffer->header.lock = 0;
+        if (block_stack) {
+            block_stack->top = make_block_stack_word(0, queue_handle_t::empty().get_segment_id());
+            block_stack->blocks_count = 0;
+        }
     }
+    /// <summary>
+    /// Takes over a buffer that was already initialized by `init()` and used by another pool instance - e.g. one persisted in a file by a previous run of the process.
+    /// Free list, segment links and all the queues are kept as they are, only the lock gets reset (its holder is gone).
+    /// The buffer must be at the same alignment and the pool constructed with the same options and memory policy parameters as the original one.
+    /// Runs in O(1) time.
+    /// </summary>
+    void attach() {
+        buffer->header.lock = 0;
+    }
+
+    /// <summary>
+    /// Acquires the pool's spinlock. Needed only if the pool is accessed from multiple threads (spsc queues, shards of `sharded_queue_pool_t`) 
+    /// - all the other functions of the pool must then be called while holding it (e.g. through `std::lock_guard`),
+    /// except for operations on regular queues with the lock-free block stack enabled, which take it themselves.
+    /// </summary>
+    void lock() {
+        std::atomic_ref<std::uint8_t> flag(buffer->header.lock);
+        while (flag.exchange(1, std::memory_order_acquire))
+            while (flag.load(std::memory_order_relaxed))
+                std::this_thread::yield();
+    }
+    /// <summary>
+    /// Releases the pool's spinlock.
+    /// </summary>
+    void unlock() { std::atomic_ref<std::uint8_t>(buffer->header.lock).store(0, std::memory_order_release); }
 
 
     /// <summary>
@@ -95,60 +400,848 @@ public:
         return queue_handle_t::empty();
     }
     /// <summary>
-    /// Tries to enqueue a byte into a queue. 
-    /// Can fail e.g. because running out of memory.
+    /// Calls `callback(ready_slot)` for every slot of the ready bitmap whose queue is not empty, in ascending order.
+    /// The callback may freely dequeue from/enqueue into the reported queues.
+    /// With the lock-free block stack enabled, queues with ready slots must not be operated by other threads meanwhile.
+    /// 
+    /// Runs in O(ready_slots_count / 64 + number of ready queues) time.
+    /// </summary>
+    /// <returns>How many ready queues were reported</returns>
+    template<std::invocable<std::uint16_t> TFunc>
+    buffersize_t poll_ready(TFunc callback) {
+        if (!ready_bitmap.is_valid()) return 0;
+        buffersize_t ret = 0;
+        for (auto slot = ready_bitmap.find_first_set(0); slot < ready_bitmap.size(); slot = ready_bitmap.find_first_set(slot + 1), ++ret)
+            callback((std::uint16_t)slot);
+        return ret;
+    }
+    /// <summary>
+    /// How many bytes are stored in a queue, read from its counters.
+    /// Runs in O(1) time.
+    /// </summary>
+    buffersize_t size(const queue_counters_t& counters) { return counters.get_length(); }
+    /// <summary>
+    /// How many bytes are stored in a queue, summed over the headers of its segments - for queues whose counters are not kept.
+    /// Runs in O(number of the queue's segments) time.
+    /// </summary>
+    buffersize_t size(queue_handle_t handle) {
+        if (!handle.is_valid()) return 0;
+        buffersize_t ret = 0;
+        ll().for_each(get_header(handle.get_segment_id()), [&](header_view_t segment) { ret += segment.get_segment_length(); });
+        return ret;
+    }
+    /// <summary>
+    /// How many blocks are currently occupied by queues (including space reserved but not committed yet).
+    /// Runs in O(1) time.
+    /// </summary>
+    buffersize_t used_blocks() { return owned_blocks_count - free_blocks(); }
+    /// <summary>
+    /// How many blocks are available for allocation.
+    /// With the lock-free block stack enabled, blocks in the stack are included - spsc queues take/return those without the pool's lock, 
+    /// so while they are active, the value is only a snapshot (the pool itself never relies on it for accounting).
+    /// Runs in O(1) time.
+    /// </summary>
+    buffersize_t free_blocks() {
+        if (block_stack) return buffer->header.free_blocks_count + std::atomic_ref(block_stack->blocks_count).load(std::memory_order_relaxed);
+        return buffer->header.free_blocks_count;
+    }
+    /// <summary>
+    /// How many bytes of the buffer are lost to the block alignment required by the memory policy 
+    /// (the worst case padding of `alignment - 1` bytes held back in front of the first block - whatever part of it the actual padding doesn't use stays unused - 
+    /// + rounding up the size of every block).
+    /// </summary>
+    buffersize_t get_alignment_loss_bytes() {
+        buffersize_t ret = get_block_alignment() - 1;
+        if constexpr (requires{ TMemoryPolicy::get_block_alignment(); })
+            ret += get_total_blocks_count() * (get_block_size_bytes() - TMemoryPolicy::get_unaligned_block_size_bytes());
+        return ret;
+    }
+    /// <summary>
+    /// Tries to enqueue a byte into a queue. 
+    /// Can fail e.g. because running out of memory.
+    /// 
+    /// Runs in O(1) time.
+    /// </summary>
+    /// <param name="handle_ptr">Pointer to the queue handle. Value pointed to might get updated in the process of this function.</param>
+    /// <param name="to_enqueue">Byte to enqueue.</param>
+    /// <param name="counters">Counters of the queue to be kept up to date, if the caller keeps them</param>
+    /// <param name="magazine">Calling thread's magazine to allocate blocks from, if it keeps one</param>
+    /// <returns>Whether the operation was successfull (didn't fail due to out-of-memory etc.)</returns>
+    bool try_enqueue_byte(queue_handle_t* handle_ptr, byte_t to_enqueue, queue_counters_t* counters = nullptr, block_magazine_t* magazine = nullptr) {
+        auto head = get_header(handle_ptr->get_segment_id());
+        std::ptrdiff_t blocks_delta = 0;
+        byte_t* new_byte;
+        if (try_grow_queue_by_1(&head, &blocks_delta, magazine) && try_peak_front(head, &new_byte)) {
+            *new_byte = to_enqueue;
+            update_handle(handle_ptr, counters, head, +1, blocks_delta);
+            return true;
+        }
+        return false;
+    }
+    /// <summary>
+    /// Tries to dequeue a byte from a queue.
+    /// Will fail if there is nothing left in the provided queue.
+    /// 
+    /// Runs in O(1) time.
+    /// </summary>
+    /// <param name="handle_ptr">Pointer to the queue handle. Value pointed to might get updated in the process of this function.</param>
+    /// <param name="out_byte">Byte that was dequeued</param>
+    /// <param name="counters">Counters of the queue to be kept up to date, if the caller keeps them</param>
+    /// <param name="magazine">Calling thread's magazine to release blocks into, if it keeps one</param>
+    /// <returns>Whether the operation was successfull (there was still something to dequeue)</returns>
+    bool try_dequeue_byte(queue_handle_t* handle_ptr, byte_t* out_byte, queue_counters_t* counters = nullptr, block_magazine_t* magazine = nullptr) {
+        if (!handle_ptr->is_valid())
+            return false;
+
+        auto head = get_header(handle_ptr->get_segment_id());
+
+        byte_t* back_ref;
+        if (!try_peak_back(head, &back_ref)) return false;
+        *out_byte = *back_ref;
+        std::ptrdiff_t blocks_delta = 0;
+        if (try_shrink_queue_by_1(&head, &blocks_delta, magazine)) {
+            update_handle(handle_ptr, counters, head, -1, blocks_delta);
+            return true;
+        }
+        return false;
+    }
+    /// <summary>
+    /// Tries to enqueue a whole span of bytes into a queue. 
+    /// Either all the bytes get enqueued, or none of them are (e.g. because running out of memory) and the queue stays untouched.
+    /// 
+    /// Runs in O(n) time, but the data gets copied by a single memcpy per segment and headers are touched only once per segment.
+    /// </summary>
+    /// <param name="handle_ptr">Pointer to the queue handle. Value pointed to might get updated in the process of this function.</param>
+    /// <param name="data">Bytes to enqueue.</param>
+    /// <param name="count">How many bytes to enqueue.</param>
+    /// <param name="counters">Counters of the queue to be kept up to date, if the caller keeps them</param>
+    /// <param name="magazine">Calling thread's magazine to allocate blocks from, if it keeps one</param>
+    /// <returns>Whether the operation was successfull (didn't fail due to out-of-memory etc.)</returns>
+    bool try_enqueue_bytes(queue_handle_t* handle_ptr, const byte_t* data, buffersize_t count, queue_counters_t* counters = nullptr, block_magazine_t* magazine = nullptr) {
+        if (count <= 0) return true;
+
+        auto head = get_header(handle_ptr->get_segment_id());
+        back_reservation_t reservation;
+        if (!try_reserve_back(head, count, &reservation, false, magazine))
+            return false;
+
+        for_each_reserved_span(reservation, count, [&](byte_t* span, buffersize_t span_length) {
+            std::memcpy(span, data, span_length);
+            data += span_length;
+            });
+        std::ptrdiff_t blocks_delta = 0;
+        head = commit_back(head, &reservation, count, &blocks_delta);
+        update_handle(handle_ptr, counters, head, (std::ptrdiff_t)count, blocks_delta);
+        return true;
+    }
+    /// <summary>
+    /// Dequeues up to `max_count` bytes from a queue into a caller provided buffer.
+    /// Data is copied by a single memcpy per segment, blocks that got fully consumed are released to the free list all at once at the end.
+    /// 
+    /// Runs in O(n) time.
+    /// </summary>
+    /// <param name="handle_ptr">Pointer to the queue handle. Value pointed to might get updated in the process of this function.</param>
+    /// <param name="out_data">Buffer to be filled with the dequeued bytes</param>
+    /// <param name="max_count">Capacity of the `out_data` buffer</param>
+    /// <param name="counters">Counters of the queue to be kept up to date, if the caller keeps them</param>
+    /// <param name="magazine">Calling thread's magazine to release blocks into, if it keeps one</param>
+    /// <returns>How many bytes were dequeued (0 if the queue was empty)</returns>
+    buffersize_t try_dequeue_bytes(queue_handle_t* handle_ptr, byte_t* out_data, buffersize_t max_count, queue_counters_t* counters = nullptr, block_magazine_t* magazine = nullptr) {
+        if (!handle_ptr->is_valid())
+            return 0;
+
+        auto head = get_header(handle_ptr->get_segment_id());
+        std::ptrdiff_t blocks_delta = 0;
+        auto ret = consume_front(&head, max_count, &blocks_delta, [&](const byte_t* run, buffersize_t run_length) {
+            std::memcpy(out_data, run, run_length);
+            out_data += run_length;
+            }, magazine);
+        update_handle(handle_ptr, counters, head, -(std::ptrdiff_t)ret, blocks_delta);
+        return ret;
+    }
+    /// <summary>
+    /// Hands out a writable span of free memory directly behind the last byte of a queue, so that data can be produced right into the pool.
+    /// Nothing becomes part of the queue until `commit()` is called.
+    /// 
+    /// The span always lies in a single segment - if there is not at least `min_count` bytes left in the queue's last block, 
+    /// a fresh block gets allocated and appended to the queue as an empty segment.
+    /// Another call to reserve() without committing in between just returns the same (possibly bigger) span again.
+    /// 
+    /// Runs in O(1) time.
+    /// </summary>
+    /// <param name="handle_ptr">Pointer to the queue handle. Value pointed to might get updated in the process of this function.</param>
+    /// <param name="min_count">Min size of the span. Must not exceed what fits into a single empty block.</param>
+    /// <param name="max_count">Max size of the span</param>
+    /// <param name="counters">Counters of the queue to be kept up to date, if the caller keeps them</param>
+    /// <returns>The reserved span, empty if the reservation failed (out-of-memory or `min_count` too big)</returns>
+    std::span<byte_t> reserve(queue_handle_t* handle_ptr, buffersize_t min_count, buffersize_t max_count, queue_counters_t* counters = nullptr) {
+        auto head = get_header(handle_ptr->get_segment_id());
+        if (head.is_valid()) {
+            auto tail = ll().last(head);
+            auto free_space = get_free_space_of_segment(tail);
+            if (free_space > 0 && free_space >= min_count)
+                return std::span<byte_t>(&tail.get_segment_data()[tail.get_segment_begin() + tail.get_segment_length()], std::min(free_space, max_count));
+        }
+
+        if (min_count > get_block_size_bytes() - get_header_size_bytes())
+            return {};
+        auto new_block = alloc_block();
+        if (!new_block.is_valid())
+            return {};
+        new_block.set_segment_length(0);
+        update_handle(handle_ptr, counters, ll().prepend_list(head, new_block), 0, +1);
+        return std::span<byte_t>(new_block.get_segment_data(), std::min(get_free_space_of_segment(new_block), max_count));
+    }
+    /// <summary>
+    /// Publishes first `count` bytes of the span returned by the last `reserve()` call as part of the queue's content.
+    /// If the queue's last segment remains empty (e.g. `count` is 0 and the span was in a fresh block), that segment gets released.
+    /// 
+    /// Runs in O(1) time.
+    /// </summary>
+    /// <param name="handle_ptr">Pointer to the queue handle. Value pointed to might get updated in the process of this function.</param>
+    /// <param name="count">How many bytes were actually written into the reserved span</param>
+    /// <param name="counters">Counters of the queue to be kept up to date, if the caller keeps them</param>
+    /// <returns>`false` if `count` is bigger than the free space available behind the queue's last byte (nothing gets committed in that case)</returns>
+    bool commit(queue_handle_t* handle_ptr, buffersize_t count, queue_counters_t* counters = nullptr) {
+        auto head = get_header(handle_ptr->get_segment_id());
+        if (!head.is_valid())
+            return count <= 0;
+
+        auto tail = ll().last(head);
+        if (count > get_free_space_of_segment(tail))
+            return false;
+        tail.set_segment_length(tail.get_segment_length() + count);
+
+        std::ptrdiff_t blocks_delta = 0;
+        if (tail.get_segment_length() <= 0) {
+            if (ll().is_single_node(tail)) 
+                head = header_view_t::invalid();
+            ll().disconnect_node(tail);
+            auto released_blocks = get_blocks_count_of_segment(tail);
+            release_segments(tail, released_blocks);
+            blocks_delta -= (std::ptrdiff_t)released_blocks;
+        }
+        update_handle(handle_ptr, counters, head, (std::ptrdiff_t)count, blocks_delta);
+        return true;
+    }
+
+    /// <summary>
+    /// Merges physically adjacent free segments back into bigger ones, so that large free runs (and the multiblock segments optimization) 
+    /// become available again after the free list got shattered into single blocks by a long churn.
+    /// 
+    /// Work is incremental - visits at most `budget` segments of the free list (each merge counts as a visit too), starting at the free list's head,
+    /// and then rotates the free list so that the next call continues where this one ended. 
+    /// Segments released by destroy_queue that were not normalized yet get normalized along the way.
+    /// 
+    /// Runs in O(budget) time.
+    /// </summary>
+    /// <param name="budget">Max ammount of free list segments to be visited</param>
+    /// <returns>How many merges were done</returns>
+    buffersize_t coalesce_free_segments(buffersize_t budget) {
+        auto segment = get_free_list();
+        buffersize_t merges_count = 0;
+        for (; segment.is_valid() && budget > 0; --budget) {
+            if (!segment.get_is_free_segment())
+                init_free_list_segment(segment);
+
+            auto blocks_count = get_blocks_count_of_segment(segment);
+            auto next_block_to_right = segment.get_segment_id() + blocks_count;
+            if (is_free_segment_start(next_block_to_right)) {
+                auto right = get_header(next_block_to_right);
+                auto right_blocks_count = get_blocks_count_of_segment(right);
+                if (blocks_count + right_blocks_count <= get_max_blocks_per_segment()) {
+                    ll().disconnect_node(right); //`right` can't be the free list head kept in the pool's header - that one is going to be overwritten at the end
+                    segment.set_segment_length(segment.get_segment_length() + right_blocks_count * get_block_size_bytes());
+                    ++merges_count;
+                    continue; //try to merge more into the same segment
+                }
+            }
+            segment = ll().next(segment);
+        }
+        set_free_list(segment);
+        return merges_count;
+    }
+
+    /// <summary>
+    /// Hands over up to `max_blocks` free blocks to another pool sharing the same blocks (see `shared_blocks_t`), e.g. one that ran out of them.
+    /// Segments are taken from the head of the free list - a segment with more blocks than needed gets split.
+    /// Locks of both pools must be held.
+    /// 
+    /// Runs in O(number of donated segments) time (plus marking them in the free block bitmaps, if enabled).
+    /// </summary>
+    /// <param name="recipient">Pool to get the blocks</param>
+    /// <param name="max_blocks">Max ammount of blocks to donate</param>
+    /// <returns>How many blocks were donated - less than `max_blocks` only if this pool ran out of free blocks</returns>
+    buffersize_t donate_free_blocks(queue_pool_t* recipient, buffersize_t max_blocks) {
+        buffersize_t donated = 0;
+        while (donated < max_blocks) {
+            auto segment = get_free_list();
+            if (!segment.is_valid()) break;
+            if (!segment.get_is_free_segment()) //segment was released by destroy_queue and not normalized yet
+                init_free_list_segment(segment);
+
+            auto blocks_count = get_blocks_count_of_segment(segment);
+            if (blocks_count > max_blocks - donated) { //just the first blocks of the segment are donated, the rest stays in the free list
+                blocks_count = max_blocks - donated;
+                segment.set_segment_begin(blocks_count * get_block_size_bytes());
+                segment.set_segment_length(segment.get_segment_length() - blocks_count * get_block_size_bytes());
+                set_free_list(trim_segment_from_left(segment));
+            }
+            else {
+                set_free_list(ll().is_single_node(segment) ? header_view_t::invalid() : ll().disconnect_node(segment));
+                ll().init_node(segment);
+            }
+            mark_segment_free(segment, false); //the bits in this pool's bitmap - the recipient marks them in its own
+            buffer->header.free_blocks_count -= blocks_count;
+            owned_blocks_count -= blocks_count;
+
+            recipient->init_free_list_segment(segment);
+            recipient->push_to_free_list(segment, blocks_count);
+            recipient->owned_blocks_count += blocks_count;
+            donated += blocks_count;
+        }
+        return donated;
+    }
+
+    /// <summary>
+    /// Incrementally defragments the buffer by sliding live segments towards its low end, so that free space accumulates at the high end.
+    /// 
+    /// Each step finds the physically first free segment and moves the segment directly to its right into its place 
+    /// (or merges the two if both are free), fixing the links of the moved segment's neighbours.
+    /// Queue handles pointing to a moved segment must be updated by the caller - `on_segment_moved(old_id, new_id)` is invoked for every moved segment.
+    /// Spans handed out by `reserve()` that were not committed yet are invalidated.
+    /// 
+    /// Each step runs in O(block_size * segment_blocks) time for the memmove, plus the search for the first free segment 
+    /// - that is a bitmap scan if the free block bitmap is enabled, a walk through the headers of all the segments before it otherwise.
+    /// Without the bitmap, segments released by destroy_queue and not normalized yet would be indistinguishable from live ones,
+    /// so the whole free list gets normalized first - O(free list segments) once per call.
+    /// Not supported by pools sharing their blocks with other pools - segments to the right of a free one may belong to them.
+    /// </summary>
+    /// <param name="step_budget">Max ammount of segments to be moved/merged</param>
+    /// <param name="on_segment_moved">Function to be invoked as `on_segment_moved(segment_id_t old_id, segment_id_t new_id)`</param>
+    /// <returns>How many steps were done - 0 means there is nothing left to compact</returns>
+    template<std::invocable<segment_id_t, segment_id_t> TFunc>
+    buffersize_t compact(buffersize_t step_budget, TFunc on_segment_moved) {
+        if (shares_blocks) return 0;
+        if (!free_block_bitmap.is_valid()) normalize_free_list(); //with the bitmap, destroy_queue normalizes right away
+        buffersize_t steps_count = 0;
+        segment_id_t search_from = 0;
+        while (steps_count < step_budget) {
+            auto free_segment = find_first_free_segment(search_from);
+            if (!free_segment.is_valid()) break;
+            auto free_blocks_count = get_blocks_count_of_segment(free_segment);
+            auto next_block_to_right = free_segment.get_segment_id() + free_blocks_count;
+            if (next_block_to_right >= get_total_blocks_count()) break; //all the free space is already at the end
+
+            if (is_free_segment_start(next_block_to_right)) { //two free segments next to each other - just merge them
+                auto right = get_header(next_block_to_right);
+                auto right_blocks_count = get_blocks_count_of_segment(right);
+                if (free_blocks_count + right_blocks_count > get_max_blocks_per_segment()) { //can't be merged - keep compacting from the right one
+                    search_from = next_block_to_right;
+                    continue;
+                }
+                set_free_list(ll().is_single_node(right) ? free_segment : ll().disconnect_node(right));
+                free_segment.set_segment_length(free_segment.get_segment_length() + right_blocks_count * get_block_size_bytes());
+            }
+            else {
+                auto moved = move_segment_to_free_segment(get_header(next_block_to_right), free_segment);
+                on_segment_moved((segment_id_t)next_block_to_right, moved.get_segment_id());
+                search_from = moved.get_segment_id();
+            }
+            ++steps_count;
+        }
+        return steps_count;
+    }
+    /// <summary>
+    /// Same as `compact(step_budget, on_segment_moved)`, but updates the provided queue handles automatically.
+    /// </summary>
+    buffersize_t compact(buffersize_t step_budget, std::span<queue_handle_t> handles) {
+        return compact(step_budget, [&](segment_id_t old_id, segment_id_t new_id) {
+            for (auto& handle : handles)
+                if (handle.get_segment_id() == old_id) //special handle values never collide with a segment id
+                    handle.segment_id = new_id;
+            });
+    }
+    /// <summary>
+    /// Same as `compact(step_budget, on_segment_moved)`, but updates the provided fat queue handles automatically.
+    /// Fat handles don't need to be released for this (see the invariant described at `fat_queue_handle_t`).
+    /// </summary>
+    buffersize_t compact(buffersize_t step_budget, std::span<fat_queue_handle_t> handles) {
+        return compact(step_budget, [&](segment_id_t old_id, segment_id_t new_id) {
+            for (auto& fat : handles) {
+                if (!fat.handle.is_valid()) continue;
+                if (fat.handle.get_segment_id() == old_id) fat.handle.segment_id = new_id;
+                if (fat.tail_id == old_id) fat.tail_id = new_id;
+            }
+            });
+    }
+
+    /// <summary>
+    /// Finds the first block on position >= `from` that is part of a segment marked as free.
+    /// Requires the free block bitmap to be enabled. Scans the bitmap a whole word at a time without touching any headers.
+    /// </summary>
+    /// <param name="from">Id of the block to start searching from</param>
+    /// <param name="out_block">Out value - id of the found block</param>
+    /// <returns>`true` IFF a free block was found</returns>
+    bool try_find_first_free_block(segment_id_t from, segment_id_t* out_block) {
+        return try_find_free_run(1, from, out_block);
+    }
+    /// <summary>
+    /// Finds the first run of at least `length` physically consecutive blocks on position >= `from`, that are all parts of segments marked as free.
+    /// Requires the free block bitmap to be enabled. Scans the bitmap a whole word at a time without touching any headers.
+    /// </summary>
+    /// <param name="length">Min count of blocks in the run</param>
+    /// <param name="from">Id of the block to start searching from</param>
+    /// <param name="out_block">Out value - id of the run's first block</param>
+    /// <returns>`true` IFF such run was found</returns>
+    bool try_find_free_run(buffersize_t length, segment_id_t from, segment_id_t* out_block) {
+        if (!free_block_bitmap.is_valid()) return false;
+        auto found = free_block_bitmap.find_set_run(length, from);
+        if (found >= free_block_bitmap.size()) return false;
+        if (out_block) *out_block = (segment_id_t)found;
+        return true;
+    }
+
+#ifdef QUEUE_POOL_FD_IO_SUPPORTED
+    /// <summary>
+    /// Max number of segments that can take part in a single `write_to_fd()`/`read_from_fd()` call.
+    /// </summary>
+    static constexpr std::size_t FD_IO_MAX_SPANS = 64;
+
+    /// <summary>
+    /// Drains up to `max_count` bytes from a queue into a file descriptor by a single `writev` call, 
+    /// pointing the kernel directly to the segments' data (no intermediate copies).
+    /// Exactly the bytes that the kernel accepted get dequeued.
+    /// </summary>
+    /// <param name="handle_ptr">Pointer to the queue handle. Value pointed to might get updated in the process of this function.</param>
+    /// <param name="fd">File descriptor to write to</param>
+    /// <param name="max_count">Max ammount of bytes to write</param>
+    /// <param name="counters">Counters of the queue to be kept up to date, if the caller keeps them</param>
+    /// <returns>How many bytes were written, or -1 if `writev` failed (`errno` is left as set by it)</returns>
+    std::ptrdiff_t write_to_fd(queue_handle_t* handle_ptr, int fd, buffersize_t max_count, queue_counters_t* counters = nullptr) {
+        if (!handle_ptr->is_valid() || max_count <= 0)
+            return 0;
+
+        auto head = get_header(handle_ptr->get_segment_id());
+        std::array<iovec, FD_IO_MAX_SPANS> spans;
+        std::size_t spans_count = 0;
+        buffersize_t remaining = max_count;
+        auto segment = head;
+        do {
+            auto span_length = std::min(remaining, segment.get_segment_length());
+            spans[spans_count++] = iovec{ &segment.get_segment_data()[segment.get_segment_begin()], span_length };
+            remaining -= span_length;
+            segment = ll().next(segment);
+        } while (remaining > 0 && spans_count < spans.size() && segment != head);
+
+        auto written = ::writev(fd, spans.data(), (int)spans_count);
+        if (written <= 0)
+            return written;
+
+        std::ptrdiff_t blocks_delta = 0;
+        consume_front(&head, (buffersize_t)written, &blocks_delta, [](const byte_t*, buffersize_t) {});
+        update_handle(handle_ptr, counters, head, -(std::ptrdiff_t)written, blocks_delta);
+        return written;
+    }
+
+    /// <summary>
+    /// Fills a queue with up to `max_count` bytes read from a file descriptor by a single `readv` call, 
+    /// letting the kernel write directly into free space of the queue's segments (no intermediate copies).
+    /// Exactly the bytes that the kernel provided get enqueued, space that was reserved but not used gets released.
+    /// </summary>
+    /// <param name="handle_ptr">Pointer to the queue handle. Value pointed to might get updated in the process of this function.</param>
+    /// <param name="fd">File descriptor to read from</param>
+    /// <param name="max_count">Max ammount of bytes to read</param>
+    /// <param name="counters">Counters of the queue to be kept up to date, if the caller keeps them</param>
+    /// <returns>How many bytes were read, or -1 if `readv` failed (`errno` is left as set by it) or not a single byte of memory could be reserved</returns>
+    std::ptrdiff_t read_from_fd(queue_handle_t* handle_ptr, int fd, buffersize_t max_count, queue_counters_t* counters = nullptr) {
+        if (max_count <= 0)
+            return 0;
+
+        auto head = get_header(handle_ptr->get_segment_id());
+        back_reservation_t reservation;
+        if (!try_reserve_back(head, max_count, &reservation, true))
+            return -1;
+
+        std::array<iovec, FD_IO_MAX_SPANS> spans;
+        std::size_t spans_count = 0;
+        for_each_reserved_span(reservation, max_count, [&](byte_t* span, buffersize_t span_length) {
+            if (spans_count < spans.size())
+                spans[spans_count++] = iovec{ span, span_length };
+            });
+
+        auto read = ::readv(fd, spans.data(), (int)spans_count);
+        auto committed = read > 0 ? (buffersize_t)read : 0;
+        std::ptrdiff_t blocks_delta = 0;
+        head = commit_back(head, &reservation, committed, &blocks_delta);
+        update_handle(handle_ptr, counters, head, (std::ptrdiff_t)committed, blocks_delta);
+        return read;
+    }
+#endif
+
+    /// <summary>
+    /// Destroys the queue and releases its resources to be used by other queues.
+    /// Queue handle gets invalidated in the process.
+    /// 
+    /// Runs in O(1) time if the queue's counters are provided (they tell how many blocks get released), O(number of the queue's segments) otherwise.
+    /// </summary>
+    /// <param name="handle_ptr">Queue to be used. Gets reset by this function to `uninitialized`.</param>
+    /// <param name="counters">Counters of the queue, if the caller keeps them. Get reset to those of an empty queue (keeping the ready slot).</param>
+    void destroy_queue(queue_handle_t* handle_ptr, queue_counters_t* counters = nullptr)
+    {
+        buffersize_t blocks_count = 0;
+        if (counters) {
+            blocks_count = counters->blocks_count;
+            mark_ready(counters, false);
+            *counters = queue_counters_t(counters->ready_slot);
+        }
+        if (!handle_ptr->is_valid())return;
+        auto head = get_header(handle_ptr->get_segment_id());
+        if (!counters) ll().for_each(head, [&](header_view_t segment) { blocks_count += get_blocks_count_of_segment(segment); });
+        with_free_list([&] { release_queue_to_freelist(head, blocks_count); });
+        *handle_ptr = queue_handle_t::uninitialized();
+    }
+
+#pragma region SingleProducerSingleConsumer
+
+    /// <summary>
+    /// Initializes an spsc queue, allocating its first block. 
+    /// Takes the pool's lock.
+    /// </summary>
+    /// <returns>`false` if out of memory</returns>
+    bool try_make_spsc_queue(spsc_queue_t* q) {
+        std::lock_guard guard(*this);
+        auto block = alloc_spsc_block();
+        if (!block.is_valid()) return false;
+        q->tail_id = q->head_id = block.get_segment_id();
+        q->tail_write_offset = q->head_read_offset = 0;
+        q->enqueued_count.store(0, std::memory_order_relaxed);
+        q->dequeued_count.store(0, std::memory_order_release);
+        return true;
+    }
+    /// <summary>
+    /// Releases all blocks of an spsc queue. Neither the producer nor the consumer may be using it at that point.
+    /// Takes the pool's lock.
+    /// </summary>
+    void destroy_queue(spsc_queue_t* q) {
+        std::lock_guard guard(*this);
+        auto block = get_header(q->head_id);
+        for (;;) {
+            bool is_last = block.get_segment_id() == q->tail_id;
+            auto next = is_last ? header_view_t::invalid() : get_header(block.get_next_segment_id());
+            ll().init_node(block);
+            release_spsc_blocks(block, 1);
+            if (is_last) break;
+            block = next;
+        }
+        q->enqueued_count.store(0, std::memory_order_relaxed);
+        q->dequeued_count.store(0, std::memory_order_relaxed);
+    }
+    /// <summary>
+    /// Enqueues a span of bytes into an spsc queue. Must be called only from the queue's producer thread.
+    /// Either all the bytes get enqueued, or none of them are.
+    /// 
+    /// Takes the pool's lock (once per call) only if new blocks are needed and the thread's magazine (if provided) can't supply them.
+    /// </summary>
+    /// <returns>Whether the operation was successfull (didn't fail due to out-of-memory)</returns>
+    bool try_enqueue_bytes(spsc_queue_t* q, const byte_t* data, buffersize_t count, block_magazine_t* magazine = nullptr) { return try_enqueue_spsc(q, data, count, magazine, true); }
+    bool try_enqueue_byte(spsc_queue_t* q, byte_t to_enqueue, block_magazine_t* magazine = nullptr) { return try_enqueue_bytes(q, &to_enqueue, 1, magazine); }
+    /// <summary>
+    /// Enqueues several spans of bytes into an spsc queue, making them visible to the consumer (and waking it, if it sleeps) just once at the end.
+    /// Stops at the first span that doesn't fit. Must be called only from the queue's producer thread.
+    /// </summary>
+    /// <returns>How many of the spans were enqueued</returns>
+    buffersize_t try_enqueue_batch(spsc_queue_t* q, std::span<const std::span<const byte_t>> spans, block_magazine_t* magazine = nullptr) {
+        buffersize_t enqueued_spans = 0, enqueued_bytes = 0;
+        for (; enqueued_spans < spans.size(); ++enqueued_spans) {
+            if (!try_enqueue_spsc(q, spans[enqueued_spans].data(), spans[enqueued_spans].size(), magazine, false)) break;
+            enqueued_bytes += spans[enqueued_spans].size();
+        }
+        if (enqueued_bytes > 0) publish_spsc(q, enqueued_bytes);
+        return enqueued_spans;
+    }
+
+    /// <summary>
+    /// Dequeues up to `max_count` bytes from an spsc queue. Must be called only from the queue's consumer thread.
+    /// 
+    /// Takes the pool's lock (once per call) only if some blocks got fully consumed and the thread's magazine (if provided) has no room for them.
+    /// </summary>
+    /// <returns>How many bytes were dequeued (0 if the queue was empty)</returns>
+    buffersize_t try_dequeue_bytes(spsc_queue_t* q, byte_t* out_data, buffersize_t max_count, block_magazine_t* magazine = nullptr) {
+        auto dequeued = q->dequeued_count.load(std::memory_order_relaxed);
+        auto to_read = std::min<buffersize_t>(max_count, (buffersize_t)(q->enqueued_count.load(std::memory_order_acquire) - dequeued));
+        if (to_read <= 0) return 0;
+
+        auto capacity = get_spsc_block_capacity();
+        auto head = get_header(q->head_id);
+        auto read_offset = q->head_read_offset;
+        header_view_t released = header_view_t::invalid();
+        buffersize_t released_count = 0;
+        for (buffersize_t done = 0; done < to_read; ) {
+            if (read_offset >= capacity) { //there are published bytes beyond this block, so its link must be published already too
+                auto next = get_header(head.get_next_segment_id());
+                ll().init_node(head);
+                released = ll().prepend_list(released, head);
+                ++released_count;
+                head = next;
+                read_offset = 0;
+            }
+            auto span_length = std::min(to_read - done, capacity - read_offset);
+            std::memcpy(out_data + done, &head.get_segment_data()[read_offset], span_length);
+            done += span_length;
+            read_offset += span_length;
+        }
+        q->head_id = head.get_segment_id();
+        q->head_read_offset = read_offset;
+        if (released.is_valid())
+            release_spsc_blocks(released, released_count, magazine);
+        q->dequeued_count.store(dequeued + to_read, std::memory_order_release);
+        return to_read;
+    }
+    bool try_dequeue_byte(spsc_queue_t* q, byte_t* out_byte, block_magazine_t* magazine = nullptr) { return try_dequeue_bytes(q, out_byte, 1, magazine) > 0; }
+
+#ifdef QUEUE_POOL_FUTEX_SUPPORTED
+    /// <summary>
+    /// Dequeues up to `max_count` bytes from an spsc queue, sleeping until some get enqueued if the queue is empty. 
+    /// Must be called only from the queue's consumer thread.
+    /// 
+    /// The producer issues a wake syscall only if the consumer is actually sleeping, once per sleep - every other enqueue costs it just a fence and a load.
+    /// </summary>
+    /// <returns>How many bytes were dequeued (0 if the timeout expired first)</returns>
+    buffersize_t dequeue_wait(spsc_queue_t* q, byte_t* out_data, buffersize_t max_count, std::chrono::nanoseconds timeout, block_magazine_t* magazine = nullptr) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        std::atomic_ref sleeping(q->consumer_sleeping);
+        for (;;) {
+            if (auto ret = try_dequeue_bytes(q, out_data, max_count, magazine)) return ret;
+            auto remaining = deadline - std::chrono::steady_clock::now();
+            if (remaining <= std::chrono::nanoseconds::zero()) return 0;
+
+            sleeping.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst); //pairs with the fence in `publish_spsc()` - either we see the enqueued bytes, or the producer sees us sleeping
+            if (size(*q) == 0) {
+                auto seconds = std::chrono::duration_cast<std::chrono::seconds>(remaining);
+                timespec relative_timeout{ .tv_sec = (time_t)seconds.count(), .tv_nsec = (long)std::chrono::duration_cast<std::chrono::nanoseconds>(remaining - seconds).count() };
+                ::syscall(SYS_futex, &q->consumer_sleeping, FUTEX_WAIT_PRIVATE, 1, &relative_timeout, nullptr, 0); //returns right away if the word is no longer 1
+            }
+            sleeping.store(0, std::memory_order_relaxed);
+        }
+    }
+#endif
+
+    /// <summary>
+    /// Returns all blocks cached in a magazine to the pool's free list.
+    /// Takes the pool's lock, so it must not be held by the caller.
+    /// </summary>
+    void flush_magazine(block_magazine_t* magazine) {
+        auto count = magazine->count;
+        if (count <= 0) return;
+        std::lock_guard guard(*this);
+        release_spsc_blocks(take_from_magazine(magazine, count), count);
+    }
+    /// <summary>
+    /// Moves all blocks from the lock-free block stack into the free list - e.g. before compaction/coalescing, which only see the free list.
+    /// No queue may be operated concurrently. Takes the pool's lock.
+    /// </summary>
+    void flush_block_stack() {
+        if (!block_stack) return;
+        std::lock_guard guard(*this);
+        for (auto block = header_view_t::invalid(); try_pop_block_stack(&block); )
+            release_spsc_blocks(block, 1);
+    }
+
+#pragma endregion
+
+#pragma region FatHandles
+
+    /// <summary>
+    /// Creates a new queue accessed through a fat handle.
+    /// Runs in O(1) time.
+    /// </summary>
+    fat_queue_handle_t make_fat_queue() { return make_fat_handle(make_queue()); }
+    /// <summary>
+    /// Starts accessing a queue through a fat handle. The plain handle must not be used until the fat one gets released.
+    /// Runs in O(1) time.
+    /// </summary>
+    fat_queue_handle_t make_fat_handle(queue_handle_t handle) {
+        fat_queue_handle_t ret;
+        ret.handle = handle;
+        load_fat_handle(&ret);
+        return ret;
+    }
+    /// <summary>
+    /// Brings headers of the queue up to date and returns its plain handle, which can then be used by all the other functions.
+    /// Fat handle is reset to `uninitialized` in the process.
+    /// Runs in O(1) time.
+    /// </summary>
+    queue_handle_t release_fat_handle(fat_queue_handle_t* fat) {
+        flush_fat_handle(fat);
+        auto ret = fat->handle;
+        *fat = fat_queue_handle_t();
+        return ret;
+    }
+    /// <summary>
+    /// How many bytes are stored in a queue accessed through a fat handle, summed over its segments (cached positions are taken into account) 
+    /// - for queues whose counters are not kept.
+    /// Runs in O(number of the queue's segments) time.
+    /// </summary>
+    buffersize_t size(const fat_queue_handle_t& fat) {
+        auto handle = fat.handle;
+        if (!handle.is_valid()) return 0;
+        auto head = get_header(handle.get_segment_id());
+        if (head.get_segment_id() == fat.tail_id) return fat.tail_write_offset - fat.head_read_offset;
+        buffersize_t ret = fat.head_end_offset - fat.head_read_offset;
+        auto tail = get_header(fat.tail_id);
+        for (auto segment = ll().next(head); segment != tail; segment = ll().next(segment))
+            ret += segment.get_segment_length();
+        return ret + fat.tail_write_offset - tail.get_segment_begin();
+    }
+    /// <summary>
+    /// How many bytes are stored in an spsc queue. Can be called from any thread, the result is just a snapshot then.
+    /// Runs in O(1) time.
+    /// </summary>
+    buffersize_t size(const spsc_queue_t& q) {
+        auto dequeued = q.dequeued_count.load(std::memory_order_acquire);
+        return (buffersize_t)(q.enqueued_count.load(std::memory_order_acquire) - dequeued);
+    }
+
+    /// <summary>
+    /// Same as `try_enqueue_byte(queue_handle_t*, byte_t, queue_counters_t*)`, but touches no header unless the byte doesn't fit into the queue's last block.
+    /// Runs in O(1) time.
+    /// </summary>
+    bool try_enqueue_byte(fat_queue_handle_t* fat, byte_t to_enqueue, queue_counters_t* counters = nullptr) {
+        if (fat->handle.is_valid()) {
+            buffersize_t position = get_header_size_bytes() + fat->tail_write_offset;
+            if (position % get_block_size_bytes() != 0 || position == 0) { //there is still space left in the last block
+                get_header(fat->tail_id).get_segment_data()[fat->tail_write_offset++] = to_enqueue;
+                if (counters && counters->length++ == 0) mark_ready(counters, true);
+                return true;
+            }
+        }
+        flush_fat_handle(fat);
+        bool ret = try_enqueue_byte(&fat->handle, to_enqueue, counters);
+        load_fat_handle(fat);
+        return ret;
+    }
+    /// <summary>
+    /// Same as `try_dequeue_byte(queue_handle_t*, byte_t*, queue_counters_t*)`, but touches no header unless the queue's first block gets fully consumed.
+    /// Runs in O(1) time.
+    /// </summary>
+    bool try_dequeue_byte(fat_queue_handle_t* fat, byte_t* out_byte, queue_counters_t* counters = nullptr) {
+        if (fat->handle.is_valid()) {
+            auto head_id = fat->handle.get_segment_id();
+            buffersize_t end = (head_id == fat->tail_id) ? fat->tail_write_offset : fat->head_end_offset;
+            buffersize_t next_position = get_header_size_bytes() + fat->head_read_offset + 1;
+            if (fat->head_read_offset + 1 < end && next_position % get_block_size_bytes() != 0) { //segment doesn't get emptied and no block gets freed
+                *out_byte = get_header(head_id).get_segment_data()[fat->head_read_offset++];
+                if (counters) --counters->length;
+                return true;
+            }
+        }
+        flush_fat_handle(fat);
+        bool ret = try_dequeue_byte(&fat->handle, out_byte, counters);
+        load_fat_handle(fat);
+        return ret;
+    }
+    /// <summary>
+    /// Destroys the queue and releases its resources to be used by other queues.
+    /// Runs in O(1) time if the queue's counters are provided, O(number of the queue's segments) otherwise.
+    /// </summary>
+    void destroy_queue(fat_queue_handle_t* fat, queue_counters_t* counters = nullptr) {
+        flush_fat_handle(fat);
+        destroy_queue(&fat->handle, counters);
+        *fat = fat_queue_handle_t();
+    }
+
+#pragma endregion
+
+#pragma region Messages
+
+    //LEB128 - 7 bits per byte, highest bit set on all bytes but the last one
+    static constexpr buffersize_t MAX_MESSAGE_PREFIX_LENGTH = (sizeof(buffersize_t) * 8 + 6) / 7;
+
+    /// <summary>
+    /// Enqueues a message - its length as a varint prefix (1 byte for messages shorter than 128 bytes), followed by the payload.
+    /// Either the whole message gets enqueued, or nothing is.
     /// 
-    /// Runs in O(1) time.
+    /// Runs in O(n) time, copying by a single memcpy per segment like `try_enqueue_bytes()`.
     /// </summary>
-    /// <param name="handle_ptr">Pointer to the queue handle. Value pointed to might get updated in the process of this function.</param>
-    /// <param name="to_enqueue">Byte to enqueue.</param>
-    /// <returns>Whether the operation was successfull (didn't fail due to out-of-memory etc.)</returns>
-    bool try_enqueue_byte(queue_handle_t* handle_ptr, byte_t to_enqueue) {
-        auto head = get_header(handle_ptr->get_segment_id());
-        byte_t* new_byte;
-        if (try_grow_queue_by_1(&head) && try_peak_front(head, &new_byte)) {
-            *new_byte = to_enqueue;
-            *handle_ptr = queue_handle_t::from_header(head);
-            return true;
+    /// <returns>Whether the operation was successfull (didn't fail due to out-of-memory)</returns>
+    bool try_enqueue_message(queue_handle_t* handle_ptr, std::span<const byte_t> payload, queue_counters_t* counters = nullptr) {
+        byte_t prefix[MAX_MESSAGE_PREFIX_LENGTH];
+        buffersize_t prefix_length = 0;
+        for (buffersize_t length = payload.size(); ; length >>= 7) {
+            prefix[prefix_length++] = (byte_t)((length & 0x7F) | (length >= 0x80 ? 0x80 : 0));
+            if (length < 0x80) break;
         }
-        return false;
+
+        auto count = prefix_length + payload.size();
+        auto head = get_header(handle_ptr->get_segment_id());
+        back_reservation_t reservation;
+        if (!try_reserve_back(head, count, &reservation))
+            return false;
+
+        buffersize_t written = 0;
+        for_each_reserved_span(reservation, count, [&](byte_t* span, buffersize_t span_length) {
+            for (; span_length > 0; ) { //at most 2 pieces - the rest of the prefix, then the payload
+                auto source = written < prefix_length ? std::span<const byte_t>(prefix + written, prefix_length - written) : payload.subspan(written - prefix_length);
+                auto piece_length = std::min(span_length, (buffersize_t)source.size());
+                std::memcpy(span, source.data(), piece_length);
+                span += piece_length;
+                span_length -= piece_length;
+                written += piece_length;
+            }
+            });
+        std::ptrdiff_t blocks_delta = 0;
+        head = commit_back(head, &reservation, count, &blocks_delta);
+        update_handle(handle_ptr, counters, head, (std::ptrdiff_t)count, blocks_delta);
+        return true;
     }
     /// <summary>
-    /// Tries to dequeue a byte from a queue.
-    /// Will fail if there is nothing left in the provided queue.
+    /// Gets a zero-copy view of the first message of a queue. It stays in the queue until `release_message()` is called.
     /// 
-    /// Runs in O(1) time.
+    /// Runs in O(number of segments of the message) time - the payload is never scanned.
     /// </summary>
-    /// <param name="handle_ptr">Pointer to the queue handle. Value pointed to might get updated in the process of this function.</param>
-    /// <param name="out_byte">Byte that was dequeued</param>
-    /// <returns>Whether the operation was successfull (there was still something to dequeue)</returns>
-    bool try_dequeue_byte(queue_handle_t* handle_ptr, byte_t* out_byte) {
-        if (!handle_ptr->is_valid())
-            return false;
-
+    /// <returns>`false` if the queue doesn't hold a whole message, or if the message spans more than `message_view_t::MAX_SPANS` segments 
+    /// (`try_dequeue_message(handle_ptr, std::span<byte_t>, ...)` has to copy it out then - `out_view->size()` still tells its length)</returns>
+    bool try_dequeue_message(queue_handle_t* handle_ptr, message_view_t* out_view) {
+        return try_peek_message(*handle_ptr, out_view);
+    }
+    /// <summary>
+    /// Removes the message obtained by `try_dequeue_message()` from the queue, releasing blocks it occupied. Its view gets invalidated.
+    /// </summary>
+    void release_message(queue_handle_t* handle_ptr, message_view_t* view, queue_counters_t* counters = nullptr) {
         auto head = get_header(handle_ptr->get_segment_id());
-
-        byte_t* back_ref;
-        if (!try_peak_back(head, &back_ref)) return false;
-        *out_byte = *back_ref;
-        if (try_shrink_queue_by_1(&head)) {
-            *handle_ptr = queue_handle_t::from_header(head);
-            return true;
-        }
-        return false;
+        std::ptrdiff_t blocks_delta = 0;
+        auto consumed = consume_front(&head, view->frame_length, &blocks_delta, [](const byte_t*, buffersize_t) {});
+        update_handle(handle_ptr, counters, head, -(std::ptrdiff_t)consumed, blocks_delta);
+        *view = message_view_t();
     }
     /// <summary>
-    /// Destroys the queue and releases its resources to be used by other queues.
-    /// Queue handle gets invalidated in the process.
+    /// Dequeues the first message of a queue, copying its payload into a caller provided buffer.
     /// </summary>
-    /// <param name="handle_ptr">Queue to be used. Gets reset by this function to `uninitialized`.</param>
-    void destroy_queue(queue_handle_t* handle_ptr)
-    {
-        if (!handle_ptr->is_valid())return;
-        release_queue_to_freelist(get_header(handle_ptr->get_segment_id()));
-        *handle_ptr = queue_handle_t::uninitialized();
+    /// <returns>`false` if the queue doesn't hold a whole message, or if it doesn't fit into `out_payload` (queue stays untouched then)</returns>
+    bool try_dequeue_message(queue_handle_t* handle_ptr, std::span<byte_t> out_payload, buffersize_t* out_length, queue_counters_t* counters = nullptr) {
+        message_view_t view;
+        try_peek_message(*handle_ptr, &view);
+        if (view.frame_length <= 0 || view.length > out_payload.size()) return false;
+
+        auto head = get_header(handle_ptr->get_segment_id());
+        buffersize_t prefix_left = view.frame_length - view.length;
+        auto out_data = out_payload.data();
+        std::ptrdiff_t blocks_delta = 0;
+        auto consumed = consume_front(&head, view.frame_length, &blocks_delta, [&](const byte_t* run, buffersize_t run_length) {
+            auto skipped = std::min(prefix_left, run_length);
+            prefix_left -= skipped;
+            std::memcpy(out_data, run + skipped, run_length - skipped);
+            out_data += run_length - skipped;
+            });
+        update_handle(handle_ptr, counters, head, -(std::ptrdiff_t)consumed, blocks_delta);
+        *out_length = view.length;
+        return true;
     }
 
+#pragma endregion
+
 
 private:
 #pragma region BufferManipulationPrimitives
@@ -156,24 +1249,56 @@ private:
     struct buffer_view_t {
         struct header_t {
             packed_segment_id_t free_list;
+            packed_segment_id_t free_blocks_count;
+            std::uint8_t lock;
         } header;
         byte_t data[];
     };
     using header_view_t = typename TMemoryPolicy::segment_header_view_t;
 
+    //tag in the upper half of the word is incremented by every pop, so that a compare-exchange never succeeds on a top that got popped and pushed back in the meantime (ABA)
+    // - always 64 bits, so that the tag has 32 bits even for the smallest ids and doesn't wrap around during a single preempted pop
+    using block_stack_word_t = std::uint64_t;
+    static constexpr unsigned BLOCK_STACK_ID_BITS = 32;
+    static_assert(sizeof(packed_segment_id_t) * 8 <= BLOCK_STACK_ID_BITS, "Segment ids must fit into the lower half of the block stack word");
+    //id of the next block in the stack - kept out of the headers, as a popping thread may read it while another thread that popped the same block already reuses it
+    using block_stack_link_t = std::uint32_t;
+    struct block_stack_t {
+        block_stack_word_t top;
+        block_stack_word_t blocks_count;
+    };
+
     buffer_view_t* buffer;
-    buffersize_t buffer_size;
+    //start of the area between the buffer's header and the blocks
+    byte_t* metadata_data;
+    //invalid if the lock-free block stack is not enabled
+    block_stack_t* block_stack = nullptr;
+    //1 link per block, accessed only atomically; invalid if the lock-free block stack is not enabled
+    block_stack_link_t* block_stack_links = nullptr;
+    byte_t* blocks_data;
+    segment_id_t total_blocks_count;
+    //blocks that are either free in this pool or used by its queues - all of them unless the blocks are shared with other pools
+    segment_id_t owned_blocks_count;
+    //whether the blocks are shared with other pools (see `shared_blocks_t`)
+    bool shares_blocks = false;
     bool use_multiblock_segments;
+    //1 bit per block - set IFF the block is part of a segment marked as free; invalid if the bitmap is not enabled
+    bitmaps::bitmap_view_t free_block_bitmap;
+    //1 bit per ready slot - set IFF the queue whose counters have that slot is not empty; invalid if not enabled
+    bitmaps::bitmap_view_t ready_bitmap;
 
     constexpr buffersize_t get_block_size_bytes() { return TMemoryPolicy::get_block_size_bytes(); }
     buffersize_t get_header_size_bytes(){return TMemoryPolicy::get_header_size_bytes();}
     buffersize_t get_allocatable_buffer_size_bytes() { return get_total_blocks_count() * get_block_size_bytes(); }
-
-    byte_t* get_segment_start(segment_id_t segment_index) { return &(buffer->data[segment_index * get_block_size_bytes()]); }
-    segment_id_t get_total_blocks_count() { return std::min<segment_id_t>(
-        TMemoryPolicy::get_addressable_blocks_count() - queue_handle_t::SPECIAL_VALUES_COUNT, 
-        (segment_id_t)(buffer_size) / get_block_size_bytes()); 
+    //whether the memory policy keeps (some of) its data in a side table outside of the blocks
+    static constexpr bool has_side_table() { return requires{ TMemoryPolicy::get_side_table_bytes_per_block(); }; }
+    static constexpr buffersize_t get_side_table_bytes_per_block() {
+        if constexpr (has_side_table()) return TMemoryPolicy::get_side_table_bytes_per_block();
+        else return 0;
     }
+
+    byte_t* get_segment_start(segment_id_t segment_index) { return &(blocks_data[segment_index * get_block_size_bytes()]); }
+    segment_id_t get_total_blocks_count() { return total_blocks_count; }
     header_view_t get_header(segment_id_t segment_index) {
         if (segment_index < 0 || segment_index >= get_total_blocks_count() || !queue_handle_t(segment_index).is_valid() ) return header_view_t::invalid();
         return TMemoryPolicy::make_header_view(get_segment_start(segment_index), segment_index);
@@ -181,9 +1306,17 @@ private:
 
     buffersize_t get_blocks_count_of_segment(header_view_t h, buffersize_t additional_bytes) {
         if (!h.is_valid()) return 0;
-        return math::divide_round_up(h.get_segment_begin() + h.get_segment_length() + get_header_size_bytes() + additional_bytes, get_block_size_bytes());
+        //even an empty segment occupies its block (that matters only if headers are not stored inside the blocks)
+        return std::max<buffersize_t>(1, math::divide_round_up(h.get_segment_begin() + h.get_segment_length() + get_header_size_bytes() + additional_bytes, get_block_size_bytes()));
     }
     buffersize_t get_blocks_count_of_segment(header_view_t h) { return get_blocks_count_of_segment(h, 0); }
+    //how many blocks can a single segment span so that the header is still able to encode its length
+    buffersize_t get_max_blocks_per_segment() { return std::max<buffersize_t>(1, (TMemoryPolicy::get_max_segment_length() + get_header_size_bytes()) / get_block_size_bytes()); }
+    //how many more bytes can be appended to the segment without it needing another block
+    buffersize_t get_free_space_of_segment(header_view_t h) {
+        if (!h.is_valid()) return 0;
+        return get_blocks_count_of_segment(h) * get_block_size_bytes() - get_header_size_bytes() - h.get_segment_begin() - h.get_segment_length();
+    }
 
 
     struct header_linked_list_access_policy {
@@ -203,29 +1336,378 @@ private:
 #pragma endregion
 
 #pragma region FreeListManagement
-    segment_id_t init_free_list() {
-        header_view_t free_list = get_header(0);
-        ll().init_node(free_list);
-        free_list.set_is_free_segment(true);
-        free_list.set_segment_begin(0);
-        free_list.set_segment_length(get_allocatable_buffer_size_bytes() - get_header_size_bytes());
-        return free_list.get_segment_id();
+    /// <summary>
+    /// Sets the segment's `is_free` flag, keeping the free block bitmap in sync. Segment's begin and length must already be set.
+    /// </summary>
+    void mark_segment_free(header_view_t h, bool value) {
+        h.set_is_free_segment(value);
+        if (free_block_bitmap.is_valid())
+            free_block_bitmap.set_range(h.get_segment_id(), get_blocks_count_of_segment(h), value);
+    }
+    /// <summary>
+    /// Whether the block is the first block of a segment marked as free. Must only be called on blocks known to start a segment.
+    /// </summary>
+    bool is_free_segment_start(segment_id_t block) {
+        if (block >= get_total_blocks_count()) return false;
+        if (free_block_bitmap.is_valid()) return free_block_bitmap.get(block);
+        if (shares_blocks) return false; //the block might be a free segment of another pool
+        auto h = get_header(block);
+        return h.is_valid() && h.get_is_free_segment();
+    }
+
+    /// <summary>
+    /// Points the handle to the queue's (possibly changed) first segment and applies changes done by the operation to the queue's counters (if provided).
+    /// Blocks delta is tallied by the operation itself from the blocks it took from/released to the free list 
+    /// - never derived from the pool-wide free blocks counter, which other queues change as well (spsc queues even without the lock).
+    /// </summary>
+    void update_handle(queue_handle_t* handle_ptr, queue_counters_t* counters, header_view_t queue_head, std::ptrdiff_t length_delta, std::ptrdiff_t blocks_delta) {
+        *handle_ptr = queue_handle_t::from_header(queue_head);
+        if (!counters) return;
+        counters->length = (std::uint32_t)(counters->length + length_delta);
+        counters->blocks_count = (packed_segment_id_t)(counters->blocks_count + blocks_delta);
+        if (length_delta != 0) mark_ready(counters, counters->length > 0);
+    }
+    /// <summary>
+    /// Updates the queue's bit in the ready bitmap, if it has one.
+    /// </summary>
+    void mark_ready(const queue_counters_t* counters, bool value) {
+        if (!ready_bitmap.is_valid() || counters->ready_slot >= ready_bitmap.size()) return;
+        if (!block_stack) {
+            ready_bitmap.set(counters->ready_slot, value);
+            return;
+        }
+        std::lock_guard guard(*this); //regular queues are operated without the lock, and slots of different queues share bitmap words
+        ready_bitmap.set(counters->ready_slot, value);
+    }
+
+    /// <summary>
+    /// Implementation of `try_enqueue_bytes()` for spsc queues - if `publish` is false, the bytes are written and linked, but stay invisible to the consumer until `publish_spsc()`.
+    /// </summary>
+    bool try_enqueue_spsc(spsc_queue_t* q, const byte_t* data, buffersize_t count, block_magazine_t* magazine, bool publish) {
+        if (count <= 0) return true;
+        auto capacity = get_spsc_block_capacity();
+        auto tail_space = capacity - q->tail_write_offset;
+
+        //all the needed blocks are allocated up front, so that nothing gets published unless everything fits
+        header_view_t new_blocks = header_view_t::invalid();
+        if (count > tail_space) {
+            new_blocks = alloc_spsc_blocks(math::divide_round_up(count - tail_space, capacity), magazine);
+            if (!new_blocks.is_valid()) return false;
+        }
+
+        auto tail = get_header(q->tail_id);
+        auto write_offset = q->tail_write_offset;
+        buffersize_t remaining = count;
+        for (;;) {
+            auto span_length = std::min(remaining, capacity - write_offset);
+            std::memcpy(&tail.get_segment_data()[write_offset], data, span_length);
+            data += span_length;
+            remaining -= span_length;
+            write_offset += span_length;
+            if (!new_blocks.is_valid()) break;
+
+            auto block = new_blocks;
+            new_blocks = ll().is_single_node(block) ? header_view_t::invalid() : ll().disconnect_node(block);
+            tail.set_next_segment_id(block.get_segment_id()); //consumer won't look at the link until it gets published below
+            tail = block;
+            write_offset = 0;
+        }
+        q->tail_id = tail.get_segment_id();
+        q->tail_write_offset = write_offset;
+        if (publish) publish_spsc(q, count);
+        return true;
+    }
+    /// <summary>
+    /// Makes bytes written by the producer visible to the consumer and wakes the consumer up if it sleeps in `dequeue_wait()`.
+    /// </summary>
+    void publish_spsc(spsc_queue_t* q, buffersize_t count) {
+        q->enqueued_count.store(q->enqueued_count.load(std::memory_order_relaxed) + count, std::memory_order_release);
+#ifdef QUEUE_POOL_FUTEX_SUPPORTED
+        std::atomic_thread_fence(std::memory_order_seq_cst); //pairs with the fence in `dequeue_wait()`
+        std::atomic_ref sleeping(q->consumer_sleeping);
+        if (sleeping.load(std::memory_order_relaxed) && sleeping.exchange(0, std::memory_order_relaxed))
+            ::syscall(SYS_futex, &q->consumer_sleeping, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+    }
+    /// <summary>
+    /// Decodes the length prefix of the first message of a queue and collects spans of its payload (as many as fit into the view).
+    /// `out_view->frame_length` is left 0 if the queue doesn't hold a whole message.
+    /// </summary>
+    /// <returns>Whether the queue holds a whole message and all of its payload spans fit into the view</returns>
+    bool try_peek_message(queue_handle_t handle, message_view_t* out_view) {
+        *out_view = message_view_t();
+        if (!handle.is_valid()) return false;
+        auto head = get_header(handle.get_segment_id());
+
+        buffersize_t prefix_length = 0, payload_length = 0, payload_left = 0;
+        bool prefix_finished = false, spans_overflow = false;
+        for (auto segment = head; ; ) {
+            auto run = &segment.get_segment_data()[segment.get_segment_begin()];
+            buffersize_t run_length = segment.get_segment_length(), t = 0;
+            for (; !prefix_finished && t < run_length; ++t) {
+                if (prefix_length >= MAX_MESSAGE_PREFIX_LENGTH) return false; //not a message
+                payload_length |= (buffersize_t)(run[t] & 0x7F) << (7 * prefix_length);
+                prefix_finished = !(run[t] & 0x80);
+                ++prefix_length;
+                if (prefix_finished) payload_left = payload_length;
+            }
+            if (prefix_finished && payload_left > 0 && t < run_length) {
+                auto span_length = std::min(payload_left, run_length - t);
+                if (out_view->spans_count < message_view_t::MAX_SPANS)
+                    out_view->spans[out_view->spans_count++] = std::span<const byte_t>(run + t, span_length);
+                else
+                    spans_overflow = true;
+                payload_left -= span_length;
+            }
+            if (prefix_finished && payload_left <= 0) break;
+            segment = ll().next(segment);
+            if (segment == head) return false;
+        }
+        out_view->length = payload_length;
+        out_view->frame_length = prefix_length + payload_length;
+        if (spans_overflow) out_view->spans_count = 0;
+        return !spans_overflow;
+    }
+
+    //how many bytes fit into a block of an spsc queue
+    buffersize_t get_spsc_block_capacity() { return get_block_size_bytes() - get_header_size_bytes(); }
+    /// <summary>
+    /// Allocates a block for an spsc queue. Pool's lock must be held.
+    /// </summary>
+    header_view_t alloc_spsc_block() {
+        auto block = alloc_segment_from_free_list(get_free_list());
+        if (block.is_valid()) {
+            block.set_segment_begin(0);
+            block.set_segment_length(get_spsc_block_capacity()); //so that the block counts as fully occupied
+        }
+        return block;
+    }
+    /// <summary>
+    /// Releases a list of blocks that were allocated by `alloc_spsc_block()`. Pool's lock must be held.
+    /// </summary>
+    void release_spsc_blocks(header_view_t blocks, buffersize_t blocks_count) {
+        ll().for_each(blocks, [&](header_view_t block) { init_free_list_segment(block); });
+        push_to_free_list(blocks, blocks_count);
+    }
+    /// <summary>
+    /// Splits the first `count` blocks off a list of blocks that is longer than that.
+    /// </summary>
+    /// <returns>Head of the remaining blocks</returns>
+    header_view_t split_blocks(header_view_t blocks, buffersize_t count) {
+        auto rest = blocks;
+        for (buffersize_t t = 0; t < count; ++t) rest = ll().next(rest);
+        return ll().split_list(blocks, rest);
+    }
+    /// <summary>
+    /// Removes the first `count` blocks cached in a magazine (at most as many as it holds).
+    /// </summary>
+    /// <returns>The removed blocks as a list</returns>
+    header_view_t take_from_magazine(block_magazine_t* magazine, buffersize_t count) {
+        auto ret = get_header(magazine->head);
+        auto rest = count < magazine->count ? split_blocks(ret, count) : header_view_t::invalid();
+        magazine->head = rest.is_valid() ? rest.get_segment_id() : queue_handle_t::empty().get_segment_id();
+        magazine->count -= std::min(count, magazine->count);
+        return ret;
+    }
+    /// <summary>
+    /// Caches a list of blocks in a magazine, in front of the blocks it already holds.
+    /// </summary>
+    void put_to_magazine(block_magazine_t* magazine, header_view_t blocks, buffersize_t count) {
+        if (count <= 0) return;
+        magazine->head = ll().prepend_list(blocks, get_header(magazine->head)).get_segment_id();
+        magazine->count += count;
+    }
+    /// <summary>
+    /// Takes everything but half of the magazine's capacity out of an overflowing magazine (the most recently cached blocks are kept), 
+    /// so that the next releases find room again.
+    /// </summary>
+    /// <param name="out_count">Out value - how many blocks were taken</param>
+    /// <returns>The taken blocks as a list</returns>
+    header_view_t take_magazine_surplus(block_magazine_t* magazine, buffersize_t* out_count) {
+        auto kept = take_from_magazine(magazine, block_magazine_t::CAPACITY / 2);
+        *out_count = magazine->count;
+        auto ret = take_from_magazine(magazine, *out_count);
+        put_to_magazine(magazine, kept, block_magazine_t::CAPACITY / 2);
+        return ret;
+    }
+    /// <summary>
+    /// Refills a magazine used by regular queues to half of its capacity - from the lock-free block stack if enabled, then from the free list
+    /// (under the pool's lock only if the stack is enabled, as the caller holds it otherwise). Stops early if out of memory.
+    /// </summary>
+    void refill_magazine(block_magazine_t* magazine) {
+        auto blocks = header_view_t::invalid();
+        buffersize_t count = 0;
+        for (auto block = header_view_t::invalid(); count < block_magazine_t::CAPACITY / 2 && try_pop_block_stack(&block); ++count)
+            blocks = ll().prepend_list(blocks, block);
+        if (count < block_magazine_t::CAPACITY / 2) with_free_list([&] {
+            for (; count < block_magazine_t::CAPACITY / 2; ++count) {
+                auto block = alloc_spsc_block();
+                if (!block.is_valid()) break;
+                blocks = ll().prepend_list(blocks, block);
+            }
+            });
+        put_to_magazine(magazine, blocks, count);
+    }
+    /// <summary>
+    /// Allocates a list of `count` blocks for an spsc queue - from the magazine if it has enough of them, 
+    /// otherwise from the lock-free block stack (if enabled) and then under the pool's lock from the free list, refilling the magazine to half of its capacity on the way.
+    /// </summary>
+    /// <returns>Invalid if out of memory (nothing gets allocated then)</returns>
+    header_view_t alloc_spsc_blocks(buffersize_t count, block_magazine_t* magazine) {
+        if (magazine && magazine->count >= count) return take_from_magazine(magazine, count);
+        auto target_count = magazine ? count + block_magazine_t::CAPACITY / 2 : count;
+        buffersize_t ret_count = magazine ? magazine->count : 0;
+        header_view_t ret = magazine ? take_from_magazine(magazine, ret_count) : header_view_t::invalid();
+        for (auto block = header_view_t::invalid(); ret_count < target_count && try_pop_block_stack(&block); ++ret_count)
+            ret = ll().prepend_list(ret, block);
+        if (ret_count < target_count) {
+            std::lock_guard guard(*this);
+            for (; ret_count < target_count; ++ret_count) {
+                auto block = alloc_spsc_block();
+                if (!block.is_valid()) break;
+                ret = ll().prepend_list(ret, block);
+            }
+            if (ret_count < count) {
+                if (ret.is_valid()) release_spsc_blocks(ret, ret_count);
+                return header_view_t::invalid();
+            }
+        }
+        if (ret_count > count) put_to_magazine(magazine, split_blocks(ret, count), ret_count - count); //surplus goes to the magazine
+        return ret;
+    }
+    /// <summary>
+    /// Releases a list of blocks of an spsc queue - into the magazine as long as it has room, otherwise everything but half of the magazine's capacity 
+    /// (the most recently released blocks are kept) goes into the lock-free block stack (if enabled) or under the pool's lock into the free list, so that the next releases find room again.
+    /// </summary>
+    void release_spsc_blocks(header_view_t blocks, buffersize_t blocks_count, block_magazine_t* magazine) {
+        if (magazine) {
+            put_to_magazine(magazine, blocks, blocks_count);
+            if (magazine->count <= block_magazine_t::CAPACITY) return;
+            blocks = take_magazine_surplus(magazine, &blocks_count);
+        }
+        if (block_stack) {
+            push_block_stack(blocks, blocks_count);
+            return;
+        }
+        std::lock_guard guard(*this);
+        release_spsc_blocks(blocks, blocks_count);
+    }
+
+    static constexpr block_stack_word_t make_block_stack_word(block_stack_word_t tag, segment_id_t id) { return (tag << BLOCK_STACK_ID_BITS) | (block_stack_word_t)id; }
+    static constexpr segment_id_t get_block_stack_id(block_stack_word_t word) { return (segment_id_t)(word & ((block_stack_word_t(1) << BLOCK_STACK_ID_BITS) - 1)); }
+    /// <summary>
+    /// Pushes a list of blocks allocated by `alloc_spsc_block()` onto the lock-free block stack with a single compare-exchange.
+    /// Blocks in the stack are chained through `block_stack_links`, in the order of the list.
+    /// </summary>
+    void push_block_stack(header_view_t blocks, buffersize_t blocks_count) {
+        //counted before they get published, so that a pop never makes the counter go below 0
+        std::atomic_ref(block_stack->blocks_count).fetch_add((block_stack_word_t)blocks_count, std::memory_order_relaxed);
+        ll().for_each(blocks, [&](header_view_t block) {
+            std::atomic_ref(block_stack_links[block.get_segment_id()]).store((block_stack_link_t)ll().next(block).get_segment_id(), std::memory_order_relaxed);
+            });
+        std::atomic_ref last_link(block_stack_links[ll().last(blocks).get_segment_id()]);
+        std::atomic_ref top(block_stack->top);
+        auto word = top.load(std::memory_order_relaxed);
+        do {
+            last_link.store((block_stack_link_t)get_block_stack_id(word), std::memory_order_relaxed);
+        } while (!top.compare_exchange_weak(word, make_block_stack_word(word >> BLOCK_STACK_ID_BITS, blocks.get_segment_id()), std::memory_order_release, std::memory_order_relaxed));
+    }
+    /// <summary>
+    /// Pops a single block from the lock-free block stack.
+    /// </summary>
+    /// <param name="out_block">The block as a single-node list, in the state `alloc_spsc_block()` leaves it in</param>
+    /// <returns>`false` if the stack is empty</returns>
+    bool try_pop_block_stack(header_view_t* out_block) {
+        if (!block_stack) return false;
+        std::atomic_ref top(block_stack->top);
+        auto word = top.load(std::memory_order_acquire);
+        for (;;) {
+            auto id = get_block_stack_id(word);
+            if (id == queue_handle_t::empty().get_segment_id()) return false;
+            //if the block got popped by another thread in the meantime, this reads a stale id, but the tag then makes the exchange fail
+            auto next = (segment_id_t)std::atomic_ref(block_stack_links[id]).load(std::memory_order_relaxed);
+            if (top.compare_exchange_weak(word, make_block_stack_word((word >> BLOCK_STACK_ID_BITS) + 1, next), std::memory_order_acquire, std::memory_order_acquire)) {
+                std::atomic_ref(block_stack->blocks_count).fetch_sub(1, std::memory_order_relaxed);
+                *out_block = ll().init_node(get_header(id));
+                return true;
+            }
+        }
+    }
+
+    /// <summary>
+    /// Writes positions cached by a fat handle into the headers of the queue's first and last segment.
+    /// </summary>
+    void flush_fat_handle(fat_queue_handle_t* fat) {
+        if (!fat->handle.is_valid()) return;
+        auto head = get_header(fat->handle.get_segment_id());
+        auto tail = get_header(fat->tail_id);
+        head.set_segment_begin(fat->head_read_offset);
+        if (head == tail) {
+            head.set_segment_length(fat->tail_write_offset - fat->head_read_offset);
+        }
+        else {
+            head.set_segment_length(fat->head_end_offset - fat->head_read_offset);
+            tail.set_segment_length(fat->tail_write_offset - tail.get_segment_begin());
+        }
+    }
+    /// <summary>
+    /// Reads positions to be cached by a fat handle from the headers of the queue's first and last segment.
+    /// </summary>
+    void load_fat_handle(fat_queue_handle_t* fat) {
+        auto handle = fat->handle;
+        *fat = fat_queue_handle_t();
+        fat->handle = handle;
+        if (!handle.is_valid()) return;
+        auto head = get_header(handle.get_segment_id());
+        auto tail = ll().last(head);
+        fat->tail_id = tail.get_segment_id();
+        fat->head_read_offset = (std::uint32_t)head.get_segment_begin();
+        fat->head_end_offset = (std::uint32_t)(head.get_segment_begin() + head.get_segment_length());
+        fat->tail_write_offset = (std::uint32_t)(tail.get_segment_begin() + tail.get_segment_length());
+    }
+
+    segment_id_t init_free_list(segment_id_t first_block, buffersize_t owned_count) {
+        //whole owned range as few free segments as possible, each of them as long as its header is able to encode
+        header_view_t free_list = header_view_t::invalid();
+        for (buffersize_t block = first_block; block < first_block + owned_count; block += get_max_blocks_per_segment()) {
+            auto segment = get_header(block);
+            auto blocks_count = std::min<buffersize_t>(get_max_blocks_per_segment(), first_block + owned_count - block);
+            ll().init_node(segment);
+            segment.set_segment_begin(0);
+            segment.set_segment_length(blocks_count * get_block_size_bytes() - get_header_size_bytes());
+            mark_segment_free(segment, true);
+            free_list = ll().prepend_list(free_list, segment);
+        }
+        buffer->header.free_blocks_count = owned_count;
+        return free_list.is_valid() ? free_list.get_segment_id() : queue_handle_t::empty().get_segment_id();
     }
     header_view_t get_free_list(){
-        header_view_t ret = get_header(buffer->header.free_list);
-        if (ret.is_valid() && ret.get_is_free_segment()) return ret;
-        else return header_view_t::invalid();
+        return get_header(buffer->header.free_list);
     }
     void set_free_list(header_view_t h) {
-        if (h.is_valid() && h.get_is_free_segment())
+        if (h.is_valid())
             buffer->header.free_list = h.get_segment_id();
         else
-            buffer->header.free_list = 0;
+            buffer->header.free_list = queue_handle_t::empty().get_segment_id();
+    }
+    /// <summary>
+    /// Splices a list of segments that were taken from queues into the free list, accounting for the blocks being free again.
+    /// </summary>
+    void push_to_free_list(header_view_t segments, buffersize_t blocks_count) {
+        set_free_list(ll().prepend_list(get_free_list(), segments));
+        buffer->header.free_blocks_count += blocks_count;
     }
 
+    /// <summary>
+    /// Takes the first block of a segment that is part of the free list.
+    /// </summary>
+    /// <param name="free_list">Segment of the free list to allocate from - either its head, or a segment marked as free</param>
+    /// <returns>The allocated block as a single-node list with length 1, invalid if there was nothing to allocate</returns>
     header_view_t alloc_segment_from_free_list(header_view_t free_list) {
-        if (!free_list.is_valid() || !free_list.get_is_free_segment())
+        if (!free_list.is_valid())
             return header_view_t::invalid();
+        if (!free_list.get_is_free_segment()) //segment was released by destroy_queue and not normalized yet
+            init_free_list_segment(free_list);
 
         auto allocated = free_list;
         auto free_list_remaining_blocks = get_blocks_count_of_segment(free_list);
@@ -253,19 +1735,111 @@ private:
         ll().init_node(allocated);
         allocated.set_segment_begin(0);
         allocated.set_segment_length(1);
-        allocated.set_is_free_segment(false);
+        mark_segment_free(allocated, false);
+        --buffer->header.free_blocks_count;
         return allocated;
     }
-    void release_queue_to_freelist(header_view_t queue_head) {
+    /// <summary>
+    /// Splices a whole list of segments into the free list in O(1) time.
+    /// Segments are not normalized (marked as free etc.) - that is done lazily by `alloc_segment_from_free_list()`.
+    /// Only if the free block bitmap is enabled, segments must be normalized right away so that the bitmap stays accurate - O(n) time then.
+    /// </summary>
+    void release_queue_to_freelist(header_view_t queue_head, buffersize_t blocks_count) {
         if (!queue_head.is_valid()) return;
+        if (free_block_bitmap.is_valid())
+            ll().for_each(queue_head, [&](header_view_t node) { init_free_list_segment(node); });
+        push_to_free_list(queue_head, blocks_count);
+    }
+
+    /// <summary>
+    /// Runs an operation on the free list - under the pool's lock if the lock-free block stack is enabled 
+    /// (operations on regular queues are then called without holding it), directly otherwise.
+    /// </summary>
+    template<typename TFunc>
+    decltype(auto) with_free_list(TFunc operation) {
+        if (!block_stack) return operation();
+        std::lock_guard guard(*this);
+        return operation();
+    }
+    /// <summary>
+    /// Allocates a single block for a regular queue - from the thread's magazine if provided (refilling it to half of its capacity once it's empty),
+    /// otherwise from the lock-free block stack if enabled (without taking the pool's lock), otherwise or once the stack runs empty from the free list.
+    /// </summary>
+    /// <returns>The allocated block as a single-node list with length 1, invalid if out of memory</returns>
+    header_view_t alloc_block(block_magazine_t* magazine = nullptr) {
+        auto block = header_view_t::invalid();
+        if (magazine && magazine->count <= 0) refill_magazine(magazine);
+        if (magazine && magazine->count > 0) block = take_from_magazine(magazine, 1);
+        if (block.is_valid() || try_pop_block_stack(&block)) {
+            block.set_segment_begin(0);
+            block.set_segment_length(1);
+            return block;
+        }
+        return with_free_list([&] { return alloc_segment_from_free_list(get_free_list()); });
+    }
+    /// <summary>
+    /// Releases a list of segments detached from a regular queue - into the thread's magazine if provided, as long as it has room. 
+    /// With the lock-free block stack enabled, all the blocks (or the magazine's surplus) get pushed onto it one by one
+    /// (without taking the pool's lock), otherwise they get normalized and spliced into the free list.
+    /// </summary>
+    void release_segments(header_view_t segments, buffersize_t blocks_count, block_magazine_t* magazine = nullptr) {
+        if (!segments.is_valid()) return;
+        if (magazine) {
+            put_to_magazine(magazine, split_into_stack_blocks(segments), blocks_count);
+            if (magazine->count <= block_magazine_t::CAPACITY) return;
+            segments = take_magazine_surplus(magazine, &blocks_count);
+        }
+        if (block_stack) {
+            push_block_stack(magazine ? segments : split_into_stack_blocks(segments), blocks_count);
+            return;
+        }
+        ll().for_each(segments, [&](header_view_t segment) { init_free_list_segment(segment); });
+        push_to_free_list(segments, blocks_count);
+    }
+    /// <summary>
+    /// Turns a list of segments into a list of their single blocks, each in the state `alloc_spsc_block()` leaves it in, so that they can go to the lock-free block stack.
+    /// Blocks stay marked as not free, exactly like the ones allocated by spsc queues.
+    /// </summary>
+    header_view_t split_into_stack_blocks(header_view_t segments) {
+        header_view_t ret = header_view_t::invalid();
+        while (segments.is_valid()) {
+            auto segment = segments;
+            segments = ll().is_single_node(segment) ? header_view_t::invalid() : ll().disconnect_node(segment);
+            auto first_block = segment.get_segment_id();
+            auto blocks_count = get_blocks_count_of_segment(segment);
+            for (buffersize_t t = 0; t < blocks_count; ++t) {
+                auto block = ll().init_node(get_header((segment_id_t)(first_block + t)));
+                block.set_segment_begin(0);
+                block.set_segment_length(get_spsc_block_capacity());
+                block.set_is_free_segment(false);
+                ret = ll().prepend_list(ret, block);
+            }
+        }
+        return ret;
+    }
+
+    /// <summary>
+    /// Releases a range of blocks that is not part of any segment (e.g. right end of a segment that just got shortened).
+    /// </summary>
+    void release_blocks(segment_id_t first_block, buffersize_t blocks_count, block_magazine_t* magazine = nullptr) {
+        auto h = get_header(first_block);
+        if (!h.is_valid() || blocks_count <= 0) return;
+        ll().init_node(h);
+        h.set_segment_begin(0);
+        h.set_segment_length(blocks_count * get_block_size_bytes() - get_header_size_bytes());
+        release_segments(h, blocks_count, magazine);
+    }
 
-        //if freelist is invalid, it might be pointing to one of the blocks in this queue 
-        // -> we must fetch it before we set its `is_free_list` flag to true
-        auto og_free_list = get_free_list(); 
-        ll().for_each(queue_head, [&](header_view_t node) {
-            init_free_list_segment(node);
+    /// <summary>
+    /// Normalizes all the segments of the free list that were released by destroy_queue and not normalized yet, so that they are marked as free.
+    /// Runs in O(free list segments) time.
+    /// </summary>
+    void normalize_free_list() {
+        auto free_list = get_free_list();
+        if (!free_list.is_valid()) return;
+        ll().for_each(free_list, [&](header_view_t segment) {
+            if (!segment.get_is_free_segment()) init_free_list_segment(segment);
             });
-        set_free_list(ll().prepend_list(og_free_list, queue_head));
     }
 
     void init_free_list_segment(header_view_t h) {
@@ -273,7 +1847,7 @@ private:
         auto blocks_count = get_blocks_count_of_segment(h);
         h.set_segment_begin(0);
         h.set_segment_length(blocks_count * get_block_size_bytes() - get_header_size_bytes());
-        h.set_is_free_segment(true);
+        mark_segment_free(h, true);
     }
 
 #pragma endregion
@@ -282,11 +1856,20 @@ private:
 
     header_view_t trim_segment_from_left(header_view_t segment) {
         if (!segment.is_valid()) return segment;
+        return trim_segment_from_left(segment, segment.get_segment_begin());
+    }
+    /// <summary>
+    /// Same as `trim_segment_from_left(segment)`, but the segment's new begin is provided explicitly 
+    /// instead of being read from its header (thus it can be bigger than what the header is able to encode).
+    /// </summary>
+    header_view_t trim_segment_from_left(header_view_t segment, buffersize_t original_begin) {
+        if (!segment.is_valid()) return segment;
 
-        auto original_begin = segment.get_segment_begin();
         int unused_segments_count = original_begin / get_block_size_bytes();
-        if (unused_segments_count <= 0)
+        if (unused_segments_count <= 0) {
+            segment.set_segment_begin(original_begin);
             return segment;
+        }
         int bytes_to_trim = unused_segments_count * get_block_size_bytes();
 
         auto first_used_block = get_header(segment.get_segment_id() + unused_segments_count);
@@ -312,14 +1895,95 @@ private:
     }
 
 
-    bool try_grow_queue_by_1(header_view_t* queue_head) {
+    /// <summary>
+    /// Finds the physically first segment on position >= `from` that is marked as free.
+    /// </summary>
+    header_view_t find_first_free_segment(segment_id_t from) {
+        if (free_block_bitmap.is_valid()) {
+            //first free block following a non-free one is always the start of a free segment
+            auto found = free_block_bitmap.find_first_set(from);
+            return found < get_total_blocks_count() ? get_header((segment_id_t)found) : header_view_t::invalid();
+        }
+        for (buffersize_t block = from; block < get_total_blocks_count(); ) {
+            auto h = get_header((segment_id_t)block);
+            if (h.get_is_free_segment()) return h;
+            block += get_blocks_count_of_segment(h);
+        }
+        return header_view_t::invalid();
+    }
+
+    /// <summary>
+    /// Moves a segment (header and data) into the place of a free segment lying directly to its left.
+    /// The free space then ends up right behind the moved segment.
+    /// </summary>
+    /// <param name="segment">Segment to be moved, must be directly to the right of `free_segment`</param>
+    /// <param name="free_segment">Free segment to be moved into</param>
+    /// <returns>Header of the moved segment</returns>
+    header_view_t move_segment_to_free_segment(header_view_t segment, header_view_t free_segment) {
+        auto old_id = segment.get_segment_id();
+        auto new_id = free_segment.get_segment_id();
+        auto free_blocks_count = get_blocks_count_of_segment(free_segment);
+        auto blocks_count = get_blocks_count_of_segment(segment);
+
+        auto remaining_free_list = ll().is_single_node(free_segment) ? header_view_t::invalid() : ll().disconnect_node(free_segment);
+        //the segment may be a part of the free list as well, if it was released by destroy_queue and not normalized yet
+        if (remaining_free_list == segment) remaining_free_list = get_header(new_id);
+
+        //header fields are copied explicitly, as the memory policy is not required to keep the header inside the block
+        auto next_id = segment.get_next_segment_id(), last_id = segment.get_last_segment_id();
+        auto begin = segment.get_segment_begin(), length = segment.get_segment_length();
+        std::memmove(get_segment_start(new_id), get_segment_start(old_id), blocks_count * get_block_size_bytes());
+        auto moved = get_header(new_id);
+        moved.set_next_segment_id(next_id);
+        moved.set_last_segment_id(last_id);
+        moved.set_segment_begin(begin);
+        moved.set_segment_length(length);
+        if (next_id == old_id) { //segment was alone in its list
+            ll().init_node(moved);
+        }
+        else {
+            get_header(moved.get_next_segment_id()).set_last_segment_id(new_id);
+            get_header(moved.get_last_segment_id()).set_next_segment_id(new_id);
+        }
+        mark_segment_free(moved, false);
+
+        auto new_free_segment = get_header((segment_id_t)(new_id + blocks_count));
+        ll().init_node(new_free_segment);
+        new_free_segment.set_segment_begin(0);
+        new_free_segment.set_segment_length(free_blocks_count * get_block_size_bytes() - get_header_size_bytes());
+        mark_segment_free(new_free_segment, true);
+        set_free_list(ll().prepend_list(remaining_free_list, new_free_segment));
+        return moved;
+    }
+
+    /// <summary>
+    /// Tries to take the block directly to the right of a segment out of the free list, so that the segment can grow into it (multiblock segments optimization).
+    /// Fails if the block is not free, or if the segment would get too long for the header to encode its length.
+    /// Blocks in the lock-free block stack are not recognized as free. Updating the segment's length is left to the caller.
+    /// </summary>
+    bool try_take_block_to_right(header_view_t segment) {
+        auto blocks_count = get_blocks_count_of_segment(segment);
+        if (blocks_count >= get_max_blocks_per_segment()) return false;
+        auto next_block_to_right = segment.get_segment_id() + blocks_count;
+        return with_free_list([&] { return is_free_segment_start(next_block_to_right) && alloc_segment_from_free_list(get_header(next_block_to_right)).is_valid(); });
+    }
+
+    /// <summary>
+    /// Makes room for 1 more byte at the end of a queue and includes it in the queue's length.
+    /// </summary>
+    /// <param name="queue_head">First segment of the queue list (invalid if the queue is empty). Gets updated to the new first segment.</param>
+    /// <param name="blocks_delta">Gets increased by the number of blocks the queue gained</param>
+    /// <param name="magazine">Calling thread's magazine to allocate blocks from (optional)</param>
+    /// <returns>`false` if out of memory</returns>
+    bool try_grow_queue_by_1(header_view_t* queue_head, std::ptrdiff_t* blocks_delta, block_magazine_t* magazine = nullptr) {
         if (!queue_head) return false;
 
         if (!queue_head->is_valid()) { //queue is empty - we must allocate its 1st block
-            auto allocated = alloc_segment_from_free_list(get_free_list());
+            auto allocated = alloc_block(magazine);
             if (!allocated.is_valid()) return false;
             allocated.set_segment_length(1);
             *queue_head = allocated;
+            ++*blocks_delta;
             return true;
         }
 
@@ -331,28 +1995,30 @@ private:
             return true;
         }
 
-        if (use_multiblock_segments) { //try if the next block to the right is free to use
-            auto next_block_to_right = get_header(queue_tail.get_segment_id() + get_blocks_count_of_segment(queue_tail));
-
-            if (next_block_to_right.is_valid() && next_block_to_right.get_is_free_segment()) {
-                auto new_block = alloc_segment_from_free_list(next_block_to_right);
-                if (!new_block.is_valid()) return false; //this really should not happen, but whatever
-               
-                queue_tail.set_segment_length(queue_tail.get_segment_length() + 1);
-                return true;
-            }
+        if (use_multiblock_segments && try_take_block_to_right(queue_tail)) { //try if the next block to the right is free to use
+            queue_tail.set_segment_length(queue_tail.get_segment_length() + 1);
+            ++*blocks_delta;
+            return true;
         }
-        //get some random free block from the free_list
-        auto new_block = alloc_segment_from_free_list(get_free_list());
+        //get some random free block from the magazine/stack/free list
+        auto new_block = alloc_block(magazine);
         if (!new_block.is_valid()) return false;
         new_block.set_segment_begin(0);
         new_block.set_segment_length(1);
         ll().insert_list(queue_tail, new_block);
+        ++*blocks_delta;
         
         return true;
     }
 
-    bool try_shrink_queue_by_1(header_view_t* out_queue_head) {
+    /// <summary>
+    /// Removes 1 byte from the front of a queue, releasing the blocks that are no longer needed.
+    /// </summary>
+    /// <param name="out_queue_head">First segment of the queue list. Gets updated to the new first segment (invalid if the queue got emptied).</param>
+    /// <param name="blocks_delta">Gets decreased by the number of blocks the queue released</param>
+    /// <param name="magazine">Calling thread's magazine to release blocks into (optional)</param>
+    /// <returns>`false` if the queue is empty</returns>
+    bool try_shrink_queue_by_1(header_view_t* out_queue_head, std::ptrdiff_t* blocks_delta, block_magazine_t* magazine = nullptr) {
         
         if (!out_queue_head || !out_queue_head->is_valid()) return false;
         if (out_queue_head->get_segment_length() <= 0) return false;
@@ -370,8 +2036,9 @@ private:
                 *out_queue_head = ll().next(queue_head);
             
             ll().disconnect_node(queue_head);
-            init_free_list_segment(queue_head);
-            set_free_list(ll().prepend_list(get_free_list(), queue_head));
+            auto released_blocks = get_blocks_count_of_segment(queue_head);
+            release_segments(queue_head, released_blocks, magazine);
+            *blocks_delta -= (std::ptrdiff_t)released_blocks;
         }
         else{
             //let's see if any blocks from the left side can be safely freed
@@ -379,14 +2046,210 @@ private:
             *out_queue_head = shrinked;
             if (shrinked != queue_head) { //if some blocks were freed
                 ll().init_node(queue_head);
-                queue_head.set_is_free_segment(true);
-                set_free_list(ll().prepend_list(get_free_list(), queue_head));
+                auto released_blocks = get_blocks_count_of_segment(queue_head);
+                release_segments(queue_head, released_blocks, magazine);
+                *blocks_delta -= (std::ptrdiff_t)released_blocks;
+            }
+        }
+
+        return true;
+    }
+
+    /// <summary>
+    /// Removes up to `max_count` bytes from the front of a queue, passing them to the caller as contiguous runs (one per segment).
+    /// Segments that got fully consumed, as well as blocks trimmed from the new first segment, are released at once at the end (in a single splice into the free list, or a single push onto the lock-free block stack).
+    /// </summary>
+    /// <param name="queue_head">First segment of the queue list. Gets updated to the new first segment (invalid if the queue got emptied).</param>
+    /// <param name="max_count">Max ammount of bytes to consume</param>
+    /// <param name="blocks_delta">Gets decreased by the number of blocks the queue released</param>
+    /// <param name="on_run">Function to be invoked as `on_run(const byte_t* run, buffersize_t run_length)` before the run gets released</param>
+    /// <param name="magazine">Calling thread's magazine to release blocks into (optional)</param>
+    /// <returns>How many bytes were consumed</returns>
+    template<typename TFunc>
+    buffersize_t consume_front(header_view_t* queue_head, buffersize_t max_count, std::ptrdiff_t* blocks_delta, TFunc on_run, block_magazine_t* magazine = nullptr) {
+        if (!queue_head) return 0;
+
+        header_view_t released = header_view_t::invalid();
+        buffersize_t released_blocks_count = 0;
+        header_view_t head = *queue_head;
+        buffersize_t consumed = 0;
+
+        while (head.is_valid() && consumed < max_count) {
+            auto begin = head.get_segment_begin();
+            auto length = head.get_segment_length();
+            auto run_length = std::min(length, max_count - consumed);
+            if (run_length <= 0) break;
+
+            on_run(&head.get_segment_data()[begin], run_length);
+            consumed += run_length;
+
+            if (run_length >= length) { //whole segment consumed -> release it
+                auto segment = head;
+                head = ll().is_single_node(segment) ? header_view_t::invalid() : ll().disconnect_node(segment);
+                released_blocks_count += get_blocks_count_of_segment(segment);
+                released = ll().prepend_list(released, segment);
+            }
+            else { //just a part of the segment consumed -> trim the blocks that are no longer needed
+                head.set_segment_length(length - run_length);
+                auto shrinked = trim_segment_from_left(head, begin + run_length);
+                if (shrinked != head) {
+                    released_blocks_count += get_blocks_count_of_segment(head);
+                    released = ll().prepend_list(released, head);
+                }
+                head = shrinked;
             }
         }
 
+        release_segments(released, released_blocks_count, magazine);
+        *blocks_delta -= (std::ptrdiff_t)released_blocks_count;
+        *queue_head = head;
+        return consumed;
+    }
+
+    /// <summary>
+    /// Free space claimed on the back side of a queue, not yet visible as part of its content.
+    /// </summary>
+    struct back_reservation_t {
+        //original tail segment of the queue (invalid if the queue was empty) - its length is temporarily set to cover the whole claimed space
+        header_view_t tail = header_view_t::invalid();
+        //length and blocks count of the tail segment before the reservation was made
+        buffersize_t tail_length = 0;
+        buffersize_t tail_blocks = 0;
+        //newly allocated segments not yet connected to the queue - each of them has its length set to its full capacity
+        header_view_t new_segments = header_view_t::invalid();
+        //total ammount of bytes reserved
+        buffersize_t capacity = 0;
+        //blocks taken from the free list for the reservation (both grown into by the tail segment and newly allocated)
+        buffersize_t blocks_taken = 0;
+        //magazine the new blocks were allocated from - unused ones go back there
+        block_magazine_t* magazine = nullptr;
+    };
+
+    /// <summary>
+    /// Claims enough free space behind the queue's last byte to hold `count` more bytes.
+    /// Remaining space of the tail segment is used first, then (if allowed) blocks directly to its right, then blocks from the free list.
+    /// Queue content is not affected until `commit_back()` is called.
+    /// </summary>
+    /// <param name="queue_head">First segment of the queue list (invalid if the queue is empty)</param>
+    /// <param name="count">How many bytes to reserve</param>
+    /// <param name="out_reservation">Out value - the reservation</param>
+    /// <param name="allow_partial">If `true`, running out of memory just stops the reservation instead of rolling it back</param>
+    /// <param name="magazine">Calling thread's magazine to allocate blocks from (optional)</param>
+    /// <returns>`false` IFF not a single byte could be reserved, or if not everything could be reserved and `allow_partial` is not set</returns>
+    bool try_reserve_back(header_view_t queue_head, buffersize_t count, back_reservation_t* out_reservation, bool allow_partial = false, block_magazine_t* magazine = nullptr) {
+        back_reservation_t& res = *out_reservation;
+        res = back_reservation_t{};
+        res.magazine = magazine;
+
+        header_view_t current = header_view_t::invalid();
+        if (queue_head.is_valid()) {
+            current = res.tail = ll().last(queue_head);
+            res.tail_length = current.get_segment_length();
+            res.tail_blocks = get_blocks_count_of_segment(current);
+            res.capacity = get_free_space_of_segment(current);
+            current.set_segment_length(res.tail_length + res.capacity);
+        }
+
+        while (res.capacity < count) {
+            if (use_multiblock_segments && current.is_valid() && try_take_block_to_right(current)) { //try if the next block to the right is free to use
+                current.set_segment_length(current.get_segment_length() + get_block_size_bytes());
+                res.capacity += get_block_size_bytes();
+                ++res.blocks_taken;
+                continue;
+            }
+            auto new_block = alloc_block(magazine);
+            if (!new_block.is_valid()) {
+                if (allow_partial && res.capacity > 0) break;
+                std::ptrdiff_t rolled_back_blocks_delta = 0; //comes out 0 - everything taken gets released again
+                commit_back(queue_head, &res, 0, &rolled_back_blocks_delta);
+                return false;
+            }
+            new_block.set_segment_length(get_block_size_bytes() - get_header_size_bytes());
+            res.new_segments = ll().prepend_list(res.new_segments, new_block);
+            res.capacity += new_block.get_segment_length();
+            ++res.blocks_taken;
+            current = new_block;
+        }
         return true;
     }
 
+    /// <summary>
+    /// Iterates the contiguous spans of a reservation in the order they will appear in the queue.
+    /// </summary>
+    /// <param name="res">The reservation</param>
+    /// <param name="count">How many bytes from the reservation's beginning to iterate</param>
+    /// <param name="on_span">Function to be invoked as `on_span(byte_t* span, buffersize_t span_length)`</param>
+    template<typename TFunc>
+    void for_each_reserved_span(back_reservation_t& res, buffersize_t count, TFunc on_span) {
+        if (res.tail.is_valid() && count > 0) {
+            auto span_length = std::min(count, res.tail.get_segment_length() - res.tail_length);
+            if (span_length > 0) {
+                on_span(&res.tail.get_segment_data()[res.tail.get_segment_begin() + res.tail_length], span_length);
+                count -= span_length;
+            }
+        }
+        if (res.new_segments.is_valid() && count > 0) {
+            ll().for_each(res.new_segments, [&](header_view_t segment) {
+                auto span_length = std::min(count, segment.get_segment_length());
+                if (span_length <= 0) return;
+                on_span(segment.get_segment_data(), span_length);
+                count -= span_length;
+                });
+        }
+    }
+
+    /// <summary>
+    /// Makes first `count` bytes of the reservation part of the queue content and releases the unused rest of it.
+    /// Committing 0 bytes rolls the reservation back completely.
+    /// </summary>
+    /// <param name="queue_head">First segment of the queue list (invalid if the queue was empty)</param>
+    /// <param name="res">The reservation. Is invalidated by this call.</param>
+    /// <param name="count">How many bytes to commit. Must not be greater than the reservation's capacity.</param>
+    /// <param name="blocks_delta">Gets increased by the number of blocks the queue gained by the reservation and the commit together</param>
+    /// <returns>New first segment of the queue list</returns>
+    header_view_t commit_back(header_view_t queue_head, back_reservation_t* res, buffersize_t count, std::ptrdiff_t* blocks_delta) {
+        *blocks_delta += (std::ptrdiff_t)res->blocks_taken;
+        if (res->tail.is_valid())
+            count -= commit_reserved_segment(res->tail, res->tail_length, count, blocks_delta, res->magazine);
+
+        header_view_t unused = header_view_t::invalid();
+        buffersize_t unused_blocks_count = 0;
+        while (res->new_segments.is_valid()) {
+            auto segment = res->new_segments;
+            res->new_segments = ll().is_single_node(segment) ? header_view_t::invalid() : ll().disconnect_node(segment);
+            if (count > 0) {
+                count -= commit_reserved_segment(segment, 0, count, blocks_delta, res->magazine);
+                queue_head = ll().prepend_list(queue_head, segment);
+            }
+            else {
+                unused_blocks_count += get_blocks_count_of_segment(segment);
+                unused = ll().prepend_list(unused, segment);
+            }
+        }
+        release_segments(unused, unused_blocks_count, res->magazine);
+        *blocks_delta -= (std::ptrdiff_t)unused_blocks_count;
+        *res = back_reservation_t{};
+        return queue_head;
+    }
+
+    /// <summary>
+    /// Sets the length of a reserved segment according to how much of its reserved space actually got used and frees the blocks that were not needed.
+    /// </summary>
+    /// <param name="blocks_delta">Gets decreased by the number of blocks freed</param>
+    /// <param name="magazine">Magazine to release the freed blocks into (optional)</param>
+    /// <returns>How many bytes of the segment's reserved space were used</returns>
+    buffersize_t commit_reserved_segment(header_view_t segment, buffersize_t original_length, buffersize_t count, std::ptrdiff_t* blocks_delta, block_magazine_t* magazine = nullptr) {
+        auto reserved_blocks = get_blocks_count_of_segment(segment);
+        auto used = std::min(count, segment.get_segment_length() - original_length);
+        segment.set_segment_length(original_length + used);
+        auto used_blocks = get_blocks_count_of_segment(segment);
+        if (used_blocks < reserved_blocks) {
+            release_blocks(segment.get_segment_id() + used_blocks, reserved_blocks - used_blocks, magazine);
+            *blocks_delta -= (std::ptrdiff_t)(reserved_blocks - used_blocks);
+        }
+        return used;
+    }
+
     /// <summary>
     /// Gets pointer to the entry that was enqueued into the queue
     /// </summary>
@@ -408,7 +2271,7 @@ private:
     /// <param name="out_byte_ptr">Out value - pointer to the next entry to be dequeued</param>
     /// <returns>`true` IFF the queue is non-empty</returns>
     bool try_peak_back(header_view_t queue_head, byte_t** out_byte_ptr) {
-        if (!queue_head.is_valid()) return false;
+        if (!queue_head.is_valid() || queue_head.get_segment_length() <= 0) return false; //last segment can be empty if its space was reserved, but nothing committed yet
 
         if (out_byte_ptr) *out_byte_ptr = &queue_head.get_segment_data()[queue_head.get_segment_begin()];
         return true;
@@ -0,0 +1,235 @@
+#ifndef SHARDED_QUEUE_POOL__guard___g4fd98g4d6s5f4g9e8r4t6h5j4k9
+#define SHARDED_QUEUE_POOL__guard___g4fd98g4d6s5f4g9e8r4t6h5j4k9
+
+#include<algorithm>
+#include<array>
+#include<cstdint>
+#include<functional>
+#include<mutex>
+#include<thread>
+#include<utility>
+
+#include "queue_pool.h"
+
+
+
+namespace markussecundus::queue_pooling{
+
+/// <summary>
+/// Splits one buffer into `SHARDS_COUNT` `queue_pool_t`s (shards), each with its own header area and free list starting on its own cache line,
+/// that share a single array of blocks (see `queue_pool_t::shared_blocks_t`) - each shard initially owns an equal part of it.
+///
+/// Every queue lives in exactly one shard, whose index is encoded in its handle. By default, a new queue goes to the shard
+/// picked by the id of the creating thread, so threads that mostly work with queues they created themselves don't share any state with each other.
+/// Each operation takes only the lock of the queue's own shard, which is never contended unless threads access the same shard.
+///
+/// Segment ids are global to the whole array, so free blocks can move between shards: when an enqueue fails because the queue's shard ran out of them,
+/// the shard with the most free blocks donates half of them and the enqueue gets retried.
+/// The memory policy must thus be able to address all the blocks of the buffer (e.g. `wide16_memory_policy` for more than 254 blocks).
+/// </summary>
+/// <typeparam name="SHARDS_COUNT">How many shards to split the buffer into - e.g. number of worker threads.</typeparam>
+/// <typeparam name="TMemoryPolicy">Memory policy used by every shard.</typeparam>
+template<std::size_t SHARDS_COUNT, memory_policies::memory_policy TMemoryPolicy = memory_policies::standard_memory_policy>
+class sharded_queue_pool_t {
+    static_assert(SHARDS_COUNT > 0 && SHARDS_COUNT <= 256, "Shard index must fit into a byte");
+public:
+    using pool_t = queue_pool_t<TMemoryPolicy>;
+    static constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+    struct queue_handle_t {
+        /// <summary>
+        /// Index of the shard the queue lives in.
+        /// </summary>
+        buffersize_t get_shard_index()const { return shard; }
+        bool is_uninitialized() { return handle.is_uninitialized(); }
+    private:
+        friend class sharded_queue_pool_t;
+        typename pool_t::queue_handle_t handle = pool_t::queue_handle_t::uninitialized();
+        std::uint8_t shard = 0;
+    };
+
+    /// <summary>
+    /// Lock-free block stack is not supported by the shards (the option is ignored) - they are always operated while holding their lock.
+    /// </summary>
+    template<typename ...Args>
+    sharded_queue_pool_t(byte_t* buffer_, buffersize_t buffer_size_, queue_pool_options_t options_, Args ...args)
+        : blocks_count(get_blocks_count(buffer_, buffer_size_, options_, args...))
+        , shards(make_shards(buffer_, blocks_count, options_, std::make_index_sequence<SHARDS_COUNT>{}, args...))
+    {}
+
+    /// <summary>
+    /// Initializes all the shards, giving each of them an equal part of the blocks. Should be called before the pool is used for the first time.
+    /// </summary>
+    void init() {
+        for (buffersize_t t = 0; t < SHARDS_COUNT; ++t)
+            shards[t].init((segment_id_t)(t * blocks_count / SHARDS_COUNT), (t + 1) * blocks_count / SHARDS_COUNT - t * blocks_count / SHARDS_COUNT);
+    }
+
+    /// <summary>
+    /// Direct access to a shard, e.g. for its statistics. Shard's lock must be held while using it if other threads might access it concurrently.
+    /// </summary>
+    pool_t& get_shard(buffersize_t shard_index) { return shards[shard_index]; }
+    /// <summary>
+    /// Index of the shard that queues created by the calling thread go to by default.
+    /// </summary>
+    static buffersize_t get_thread_shard_index() { return std::hash<std::thread::id>{}(std::this_thread::get_id()) % SHARDS_COUNT; }
+
+    /// <summary>
+    /// Creates a new queue in the calling thread's shard.
+    /// Runs in O(1) time.
+    /// </summary>
+    queue_handle_t make_queue() { return make_queue(get_thread_shard_index()); }
+    /// <summary>
+    /// Creates a new queue in a specific shard (e.g. one chosen by hash of some key of the queue).
+    /// Runs in O(1) time.
+    /// </summary>
+    queue_handle_t make_queue(buffersize_t shard_index) {
+        queue_handle_t ret;
+        ret.shard = (std::uint8_t)(shard_index % SHARDS_COUNT);
+        std::lock_guard guard(shards[ret.shard]);
+        ret.handle = shards[ret.shard].make_queue();
+        return ret;
+    }
+
+    /// <summary>
+    /// How many bytes are stored in a queue. Takes the lock of the queue's shard.
+    /// Runs in O(number of the queue's segments) time.
+    /// </summary>
+    buffersize_t size(queue_handle_t handle) {
+        std::lock_guard guard(shards[handle.shard]);
+        return shards[handle.shard].size(handle.handle);
+    }
+    /// <summary>
+    /// How many blocks are available for allocation, summed over all the shards.
+    /// Runs in O(SHARDS_COUNT) time.
+    /// </summary>
+    buffersize_t free_blocks() {
+        buffersize_t ret = 0;
+        for (auto& shard : shards) {
+            std::lock_guard guard(shard);
+            ret += shard.free_blocks();
+        }
+        return ret;
+    }
+    /// <summary>
+    /// How many blocks are occupied by queues, summed over all the shards.
+    /// Runs in O(SHARDS_COUNT) time.
+    /// </summary>
+    buffersize_t used_blocks() {
+        buffersize_t ret = 0;
+        for (auto& shard : shards) {
+            std::lock_guard guard(shard);
+            ret += shard.used_blocks();
+        }
+        return ret;
+    }
+
+    /// <summary>
+    /// Same as `queue_pool_t::try_enqueue_byte()` applied to the queue's shard.
+    /// </summary>
+    bool try_enqueue_byte(queue_handle_t* handle_ptr, byte_t to_enqueue) {
+        return with_donated_blocks(handle_ptr, [&](pool_t& shard) { return shard.try_enqueue_byte(&handle_ptr->handle, to_enqueue); });
+    }
+    /// <summary>
+    /// Same as `queue_pool_t::try_dequeue_byte()` applied to the queue's shard.
+    /// </summary>
+    bool try_dequeue_byte(queue_handle_t* handle_ptr, byte_t* out_byte) {
+        std::lock_guard guard(shards[handle_ptr->shard]);
+        return shards[handle_ptr->shard].try_dequeue_byte(&handle_ptr->handle, out_byte);
+    }
+    /// <summary>
+    /// Same as `queue_pool_t::try_enqueue_bytes()` applied to the queue's shard.
+    /// </summary>
+    bool try_enqueue_bytes(queue_handle_t* handle_ptr, const byte_t* data, buffersize_t count) {
+        return with_donated_blocks(handle_ptr, [&](pool_t& shard) { return shard.try_enqueue_bytes(&handle_ptr->handle, data, count); });
+    }
+    /// <summary>
+    /// Same as `queue_pool_t::try_dequeue_bytes()` applied to the queue's shard.
+    /// </summary>
+    buffersize_t try_dequeue_bytes(queue_handle_t* handle_ptr, byte_t* out_data, buffersize_t max_count) {
+        std::lock_guard guard(shards[handle_ptr->shard]);
+        return shards[handle_ptr->shard].try_dequeue_bytes(&handle_ptr->handle, out_data, max_count);
+    }
+    /// <summary>
+    /// Destroys the queue and releases its blocks into its shard's free list.
+    /// </summary>
+    void destroy_queue(queue_handle_t* handle_ptr) {
+        {
+            std::lock_guard guard(shards[handle_ptr->shard]);
+            shards[handle_ptr->shard].destroy_queue(&handle_ptr->handle);
+        }
+        *handle_ptr = queue_handle_t();
+    }
+
+private:
+    using segment_id_t = typename pool_t::segment_id_t;
+
+    segment_id_t blocks_count;
+    std::array<pool_t, SHARDS_COUNT> shards;
+
+    static buffersize_t get_padding(byte_t* buffer) { return (CACHE_LINE_SIZE - reinterpret_cast<std::uintptr_t>(buffer) % CACHE_LINE_SIZE) % CACHE_LINE_SIZE; }
+    //header area of every shard takes whole cache lines, so that headers of neighbouring shards never share one
+    static buffersize_t get_header_area_bytes(segment_id_t blocks_count, queue_pool_options_t options) {
+        return math::divide_round_up(pool_t::get_shared_header_area_bytes(blocks_count, options), CACHE_LINE_SIZE) * CACHE_LINE_SIZE;
+    }
+    /// <summary>
+    /// How many blocks fit into the buffer behind the header areas of all the shards.
+    /// </summary>
+    template<typename ...Args>
+    static segment_id_t get_blocks_count(byte_t* buffer, buffersize_t buffer_size, queue_pool_options_t options, Args ...args) {
+        auto available = buffer_size - std::min(buffer_size, get_padding(buffer) + pool_t::get_block_alignment() - 1); //worst case padding of the blocks
+        buffersize_t block_size = TMemoryPolicy(args...).get_block_size_bytes();
+        auto ret = (segment_id_t)std::min<buffersize_t>(TMemoryPolicy::get_addressable_blocks_count() - pool_t::queue_handle_t::SPECIAL_VALUES_COUNT, available / block_size);
+        //header areas grow with the blocks count (free block bitmap), so the count might need to shrink a bit
+        while (ret > 0 && SHARDS_COUNT * get_header_area_bytes(ret, options) + ret * block_size > available) --ret;
+        return ret;
+    }
+
+    //header areas of all the shards | alignment padding (optional) | blocks shared by all the shards...
+    template<std::size_t ...SHARD_INDICES, typename ...Args>
+    static std::array<pool_t, SHARDS_COUNT> make_shards(byte_t* buffer, segment_id_t blocks_count, queue_pool_options_t options, std::index_sequence<SHARD_INDICES...>, Args ...args) {
+        byte_t* headers = buffer + get_padding(buffer);
+        auto header_area_bytes = get_header_area_bytes(blocks_count, options);
+        byte_t* blocks = headers + SHARDS_COUNT * header_area_bytes;
+        blocks += (pool_t::get_block_alignment() - reinterpret_cast<std::uintptr_t>(blocks) % pool_t::get_block_alignment()) % pool_t::get_block_alignment();
+        //shards are operated only while holding their lock, which operations on regular queues of a pool with the lock-free block stack would try to take again
+        options.use_lock_free_block_stack = false;
+        return { pool_t(headers + SHARD_INDICES * header_area_bytes, typename pool_t::shared_blocks_t{ blocks, blocks_count }, options, args...)... };
+    }
+
+    /// <summary>
+    /// Runs an enqueue operation on the queue's shard. If it fails, the shard with the most free blocks donates half of them (at least 1) 
+    /// to the queue's shard and the operation is tried once more - it still fails if it needs more blocks than that.
+    /// 
+    /// The shard with the most free blocks is only a snapshot, so the donation is done while holding locks of both shards
+    /// (taken in the order of shard indices, so that two threads borrowing blocks in opposite directions can't deadlock), 
+    /// and the operation runs before they are released.
+    /// </summary>
+    template<typename TFunc>
+    bool with_donated_blocks(queue_handle_t* handle_ptr, TFunc operation) {
+        auto own = handle_ptr->shard;
+        {
+            std::lock_guard guard(shards[own]);
+            if (operation(shards[own])) return true;
+        }
+        auto donor = own;
+        buffersize_t best_free_blocks = 0;
+        for (buffersize_t t = 0; t < SHARDS_COUNT; ++t) {
+            if (t == own) continue;
+            std::lock_guard guard(shards[t]);
+            if (shards[t].free_blocks() > best_free_blocks) {
+                best_free_blocks = shards[t].free_blocks();
+                donor = (std::uint8_t)t;
+            }
+        }
+        if (donor == own) return false;
+        std::lock_guard first_guard(shards[std::min(own, donor)]);
+        std::lock_guard second_guard(shards[std::max(own, donor)]);
+        shards[donor].donate_free_blocks(&shards[own], std::max<buffersize_t>(1, shards[donor].free_blocks() / 2));
+        return operation(shards[own]);
+    }
+};
+
+}
+
+#endif
@@ -5,13 +5,29 @@
 #define QUEUE_TEST_CLASS tests::QueuePoolTest
 
 #include "../queue_pool.h"
+#include "../async_queue_pool.h"
+#include "../typed_queue_view.h"
+#include "../drr_scheduler.h"
+#include "../sharded_queue_pool.h"
+#include "../persistent_queue_pool.h"
 
 using namespace markussecundus::queue_pooling;
 using namespace markussecundus::queue_pooling::memory_policies;
 
 
 #include<array>
+#include<atomic>
+#include<chrono>
 #include<deque>
+#include<filesystem>
+#include<random>
+#include<span>
+#include<thread>
+#include<vector>
+
+#ifdef QUEUE_POOL_FD_IO_SUPPORTED
+#include<unistd.h>
+#endif
 
 
 
@@ -60,6 +76,57 @@ namespace tests{
             wrt << "\n";
         }
 
+        /// Checks that every block of the pool belongs either to one of the queues, or to the free list, and that the O(1) counters (of the pool and of the queues, if provided) agree with that.
+        template<memory_policy TMemoryPolicy, std::size_t QUEUES_COUNT>
+        bool validate_blocks_accounting(queue_pool_t<TMemoryPolicy>& pool, std::array<typename queue_pool_t<TMemoryPolicy>::queue_handle_t, QUEUES_COUNT>& queues,
+                const std::array<typename queue_pool_t<TMemoryPolicy>::queue_counters_t, QUEUES_COUNT>* counters = nullptr) {
+            bool ret = true;
+            buffersize_t blocks_total = 0, list_blocks = 0, list_length = 0;
+            auto count_list = [&](typename queue_pool_t<TMemoryPolicy>::header_view_t h) {
+                list_blocks = list_length = 0;
+                if (!h.is_valid()) return;
+                pool.ll().for_each(h, [&](typename queue_pool_t<TMemoryPolicy>::header_view_t node) { 
+                    list_blocks += pool.get_blocks_count_of_segment(node); 
+                    list_length += node.get_segment_length();
+                    });
+                blocks_total += list_blocks;
+            };
+            for (std::size_t t = 0; t < QUEUES_COUNT; ++t) {
+                auto& q = queues[t];
+                if (!q.is_valid()) {
+                    if (counters && ((*counters)[t].get_length() != 0 || (*counters)[t].get_blocks_count() != 0)) ret = false;
+                    continue;
+                }
+                count_list(pool.get_header(q.get_segment_id()));
+                if (list_length != pool.size(q)) ret = false;
+                if (counters && (list_length != pool.size((*counters)[t]) || list_blocks != (*counters)[t].get_blocks_count())) ret = false;
+            }
+            count_list(pool.get_free_list());
+            if (list_blocks != pool.free_blocks() || pool.used_blocks() + pool.free_blocks() != pool.get_total_blocks_count()) ret = false;
+            return ret && blocks_total == pool.get_total_blocks_count();
+        }
+
+        /// Walks all the segments in the order they are laid out in the buffer and checks that the free block bitmap agrees with their `is_free` flags.
+        template<memory_policy TMemoryPolicy>
+        bool validate_free_block_bitmap(queue_pool_t<TMemoryPolicy>& pool) {
+            if (!pool.free_block_bitmap.is_valid()) return true;
+            bool ret = true;
+            buffersize_t first_free_block = pool.get_total_blocks_count();
+            for (buffersize_t block = 0; block < pool.get_total_blocks_count(); ) {
+                auto h = pool.get_header(block);
+                auto blocks_count = pool.get_blocks_count_of_segment(h);
+                for (buffersize_t t = block; t < block + blocks_count; ++t)
+                    if (pool.free_block_bitmap.get(t) != h.get_is_free_segment()) ret = false;
+                if (h.get_is_free_segment() && first_free_block >= pool.get_total_blocks_count())
+                    first_free_block = block;
+                block += blocks_count;
+            }
+            typename queue_pool_t<TMemoryPolicy>::segment_id_t found;
+            if (pool.try_find_first_free_block(0, &found) ? (found != first_free_block) : (first_free_block < pool.get_total_blocks_count()))
+                ret = false;
+            return ret;
+        }
+
         struct Helper2;
     };
 
@@ -89,7 +156,8 @@ namespace tests{
 
         auto q = pool.make_queue();
         auto header = pool.get_header(q.get_segment_id());
-        std::cout << pool.try_grow_queue_by_1(&header) <<"\n";
+        std::ptrdiff_t blocks_delta = 0;
+        std::cout << pool.try_grow_queue_by_1(&header, &blocks_delta) <<"\n";
     }
 
 
@@ -372,6 +440,124 @@ namespace tests{
             if (emptiness_fails) std::cout << ERR_MSG("!EMPTINESS FAILS: " << emptiness_fails) << "\n";
         }
 
+        template<std::size_t BUFFER_SIZE, std::size_t BLOCK_SIZE, std::size_t QUEUES_COUNT, std::size_t OPERATIONS_COUNT, std::size_t MAX_ELEMENTS_IN_QUEUE, std::size_t MAX_CHUNK, int DEQUEUE_CHANCE, bool BIG_SEGMENTS, bool FREE_BLOCK_BITMAP = false, memory_policy TMemoryPolicy = standard_memory_policy, bool KEEP_COUNTERS = true>
+        void test_queue_randomized_bulk_impl() {
+            std::cout << "\n***********************\nRANDOMIZED_TEST_BULK(header_size=" << TMemoryPolicy::get_header_size_bytes() << ", counters=" << KEEP_COUNTERS << ", big_segments=" << BIG_SEGMENTS << ", free_block_bitmap=" << FREE_BLOCK_BITMAP << ", buffer_size=" << BUFFER_SIZE << ", block_size=" << BLOCK_SIZE << ", queues_count=" << QUEUES_COUNT << ", ops_count=" << OPERATIONS_COUNT << ", max_elems_in_queue=" << MAX_ELEMENTS_IN_QUEUE << ", max_chunk=" << MAX_CHUNK << ", dequeue=1/" << DEQUEUE_CHANCE << ")\n";
+
+            int enqueue_skips = 0;
+            int enqueue_fails = 0;
+            int value_fails = 0;
+            int emptiness_fails = 0;
+            int accounting_fails = 0;
+
+            using pool_t = queue_pool_t<TMemoryPolicy>;
+
+            byte_t buffer[BUFFER_SIZE];
+            pool_t pool(buffer, BUFFER_SIZE, queue_pool_options_t{ .use_multiblock_segments = BIG_SEGMENTS, .use_free_block_bitmap = FREE_BLOCK_BITMAP }, BLOCK_SIZE);
+            pool.init();
+
+            std::array<typename pool_t::queue_handle_t, QUEUES_COUNT> queues{};
+            std::array<typename pool_t::queue_counters_t, QUEUES_COUNT> counters{};
+            std::array<typename std::deque<byte_t>, QUEUES_COUNT> std_queues{};
+
+            for (std::size_t t = 0; t < QUEUES_COUNT; ++t)
+                queues[t] = pool.make_queue();
+
+            byte_t chunk[MAX_CHUNK];
+            for (std::size_t op_ = 0; op_ < OPERATIONS_COUNT; ++op_) {
+                int queue_index = std::rand() % QUEUES_COUNT;
+                auto counters_ptr = KEEP_COUNTERS ? &counters[queue_index] : nullptr;
+
+                if (!(std::rand() % 500)) { //destroy
+                    std_queues[queue_index].clear();
+                    pool.destroy_queue(&queues[queue_index], counters_ptr);
+                    queues[queue_index] = pool.make_queue();
+                }
+                else if (!(std::rand() % 100)) { //defragment the free list a bit
+                    pool.coalesce_free_segments(1 + std::rand() % 16);
+                }
+                else if (!(std::rand() % 100)) { //move some live segments around
+                    pool.compact(1 + std::rand() % 16, std::span(queues));
+                }
+                else if (std::rand() % DEQUEUE_CHANCE) { //enqueue
+                    std::size_t chunk_length = 1 + std::rand() % MAX_CHUNK;
+                    if (std_queues[queue_index].size() + chunk_length > MAX_ELEMENTS_IN_QUEUE) {
+                        ++enqueue_skips;
+                        continue;
+                    }
+                    if (std::rand() & 1) { //produce directly into the pool
+                        std::size_t min_length = std::min<std::size_t>(chunk_length, 1 + std::rand() % (BLOCK_SIZE - TMemoryPolicy::get_header_size_bytes()));
+                        auto span = pool.reserve(&(queues[queue_index]), min_length, chunk_length, counters_ptr);
+                        if (span.size() < min_length || span.size() > chunk_length) {
+                            ++enqueue_fails;
+                            continue;
+                        }
+                        std::size_t to_commit = std::rand() % (span.size() + 1);
+                        for (std::size_t t = 0; t < to_commit; ++t)
+                            std_queues[queue_index].push_back(span[t] = (byte_t)std::rand());
+                        if (!pool.commit(&(queues[queue_index]), to_commit, counters_ptr)) {
+                            ++value_fails;
+                            std::cout << op_ << ")... " << "commit of " << to_commit << " bytes failed\n";
+                        }
+                    }
+                    else {
+                        for (std::size_t t = 0; t < chunk_length; ++t)
+                            chunk[t] = (byte_t)std::rand();
+                        if (!pool.try_enqueue_bytes(&(queues[queue_index]), chunk, chunk_length, counters_ptr)) {
+                            ++enqueue_fails;
+                            continue;
+                        }
+                        std_queues[queue_index].insert(std_queues[queue_index].end(), chunk, chunk + chunk_length);
+                    }
+                }
+                else if (std::rand() & 1) { //dequeue single byte
+                    byte_t my_byte = 0, std_byte = 0;
+                    bool std_empty = std_queues[queue_index].size() <= 0;
+                    if (!std_empty) {
+                        std_byte = std_queues[queue_index].front();
+                        std_queues[queue_index].pop_front();
+                    }
+                    bool my_empty = !pool.try_dequeue_byte(&(queues[queue_index]), &my_byte, counters_ptr);
+
+                    if (std_empty != my_empty) {
+                        ++emptiness_fails;
+                        std::cout << op_ << ")... " << "emptiness difference: std(empty=" << std_empty << "), my(empty=" << my_empty << ")\n";
+                    }
+                    else if (std_byte != my_byte) {
+                        ++value_fails;
+                        std::cout << op_ << ")... " << "value difference: std(" << (int)std_byte << "), my(" << (int)my_byte << ")\n";
+                    }
+                }
+                else { //dequeue chunk
+                    std::size_t chunk_length = 1 + std::rand() % MAX_CHUNK;
+                    std::size_t std_length = std::min(chunk_length, std_queues[queue_index].size());
+                    std::size_t my_length = pool.try_dequeue_bytes(&(queues[queue_index]), chunk, chunk_length, counters_ptr);
+
+                    if (std_length != my_length) {
+                        ++emptiness_fails;
+                        std::cout << op_ << ")... " << "length difference: std(" << std_length << "), my(" << my_length << ")\n";
+                    }
+                    for (std::size_t t = 0; t < std::min(std_length, my_length); ++t) {
+                        if (std_queues[queue_index][t] != chunk[t]) {
+                            ++value_fails;
+                            std::cout << op_ << ")... " << "value difference at " << t << ": std(" << (int)std_queues[queue_index][t] << "), my(" << (int)chunk[t] << ")\n";
+                            break;
+                        }
+                    }
+                    std_queues[queue_index].erase(std_queues[queue_index].begin(), std_queues[queue_index].begin() + std_length);
+                }
+                if (!Helper{}.validate_blocks_accounting(pool, queues, KEEP_COUNTERS ? &counters : nullptr) || !Helper{}.validate_free_block_bitmap(pool) || pool.size(queues[queue_index]) != std_queues[queue_index].size())
+                    ++accounting_fails;
+            }
+
+            std::cout << "\n*TEST FINISHED!\n";
+            std::cout << "enqueue skips: " << enqueue_skips << "\n";
+            if (enqueue_fails) std::cout << WARN_MSG("!ENQUEUE FAILS: " << enqueue_fails) << "\n";
+            if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+            if (emptiness_fails) std::cout << ERR_MSG("!EMPTINESS FAILS: " << emptiness_fails) << "\n";
+            if (accounting_fails) std::cout << ERR_MSG("!ACCOUNTING FAILS: " << accounting_fails) << "\n";
+        }
+
     };
 
 
@@ -462,6 +648,1364 @@ namespace tests{
 
 
 
+    void QueuePoolTest::test_queue_randomized_bulk() {
+        std::cout << "\n---------------------------------\nRANDOMIZED_TESTS_BULK...\n";
+
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<2048, 24, 15, 20000, 120, 40, 2, false>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<1920, 15, 64, 20000, 16, 8, 2, false>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<1920, 64, 2, 20000, 800, 200, 5, false>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<4096, 44, 30, 20000, 80, 60, 5, false>();
+
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<2048, 24, 15, 20000, 120, 40, 2, true>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<1920, 15, 64, 20000, 16, 8, 2, true>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<1920, 64, 2, 20000, 800, 200, 5, true>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<4096, 44, 30, 20000, 80, 60, 5, true>();
+
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<2048, 24, 15, 20000, 120, 40, 2, false, true>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<2048, 24, 15, 20000, 120, 40, 2, true, true>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<1920, 15, 64, 20000, 16, 8, 2, true, true>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<4096, 44, 30, 20000, 80, 60, 5, true, true>();
+    }
+
+
+    void QueuePoolTest::test_coalescing() {
+        std::cout << "\n---------------------------------\nCOALESCING...\n";
+
+        constexpr std::size_t BUFFER_SIZE = 8192, BLOCK_SIZE = 24, QUEUES_COUNT = 20, ROUNDS_COUNT = 10, OPERATIONS_COUNT = 5000;
+
+        int fragmentation_fails = 0;
+        int accounting_fails = 0;
+
+        using pool_t = queue_pool_t<standard_memory_policy>;
+        for (bool bitmap : {false, true}) {
+            byte_t buffer[BUFFER_SIZE];
+            pool_t pool(buffer, BUFFER_SIZE, queue_pool_options_t{ .use_multiblock_segments = true, .use_free_block_bitmap = bitmap }, BLOCK_SIZE);
+            pool.init();
+            auto initial_free_segments = pool.ll().length(pool.get_free_list());
+
+            std::array<pool_t::queue_handle_t, QUEUES_COUNT> queues{};
+            for (std::size_t round = 0; round < ROUNDS_COUNT; ++round) {
+                //churn to shatter the free list...
+                for (std::size_t op_ = 0; op_ < OPERATIONS_COUNT; ++op_) {
+                    auto& q = queues[std::rand() % QUEUES_COUNT];
+                    byte_t b = 0;
+                    if (std::rand() % 3) pool.try_enqueue_byte(&q, b);
+                    else pool.try_dequeue_byte(&q, &b);
+                }
+                for (auto& q : queues)
+                    pool.destroy_queue(&q);
+                auto shattered_free_segments = pool.ll().length(pool.get_free_list());
+
+                //...and glue it back together in small steps
+                while (pool.coalesce_free_segments(1 + std::rand() % 8) > 0 || pool.coalesce_free_segments(pool.get_total_blocks_count()) > 0);
+                auto coalesced_free_segments = pool.ll().length(pool.get_free_list());
+
+                std::cout << "bitmap=" << bitmap << ", round " << round << ")... free segments: " << shattered_free_segments << " -> " << coalesced_free_segments << "\n";
+                //merging is greedy, so with segments being capped by max encodable length, it can end up with at most twice as many segments as are optimal
+                if (coalesced_free_segments > 2 * initial_free_segments - 1) ++fragmentation_fails;
+                if (!Helper{}.validate_blocks_accounting(pool, queues) || !Helper{}.validate_free_block_bitmap(pool)) ++accounting_fails;
+            }
+        }
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (fragmentation_fails) std::cout << ERR_MSG("!FRAGMENTATION FAILS: " << fragmentation_fails) << "\n";
+        if (accounting_fails) std::cout << ERR_MSG("!ACCOUNTING FAILS: " << accounting_fails) << "\n";
+    }
+
+    void QueuePoolTest::test_compaction() {
+        std::cout << "\n---------------------------------\nCOMPACTION...\n";
+
+        constexpr std::size_t BUFFER_SIZE = 4096, BLOCK_SIZE = 24, QUEUES_COUNT = 20, ROUNDS_COUNT = 10, OPERATIONS_COUNT = 5000;
+
+        int value_fails = 0;
+        int fragmentation_fails = 0;
+        int accounting_fails = 0;
+
+        using pool_t = queue_pool_t<standard_memory_policy>;
+        for (bool big_segments : {false, true}) for (bool bitmap : {false, true}) {
+            byte_t buffer[BUFFER_SIZE];
+            pool_t pool(buffer, BUFFER_SIZE, queue_pool_options_t{ .use_multiblock_segments = big_segments, .use_free_block_bitmap = bitmap }, BLOCK_SIZE);
+            pool.init();
+
+            std::array<pool_t::queue_handle_t, QUEUES_COUNT> queues{};
+            std::array<std::deque<byte_t>, QUEUES_COUNT> std_queues{};
+            for (std::size_t round = 0; round < ROUNDS_COUNT; ++round) {
+                //churn to scatter the live segments all over the buffer...
+                for (std::size_t op_ = 0; op_ < OPERATIONS_COUNT; ++op_) {
+                    auto queue_index = std::rand() % QUEUES_COUNT;
+                    byte_t b = (byte_t)std::rand();
+                    if (!(std::rand() % 400)) {
+                        pool.destroy_queue(&queues[queue_index]);
+                        std_queues[queue_index].clear();
+                    }
+                    else if (std::rand() % 3) {
+                        if (pool.try_enqueue_byte(&queues[queue_index], b)) std_queues[queue_index].push_back(b);
+                    }
+                    else if (pool.try_dequeue_byte(&queues[queue_index], &b)) std_queues[queue_index].pop_front();
+                }
+                if (round % 2) pool.coalesce_free_segments(pool.get_total_blocks_count()); //compaction must cope with segments released by destroy_queue that were not normalized yet as well
+
+                //...and slide them all to the beginning in small steps
+                buffersize_t steps_count = 0;
+                for (buffersize_t steps; (steps = pool.compact(1 + std::rand() % 8, std::span(queues))) > 0; steps_count += steps)
+                    if (!Helper{}.validate_blocks_accounting(pool, queues) || !Helper{}.validate_free_block_bitmap(pool)) ++accounting_fails;
+
+                //after the first free block there must be nothing but free blocks
+                bool reached_free_space = false;
+                for (buffersize_t block = 0; block < pool.get_total_blocks_count(); ) {
+                    auto h = pool.get_header((segment_id_t)block);
+                    if (h.get_is_free_segment()) reached_free_space = true;
+                    else if (reached_free_space) { ++fragmentation_fails; break; }
+                    block += pool.get_blocks_count_of_segment(h);
+                }
+                std::cout << "big_segments=" << big_segments << ", bitmap=" << bitmap << ", round " << round << ")... compaction steps: " << steps_count << "\n";
+
+                for (std::size_t t = 0; t < QUEUES_COUNT; ++t) {
+                    for (auto expected : std_queues[t]) {
+                        byte_t b;
+                        if (!pool.try_dequeue_byte(&queues[t], &b) || b != expected) { ++value_fails; break; }
+                    }
+                    for (auto expected : std_queues[t]) 
+                        pool.try_enqueue_byte(&queues[t], expected);
+                }
+            }
+        }
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+        if (fragmentation_fails) std::cout << ERR_MSG("!FRAGMENTATION FAILS: " << fragmentation_fails) << "\n";
+        if (accounting_fails) std::cout << ERR_MSG("!ACCOUNTING FAILS: " << accounting_fails) << "\n";
+    }
+
+    void QueuePoolTest::test_fd_io() {
+        std::cout << "\n---------------------------------\nFD_IO...\n";
+#ifndef QUEUE_POOL_FD_IO_SUPPORTED
+        std::cout << "not supported on this platform\n";
+#else
+        constexpr std::size_t BUFFER_SIZE = 1920, BLOCK_SIZE = 24, QUEUES_COUNT = 8, OPERATIONS_COUNT = 20000, MAX_ELEMENTS_IN_QUEUE = 160, MAX_CHUNK = 100;
+
+        int io_fails = 0;
+        int value_fails = 0;
+        int accounting_fails = 0;
+
+        using pool_t = queue_pool_t<standard_memory_policy>;
+        byte_t src_buffer[BUFFER_SIZE], dst_buffer[BUFFER_SIZE];
+        pool_t src_pool(src_buffer, BUFFER_SIZE, false, BLOCK_SIZE);
+        pool_t dst_pool(dst_buffer, BUFFER_SIZE, true, BLOCK_SIZE);
+        src_pool.init();
+        dst_pool.init();
+
+        int pipe_fds[2];
+        if (::pipe(pipe_fds)) {
+            std::cout << ERR_MSG("!cannot create pipe") << "\n";
+            return;
+        }
+
+        std::array<pool_t::queue_handle_t, QUEUES_COUNT> src_queues{}, dst_queues{};
+        std::array<std::deque<byte_t>, QUEUES_COUNT> std_src_queues{}, std_dst_queues{};
+        for (std::size_t t = 0; t < QUEUES_COUNT; ++t) {
+            src_queues[t] = src_pool.make_queue();
+            dst_queues[t] = dst_pool.make_queue();
+        }
+
+        byte_t chunk[MAX_CHUNK];
+        for (std::size_t op_ = 0; op_ < OPERATIONS_COUNT; ++op_) {
+            int queue_index = std::rand() % QUEUES_COUNT;
+            std::size_t chunk_length = 1 + std::rand() % MAX_CHUNK;
+
+            switch (std::rand() % 3) {
+            case 0: { //fill the source queue
+                if (std_src_queues[queue_index].size() + chunk_length > MAX_ELEMENTS_IN_QUEUE) break;
+                for (std::size_t t = 0; t < chunk_length; ++t)
+                    chunk[t] = (byte_t)std::rand();
+                if (src_pool.try_enqueue_bytes(&src_queues[queue_index], chunk, chunk_length))
+                    std_src_queues[queue_index].insert(std_src_queues[queue_index].end(), chunk, chunk + chunk_length);
+                break;
+            }
+            case 1: { //move data from source to destination queue through the pipe
+                chunk_length = std::min(chunk_length, MAX_ELEMENTS_IN_QUEUE - std_dst_queues[queue_index].size());
+                auto written = src_pool.write_to_fd(&src_queues[queue_index], pipe_fds[1], chunk_length);
+                if (written < 0 || (std::size_t)written != std::min(chunk_length, std_src_queues[queue_index].size())) {
+                    ++io_fails;
+                    std::cout << op_ << ")... " << "write length difference: expected(" << std::min(chunk_length, std_src_queues[queue_index].size()) << "), my(" << written << ")\n";
+                    break;
+                }
+                std_dst_queues[queue_index].insert(std_dst_queues[queue_index].end(), std_src_queues[queue_index].begin(), std_src_queues[queue_index].begin() + written);
+                std_src_queues[queue_index].erase(std_src_queues[queue_index].begin(), std_src_queues[queue_index].begin() + written);
+                for (std::ptrdiff_t read_total = 0; read_total < written; ) {
+                    auto read = dst_pool.read_from_fd(&dst_queues[queue_index], pipe_fds[0], written - read_total);
+                    if (read <= 0) {
+                        ++io_fails;
+                        std::cout << op_ << ")... " << "read failed\n";
+                        return;
+                    }
+                    read_total += read;
+                }
+                break;
+            }
+            case 2: { //drain the destination queue
+                std::size_t std_length = std::min(chunk_length, std_dst_queues[queue_index].size());
+                std::size_t my_length = dst_pool.try_dequeue_bytes(&dst_queues[queue_index], chunk, chunk_length);
+                if (std_length != my_length || !std::equal(chunk, chunk + std_length, std_dst_queues[queue_index].begin())) {
+                    ++value_fails;
+                    std::cout << op_ << ")... " << "content difference\n";
+                }
+                std_dst_queues[queue_index].erase(std_dst_queues[queue_index].begin(), std_dst_queues[queue_index].begin() + std_length);
+                break;
+            }
+            }
+            if (!Helper{}.validate_blocks_accounting(src_pool, src_queues) || !Helper{}.validate_blocks_accounting(dst_pool, dst_queues))
+                ++accounting_fails;
+        }
+        ::close(pipe_fds[0]);
+        ::close(pipe_fds[1]);
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (io_fails) std::cout << ERR_MSG("!IO FAILS: " << io_fails) << "\n";
+        if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+        if (accounting_fails) std::cout << ERR_MSG("!ACCOUNTING FAILS: " << accounting_fails) << "\n";
+#endif
+    }
+
+
+    void QueuePoolTest::test_wide_memory_policy() {
+        std::cout << "\n---------------------------------\nWIDE_MEMORY_POLICY...\n";
+
+        int header_fails = 0;
+        auto test_header = [&]<memory_policy TMemoryPolicy>(TMemoryPolicy pol) {
+            byte_t buffer[64] = {};
+            auto h = pol.make_header_view(buffer + 1, 0); //deliberately misaligned
+            for (buffersize_t value : {buffersize_t(0), buffersize_t(1), buffersize_t(0x1234), (buffersize_t)TMemoryPolicy::get_max_segment_length()}) {
+                for (bool flag : {false, true}) {
+                    h.set_is_free_segment(flag);
+                    h.set_segment_length(value);
+                    h.set_segment_begin(value);
+                    buffersize_t id = value % TMemoryPolicy::get_addressable_blocks_count();
+                    h.set_next_segment_id(TMemoryPolicy::get_addressable_blocks_count() - 1 - id);
+                    h.set_last_segment_id(id);
+                    if (h.get_segment_length() != value || h.get_segment_begin() != value || h.get_is_free_segment() != flag
+                        || h.get_next_segment_id() != TMemoryPolicy::get_addressable_blocks_count() - 1 - id || h.get_last_segment_id() != id)
+                        ++header_fails;
+                }
+            }
+        };
+        test_header(wide16_memory_policy(64));
+        test_header(wide32_memory_policy(64));
+        test_header(fast_memory_policy(64));
+
+        //way more blocks than a byte can address
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<1 << 16, 64, 32, 20000, 2000, 300, 3, false, false, wide16_memory_policy>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<1 << 16, 64, 32, 20000, 2000, 300, 3, true, true, wide16_memory_policy>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<4096, 40, 15, 20000, 120, 40, 2, true, false, wide32_memory_policy>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<4096, 40, 15, 20000, 120, 40, 2, false, true, wide32_memory_policy>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<2048, 24, 15, 20000, 120, 40, 2, false, false, fast_memory_policy>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<4096, 64, 30, 20000, 300, 60, 3, true, true, fast_memory_policy>();
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (header_fails) std::cout << ERR_MSG("!VALUE FAILS: " << header_fails) << "\n";
+    }
+
+    void QueuePoolTest::test_side_table_memory_policy() {
+        std::cout << "\n---------------------------------\nSIDE_TABLE_MEMORY_POLICY...\n";
+
+        constexpr std::size_t BUFFER_SIZE = 4096, BLOCK_SIZE = 32;
+        int value_fails = 0;
+
+        //headers must live entirely out of the blocks - filling whole blocks with payload must not corrupt anything
+        using pool_t = queue_pool_t<side_table16_memory_policy>;
+        byte_t buffer[BUFFER_SIZE];
+        pool_t pool(buffer, BUFFER_SIZE, true, BLOCK_SIZE);
+        pool.init();
+        std::array<pool_t::queue_handle_t, 4> queues{};
+        byte_t chunk[BLOCK_SIZE * 3];
+        for (std::size_t t = 0; t < queues.size(); ++t) {
+            std::memset(chunk, 0xA0 + (int)t, sizeof(chunk));
+            if (!pool.try_enqueue_bytes(&queues[t], chunk, sizeof(chunk))) ++value_fails;
+        }
+        if (pool.used_blocks() != queues.size() * 3) ++value_fails;
+        for (std::size_t t = 0; t < queues.size(); ++t) {
+            if (pool.try_dequeue_bytes(&queues[t], chunk, sizeof(chunk)) != sizeof(chunk)) ++value_fails;
+            for (auto b : chunk) if (b != 0xA0 + (int)t) { ++value_fails; break; }
+        }
+        if (!Helper{}.validate_blocks_accounting(pool, queues)) ++value_fails;
+
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<2048, 24, 15, 20000, 120, 40, 2, false, false, side_table16_memory_policy>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<2048, 24, 15, 20000, 120, 40, 2, true, false, side_table16_memory_policy>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<1 << 16, 64, 32, 20000, 2000, 300, 3, true, true, side_table16_memory_policy>();
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+    }
+
+    void QueuePoolTest::test_aligned_memory_policy() {
+        std::cout << "\n---------------------------------\nALIGNED_MEMORY_POLICY...\n";
+
+        constexpr std::size_t BUFFER_SIZE = 4096, BLOCK_SIZE = 40, ALIGNMENT = 64;
+        int value_fails = 0;
+
+        auto test_layout = [&]<memory_policy TMemoryPolicy>(TMemoryPolicy*) {
+            byte_t buffer[BUFFER_SIZE + 3];
+            for (bool bitmap : {false, true}) {
+                queue_pool_t<TMemoryPolicy> pool(buffer + 3, BUFFER_SIZE, queue_pool_options_t{ .use_free_block_bitmap = bitmap }, BLOCK_SIZE); //deliberately misaligned buffer
+                pool.init();
+                if (pool.get_block_size_bytes() != ALIGNMENT) ++value_fails;
+                for (buffersize_t t = 0; t < pool.get_total_blocks_count(); ++t)
+                    if (reinterpret_cast<std::uintptr_t>(pool.get_segment_start(t)) % ALIGNMENT) { ++value_fails; break; }
+                if (pool.get_segment_start(pool.get_total_blocks_count()) > buffer + 3 + BUFFER_SIZE) ++value_fails;
+                if (pool.get_alignment_loss_bytes() != (ALIGNMENT - 1) + pool.get_total_blocks_count() * (ALIGNMENT - BLOCK_SIZE)) ++value_fails;
+                std::cout << "header_size=" << TMemoryPolicy::get_header_size_bytes() << ", bitmap=" << bitmap << ")... blocks: " << pool.get_total_blocks_count() << ", alignment loss: " << pool.get_alignment_loss_bytes() << "B\n";
+            }
+        };
+        test_layout((aligned_memory_policy<standard_memory_policy, ALIGNMENT>*)nullptr);
+        test_layout((aligned_memory_policy<side_table16_memory_policy, ALIGNMENT>*)nullptr);
+
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<4096, 40, 15, 20000, 120, 40, 2, true, true, aligned_memory_policy<standard_memory_policy, ALIGNMENT>>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<4096, 40, 15, 20000, 120, 40, 2, false, false, aligned_memory_policy<side_table16_memory_policy, ALIGNMENT>>();
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+    }
+
+    void QueuePoolTest::test_uncounted_queues() {
+        std::cout << "\n---------------------------------\nUNCOUNTED_QUEUES...\n";
+
+        //counters are kept apart, so handles stay just a packed segment id
+        static_assert(sizeof(queue_pool_t<standard_memory_policy>::queue_handle_t) == 1);
+        static_assert(sizeof(queue_pool_t<wide16_memory_policy>::queue_handle_t) == 2);
+        static_assert(sizeof(queue_pool_t<standard_memory_policy>::queue_counters_t) == 8);
+
+        //no counters passed anywhere - sizes and blocks counts of destroyed queues are summed over the headers
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<2048, 24, 15, 20000, 120, 40, 2, false, false, standard_memory_policy, false>();
+        QueuePoolTest::Helper::Helper2{}.test_queue_randomized_bulk_impl<4096, 40, 15, 20000, 120, 40, 2, true, true, standard_memory_policy, false>();
+
+        std::cout << "\n*TEST FINISHED!\n";
+    }
+
+    void QueuePoolTest::test_fat_handles() {
+        std::cout << "\n---------------------------------\nFAT_HANDLES...\n";
+
+        constexpr std::size_t BUFFER_SIZE = 1920, BLOCK_SIZE = 24, QUEUES_COUNT = 15, OPERATIONS_COUNT = 50000, MAX_ELEMENTS_IN_QUEUE = 120;
+
+        int value_fails = 0;
+        int emptiness_fails = 0;
+        int accounting_fails = 0;
+
+        using pool_t = queue_pool_t<standard_memory_policy>;
+        for (bool big_segments : {false, true}) for (bool bitmap : {false, true}) {
+            byte_t buffer[BUFFER_SIZE];
+            pool_t pool(buffer, BUFFER_SIZE, queue_pool_options_t{ .use_multiblock_segments = big_segments, .use_free_block_bitmap = bitmap }, BLOCK_SIZE);
+            pool.init();
+
+            std::array<pool_t::fat_queue_handle_t, QUEUES_COUNT> queues{};
+            std::array<pool_t::queue_counters_t, QUEUES_COUNT> counters{};
+            std::array<std::deque<byte_t>, QUEUES_COUNT> std_queues{};
+            for (auto& q : queues) q = pool.make_fat_queue();
+
+            for (std::size_t op_ = 0; op_ < OPERATIONS_COUNT; ++op_) {
+                auto queue_index = std::rand() % QUEUES_COUNT;
+                auto& q = queues[queue_index];
+                auto& std_q = std_queues[queue_index];
+                auto c = &counters[queue_index];
+
+                if (!(std::rand() % 500)) { //destroy
+                    pool.destroy_queue(&q, c);
+                    q = pool.make_fat_queue();
+                    std_q.clear();
+                }
+                else if (!(std::rand() % 200)) { //move segments around while the handles are still fat
+                    pool.compact(1 + std::rand() % 8, std::span(queues));
+                }
+                else if (!(std::rand() % 200)) { //let the headers catch up and check everything adds up
+                    std::array<pool_t::queue_handle_t, QUEUES_COUNT> plain_queues;
+                    for (std::size_t t = 0; t < QUEUES_COUNT; ++t) plain_queues[t] = pool.release_fat_handle(&queues[t]);
+                    if (!Helper{}.validate_blocks_accounting(pool, plain_queues, &counters) || !Helper{}.validate_free_block_bitmap(pool)) ++accounting_fails;
+                    for (std::size_t t = 0; t < QUEUES_COUNT; ++t) queues[t] = pool.make_fat_handle(plain_queues[t]);
+                }
+                else if (std::rand() % 2) { //enqueue
+                    if (std_q.size() >= MAX_ELEMENTS_IN_QUEUE) continue;
+                    byte_t b = (byte_t)std::rand();
+                    if (pool.try_enqueue_byte(&q, b, c)) std_q.push_back(b);
+                }
+                else { //dequeue
+                    byte_t b = 0;
+                    bool my_empty = !pool.try_dequeue_byte(&q, &b, c);
+                    if (my_empty != std_q.empty()) ++emptiness_fails;
+                    else if (!my_empty) {
+                        if (b != std_q.front()) ++value_fails;
+                        std_q.pop_front();
+                    }
+                }
+                if (pool.size(q) != std_q.size() || pool.size(*c) != std_q.size()) ++accounting_fails;
+            }
+        }
+
+        //deterministic: fat handles whose cached positions point into the middle of their blocks stay usable after a full compaction moves all of their segments
+        for (bool big_segments : {false, true}) {
+            constexpr std::size_t FAT_COUNT = 4, FILLERS_COUNT = 8, BYTES_PER_QUEUE = 50, DEQUEUED_PER_QUEUE = 7, ENQUEUED_AFTER = 5;
+            byte_t buffer[BUFFER_SIZE];
+            pool_t pool(buffer, BUFFER_SIZE, queue_pool_options_t{ .use_multiblock_segments = big_segments }, BLOCK_SIZE);
+            pool.init();
+
+            std::array<pool_t::queue_handle_t, FILLERS_COUNT> fillers;
+            std::array<pool_t::fat_queue_handle_t, FAT_COUNT> queues;
+            std::array<std::deque<byte_t>, FAT_COUNT> std_queues{};
+            byte_t filler_data[BYTES_PER_QUEUE] = {};
+            for (auto& f : fillers) {
+                f = pool.make_queue();
+                if (!pool.try_enqueue_bytes(&f, filler_data, BYTES_PER_QUEUE)) ++accounting_fails;
+            }
+            for (std::size_t t = 0; t < FAT_COUNT; ++t) {
+                queues[t] = pool.make_fat_queue();
+                for (std::size_t i = 0; i < BYTES_PER_QUEUE; ++i) {
+                    byte_t b = (byte_t)(t * 31 + i);
+                    if (pool.try_enqueue_byte(&queues[t], b)) std_queues[t].push_back(b);
+                    else ++accounting_fails;
+                }
+                for (std::size_t i = 0; i < DEQUEUED_PER_QUEUE; ++i) {
+                    byte_t b = 0;
+                    if (!pool.try_dequeue_byte(&queues[t], &b) || b != std_queues[t].front()) ++value_fails;
+                    std_queues[t].pop_front();
+                }
+            }
+            for (auto& f : fillers) pool.destroy_queue(&f); //holes in front of every fat queue
+
+            buffersize_t steps_count = 0;
+            for (buffersize_t steps; (steps = pool.compact(pool.get_total_blocks_count(), std::span(queues))) > 0; ) steps_count += steps;
+            if (steps_count == 0) ++accounting_fails;
+
+            for (std::size_t t = 0; t < FAT_COUNT; ++t) {
+                for (std::size_t i = 0; i < ENQUEUED_AFTER; ++i) {
+                    byte_t b = (byte_t)(200 + t + i);
+                    if (pool.try_enqueue_byte(&queues[t], b)) std_queues[t].push_back(b);
+                    else ++accounting_fails;
+                }
+                if (pool.size(queues[t]) != std_queues[t].size()) ++accounting_fails;
+                for (byte_t b = 0; !std_queues[t].empty(); std_queues[t].pop_front())
+                    if (!pool.try_dequeue_byte(&queues[t], &b) || b != std_queues[t].front()) { ++value_fails; break; }
+            }
+            std::array<pool_t::queue_handle_t, FAT_COUNT> plain_queues;
+            for (std::size_t t = 0; t < FAT_COUNT; ++t) plain_queues[t] = pool.release_fat_handle(&queues[t]);
+            if (!Helper{}.validate_blocks_accounting(pool, plain_queues)) ++accounting_fails;
+        }
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+        if (emptiness_fails) std::cout << ERR_MSG("!EMPTINESS FAILS: " << emptiness_fails) << "\n";
+        if (accounting_fails) std::cout << ERR_MSG("!ACCOUNTING FAILS: " << accounting_fails) << "\n";
+    }
+
+    void QueuePoolTest::test_ready_bitmap() {
+        std::cout << "\n---------------------------------\nREADY_BITMAP...\n";
+
+        constexpr std::size_t BUFFER_SIZE = 4096, BLOCK_SIZE = 24, QUEUES_COUNT = 40, SLOT_STRIDE = 3, OPERATIONS_COUNT = 50000, MAX_ELEMENTS_IN_QUEUE = 60, MAX_BULK = 30;
+
+        int value_fails = 0;
+        int readiness_fails = 0;
+        int accounting_fails = 0;
+
+        using pool_t = queue_pool_t<standard_memory_policy>;
+        for (bool big_segments : {false, true}) {
+            byte_t buffer[BUFFER_SIZE];
+            pool_t pool(buffer, BUFFER_SIZE, queue_pool_options_t{ .use_multiblock_segments = big_segments, .ready_slots_count = QUEUES_COUNT * SLOT_STRIDE }, BLOCK_SIZE);
+            pool.init();
+
+            //slots are spread over multiple bitmap words, with gaps between them
+            std::array<pool_t::fat_queue_handle_t, QUEUES_COUNT> queues{};
+            std::array<pool_t::queue_counters_t, QUEUES_COUNT> counters{};
+            std::array<std::deque<byte_t>, QUEUES_COUNT> std_queues{};
+            for (std::size_t t = 0; t < QUEUES_COUNT; ++t) {
+                queues[t] = pool.make_fat_queue();
+                counters[t] = pool_t::queue_counters_t((std::uint16_t)(t * SLOT_STRIDE));
+            }
+
+            for (std::size_t op_ = 0; op_ < OPERATIONS_COUNT; ++op_) {
+                auto queue_index = std::rand() % QUEUES_COUNT;
+                auto& q = queues[queue_index];
+                auto& std_q = std_queues[queue_index];
+                auto c = &counters[queue_index];
+
+                if (!(std::rand() % 500)) { //destroy - the counters keep their slot
+                    pool.destroy_queue(&q, c);
+                    q = pool.make_fat_queue();
+                    std_q.clear();
+                }
+                else if (!(std::rand() % 200)) { //move segments around
+                    pool.compact(1 + std::rand() % 8, std::span(queues));
+                }
+                else if (!(std::rand() % 50)) { //poll - must report exactly the non-empty queues; drain a byte from each of them
+                    std::size_t expected_index = 0, non_empty_count = 0;
+                    for (auto& std_q_ : std_queues) non_empty_count += !std_q_.empty();
+                    auto reported = pool.poll_ready([&](std::uint16_t slot) {
+                        while (expected_index < QUEUES_COUNT && std_queues[expected_index].empty()) ++expected_index;
+                        if (slot != expected_index * SLOT_STRIDE) { ++readiness_fails; return; }
+                        byte_t b = 0;
+                        if (!pool.try_dequeue_byte(&queues[expected_index], &b, &counters[expected_index]) || b != std_queues[expected_index].front()) ++value_fails;
+                        std_queues[expected_index++].pop_front();
+                    });
+                    if (reported != non_empty_count) ++readiness_fails;
+                }
+                else if (!(std::rand() % 20)) { //bulk operation through the plain handle
+                    auto plain = pool.release_fat_handle(&q);
+                    byte_t bulk[MAX_BULK];
+                    std::size_t count = 1 + std::rand() % MAX_BULK;
+                    if (std::rand() % 2) {
+                        if (std_q.size() + count <= MAX_ELEMENTS_IN_QUEUE) {
+                            for (std::size_t t = 0; t < count; ++t) bulk[t] = (byte_t)std::rand();
+                            if (pool.try_enqueue_bytes(&plain, bulk, count, c)) std_q.insert(std_q.end(), bulk, bulk + count);
+                        }
+                    }
+                    else {
+                        auto dequeued = pool.try_dequeue_bytes(&plain, bulk, count, c);
+                        if (dequeued != std::min(count, std_q.size())) ++accounting_fails;
+                        for (std::size_t t = 0; t < dequeued && !std_q.empty(); ++t, std_q.pop_front())
+                            if (bulk[t] != std_q.front()) ++value_fails;
+                    }
+                    q = pool.make_fat_handle(plain);
+                }
+                else if (std::rand() % 2) { //enqueue
+                    if (std_q.size() >= MAX_ELEMENTS_IN_QUEUE) continue;
+                    byte_t b = (byte_t)std::rand();
+                    if (pool.try_enqueue_byte(&q, b, c)) std_q.push_back(b);
+                }
+                else { //dequeue
+                    byte_t b = 0;
+                    if (pool.try_dequeue_byte(&q, &b, c)) {
+                        if (std_q.empty() || b != std_q.front()) ++value_fails;
+                        else std_q.pop_front();
+                    }
+                }
+                if (pool.size(q) != std_q.size() || pool.size(*c) != std_q.size()) ++accounting_fails;
+            }
+        }
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+        if (readiness_fails) std::cout << ERR_MSG("!READINESS FAILS: " << readiness_fails) << "\n";
+        if (accounting_fails) std::cout << ERR_MSG("!ACCOUNTING FAILS: " << accounting_fails) << "\n";
+    }
+
+    void QueuePoolTest::test_typed_queue_view() {
+        std::cout << "\n---------------------------------\nTYPED_QUEUE_VIEW...\n";
+
+        struct record_t {
+            std::uint32_t id;
+            std::uint16_t kind;
+            byte_t payload[18];
+            bool operator==(const record_t&)const = default;
+        };
+        constexpr std::size_t BUFFER_SIZE = 4096, BLOCK_SIZE = 32, QUEUES_COUNT = 12, OPERATIONS_COUNT = 30000, MAX_RECORDS_IN_QUEUE = 20, MAX_BATCH = 6;
+
+        int value_fails = 0;
+        int emptiness_fails = 0;
+        int accounting_fails = 0;
+
+        using pool_t = queue_pool_t<standard_memory_policy>;
+        using view_t = typed_queue_view_t<record_t, standard_memory_policy>;
+        for (bool big_segments : {false, true}) for (bool keep_counters : {false, true}) {
+            byte_t buffer[BUFFER_SIZE];
+            pool_t pool(buffer, BUFFER_SIZE, big_segments, BLOCK_SIZE);
+            pool.init();
+
+            std::array<pool_t::queue_handle_t, QUEUES_COUNT> queues;
+            std::array<pool_t::queue_counters_t, QUEUES_COUNT> counters{};
+            std::array<std::deque<record_t>, QUEUES_COUNT> std_queues{};
+            for (auto& q : queues) q = pool.make_queue();
+
+            std::uint32_t next_id = 0;
+            auto make_record = [&]() {
+                record_t ret{ .id = next_id++, .kind = (std::uint16_t)std::rand(), .payload = {} };
+                for (auto& b : ret.payload) b = (byte_t)std::rand();
+                return ret;
+            };
+            for (std::size_t op_ = 0; op_ < OPERATIONS_COUNT; ++op_) {
+                auto queue_index = std::rand() % QUEUES_COUNT;
+                view_t q(&pool, &queues[queue_index], keep_counters ? &counters[queue_index] : nullptr);
+                auto& std_q = std_queues[queue_index];
+
+                switch (std::rand() % 4) {
+                case 0: { //push
+                    if (std_q.size() >= MAX_RECORDS_IN_QUEUE) break;
+                    auto r = make_record();
+                    if (q.push(r)) std_q.push_back(r);
+                    break;
+                }
+                case 1: { //push_n
+                    std::array<record_t, MAX_BATCH> batch;
+                    std::size_t count = 1 + std::rand() % MAX_BATCH;
+                    if (std_q.size() + count > MAX_RECORDS_IN_QUEUE) break;
+                    for (std::size_t t = 0; t < count; ++t) batch[t] = make_record();
+                    if (q.push_n(std::span<const record_t>(batch.data(), count))) std_q.insert(std_q.end(), batch.begin(), batch.begin() + count);
+                    break;
+                }
+                case 2: { //pop
+                    record_t r;
+                    bool my_empty = !q.pop(r);
+                    if (my_empty != std_q.empty()) ++emptiness_fails;
+                    else if (!my_empty) {
+                        if (!(r == std_q.front())) ++value_fails;
+                        std_q.pop_front();
+                    }
+                    break;
+                }
+                default: { //pop_n
+                    std::array<record_t, MAX_BATCH> batch;
+                    std::size_t count = 1 + std::rand() % MAX_BATCH;
+                    auto popped = q.pop_n(std::span<record_t>(batch.data(), count));
+                    if (popped != std::min(count, std_q.size())) ++emptiness_fails;
+                    for (std::size_t t = 0; t < popped && !std_q.empty(); ++t) {
+                        if (!(batch[t] == std_q.front())) ++value_fails;
+                        std_q.pop_front();
+                    }
+                    break;
+                }
+                }
+                if (q.size() != std_q.size() || pool.size(queues[queue_index]) / sizeof(record_t) != std_q.size()) ++accounting_fails;
+            }
+            if (!Helper{}.validate_blocks_accounting(pool, queues, keep_counters ? &counters : nullptr)) ++accounting_fails;
+        }
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+        if (emptiness_fails) std::cout << ERR_MSG("!EMPTINESS FAILS: " << emptiness_fails) << "\n";
+        if (accounting_fails) std::cout << ERR_MSG("!ACCOUNTING FAILS: " << accounting_fails) << "\n";
+    }
+
+    void QueuePoolTest::test_messages() {
+        std::cout << "\n---------------------------------\nMESSAGES...\n";
+
+        constexpr std::size_t BUFFER_SIZE = 1 << 14, BLOCK_SIZE = 32, QUEUES_COUNT = 8, OPERATIONS_COUNT = 20000, MAX_MESSAGES_IN_QUEUE = 6, MAX_MESSAGE_LENGTH = 400;
+
+        int value_fails = 0;
+        int emptiness_fails = 0;
+        int accounting_fails = 0;
+        std::size_t zero_copy_count = 0, copied_count = 0;
+
+        using pool_t = queue_pool_t<wide16_memory_policy>;
+        for (bool big_segments : {false, true}) {
+            std::vector<byte_t> buffer(BUFFER_SIZE);
+            pool_t pool(buffer.data(), BUFFER_SIZE, big_segments, BLOCK_SIZE);
+            pool.init();
+
+            std::array<pool_t::queue_handle_t, QUEUES_COUNT> queues;
+            std::array<std::deque<std::vector<byte_t>>, QUEUES_COUNT> std_queues{};
+            for (auto& q : queues) q = pool.make_queue();
+
+            for (std::size_t op_ = 0; op_ < OPERATIONS_COUNT; ++op_) {
+                auto queue_index = std::rand() % QUEUES_COUNT;
+                auto& q = queues[queue_index];
+                auto& std_q = std_queues[queue_index];
+
+                if (std::rand() % 2) { //enqueue
+                    if (std_q.size() >= MAX_MESSAGES_IN_QUEUE) continue;
+                    std::vector<byte_t> message(std::rand() % 4 ? std::rand() % 100 : std::rand() % MAX_MESSAGE_LENGTH);
+                    for (auto& b : message) b = (byte_t)std::rand();
+                    if (pool.try_enqueue_message(&q, message)) std_q.push_back(std::move(message));
+                }
+                else { //dequeue
+                    pool_t::message_view_t view;
+                    std::vector<byte_t> received;
+                    bool dequeued = pool.try_dequeue_message(&q, &view);
+                    if (dequeued) {
+                        for (auto span : view.get_spans()) received.insert(received.end(), span.begin(), span.end());
+                        if (received.size() != view.size()) ++value_fails;
+                        pool.release_message(&q, &view);
+                        ++zero_copy_count;
+                    }
+                    else if (view.size() > 0) { //too many segments for a view
+                        received.resize(MAX_MESSAGE_LENGTH);
+                        buffersize_t length = 0;
+                        dequeued = pool.try_dequeue_message(&q, received, &length);
+                        received.resize(length);
+                        ++copied_count;
+                    }
+                    if (dequeued == std_q.empty()) ++emptiness_fails;
+                    else if (dequeued) {
+                        if (received != std_q.front()) ++value_fails;
+                        std_q.pop_front();
+                    }
+                }
+                buffersize_t expected_size = 0;
+                for (auto& m : std_q) expected_size += m.size() + (m.size() < 0x80 ? 1 : 2);
+                if (pool.size(q) != expected_size) ++accounting_fails;
+            }
+            if (!Helper{}.validate_blocks_accounting(pool, queues)) ++accounting_fails;
+        }
+        std::cout << "zero-copy: " << zero_copy_count << ", copied: " << copied_count << "\n";
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+        if (emptiness_fails) std::cout << ERR_MSG("!EMPTINESS FAILS: " << emptiness_fails) << "\n";
+        if (accounting_fails) std::cout << ERR_MSG("!ACCOUNTING FAILS: " << accounting_fails) << "\n";
+    }
+
+    void QueuePoolTest::test_drr_scheduler() {
+        std::cout << "\n---------------------------------\nDRR_SCHEDULER...\n";
+
+        constexpr std::size_t BUFFER_SIZE = 1 << 16, BLOCK_SIZE = 64, MAX_QUEUES = 256, QUEUES_COUNT = 200, BUSY_QUEUES_COUNT = 4, BYTES_PER_QUEUE = 5000, QUANTUM = 100, BUDGET = 250, MAX_RUNS = 8;
+
+        int value_fails = 0;
+        int fairness_fails = 0;
+        int accounting_fails = 0;
+
+        using pool_t = queue_pool_t<wide16_memory_policy>;
+        using scheduler_t = drr_scheduler_t<MAX_QUEUES, wide16_memory_policy>;
+        std::vector<byte_t> buffer(BUFFER_SIZE);
+        pool_t pool(buffer.data(), BUFFER_SIZE, false, BLOCK_SIZE);
+        pool.init();
+        scheduler_t scheduler(&pool, QUANTUM);
+
+        auto expected_byte = [](std::size_t queue, std::size_t index) { return (byte_t)((index * 11 + queue * 29) % 247); };
+        //only a few of the registered queues ever hold anything, with weights 1..BUSY_QUEUES_COUNT
+        std::vector<pool_t::queue_handle_t> queues(QUEUES_COUNT);
+        std::vector<segment_id_t> busy_indices;
+        for (std::size_t t = 0; t < QUEUES_COUNT; ++t) {
+            queues[t] = pool.make_queue();
+            bool is_busy = t % (QUEUES_COUNT / BUSY_QUEUES_COUNT) == 0;
+            auto index = scheduler.add_queue(&queues[t], is_busy ? 1 + busy_indices.size() : 1);
+            if (index == scheduler_t::INVALID_INDEX) ++accounting_fails;
+            if (!is_busy) continue;
+            busy_indices.push_back(index);
+            std::vector<byte_t> data(BYTES_PER_QUEUE);
+            for (std::size_t b = 0; b < BYTES_PER_QUEUE; ++b) data[b] = expected_byte(index, b);
+            if (!scheduler.try_enqueue_bytes(index, data.data(), data.size())) ++accounting_fails;
+        }
+
+        std::array<byte_t, BUDGET> out;
+        std::array<scheduler_t::run_t, MAX_RUNS> runs;
+        std::vector<std::size_t> received(MAX_QUEUES);
+        std::size_t total_received = 0;
+        auto drain = [&](std::size_t bytes_count) {
+            for (std::size_t target = total_received + bytes_count; total_received < target && scheduler.has_active_queues(); ) {
+                auto runs_count = scheduler.next_batch(out, BUDGET, runs);
+                for (std::size_t r = 0; r < runs_count; ++r) {
+                    auto index = runs[r].queue_index;
+                    if (std::find(busy_indices.begin(), busy_indices.end(), index) == busy_indices.end()) ++value_fails;
+                    for (auto b : runs[r].data)
+                        if (b != expected_byte(index, received[index]++)) { ++value_fails; break; }
+                    total_received += runs[r].data.size();
+                }
+            }
+        };
+
+        //while all busy queues are backlogged, each gets a share proportional to its weight
+        constexpr std::size_t FAIR_SHARE_BYTES = BYTES_PER_QUEUE;
+        drain(FAIR_SHARE_BYTES);
+        std::size_t weights_sum = BUSY_QUEUES_COUNT * (BUSY_QUEUES_COUNT + 1) / 2;
+        for (std::size_t t = 0; t < BUSY_QUEUES_COUNT; ++t) {
+            auto expected = (double)total_received * (t + 1) / weights_sum;
+            if (std::abs((double)received[busy_indices[t]] - expected) > QUANTUM * BUSY_QUEUES_COUNT) ++fairness_fails;
+        }
+
+        //queue that was idle gets into the round once something is enqueued into it
+        auto idle_index = (segment_id_t)1;
+        byte_t late_byte = expected_byte(idle_index, 0);
+        busy_indices.push_back(idle_index);
+        if (!scheduler.try_enqueue_bytes(idle_index, &late_byte, 1)) ++accounting_fails;
+
+        drain(BUSY_QUEUES_COUNT * BYTES_PER_QUEUE);
+        if (scheduler.has_active_queues() || received[idle_index] != 1) ++accounting_fails;
+        for (std::size_t t = 0; t < BUSY_QUEUES_COUNT; ++t)
+            if (received[busy_indices[t]] != BYTES_PER_QUEUE) ++accounting_fails;
+        for (auto& q : queues)
+            if (pool.size(q) != 0) ++accounting_fails;
+
+        //base quantum 0 must not leave a queue stuck in its turn
+        scheduler_t zero_quantum_scheduler(&pool, 0);
+        auto zero_index = zero_quantum_scheduler.add_queue(&queues[0], 0);
+        if (!zero_quantum_scheduler.try_enqueue_bytes(zero_index, out.data(), 3)) ++accounting_fails;
+        buffersize_t zero_quantum_batches = 0;
+        while (zero_quantum_scheduler.has_active_queues() && zero_quantum_batches++ < 3) zero_quantum_scheduler.next_batch(out, BUDGET, runs);
+        if (zero_quantum_scheduler.has_active_queues() || pool.size(queues[0]) != 0) ++accounting_fails;
+        std::cout << "queues=" << QUEUES_COUNT << ", busy=" << BUSY_QUEUES_COUNT << ")... drained " << total_received << " bytes\n";
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+        if (fairness_fails) std::cout << ERR_MSG("!FAIRNESS FAILS: " << fairness_fails) << "\n";
+        if (accounting_fails) std::cout << ERR_MSG("!ACCOUNTING FAILS: " << accounting_fails) << "\n";
+    }
+
+    void QueuePoolTest::test_spsc() {
+        std::cout << "\n---------------------------------\nSPSC...\n";
+
+        constexpr std::size_t BUFFER_SIZE = 8192, BLOCK_SIZE = 32, PAIRS_COUNT = 4, BYTES_PER_PAIR = 300000, MAX_CHUNK = 64, MAX_ELEMENTS_IN_QUEUE = 1000;
+        constexpr std::size_t REGULAR_QUEUES_COUNT = 4, REGULAR_OPERATIONS_COUNT = 20000, MAX_ELEMENTS_IN_REGULAR_QUEUE = 200;
+
+        std::atomic<int> value_fails = 0;
+        int accounting_fails = 0;
+
+        using pool_t = queue_pool_t<standard_memory_policy>;
+        for (bool block_stack : {false, true}) for (bool bitmap : {false, true}) {
+            byte_t buffer[BUFFER_SIZE];
+            pool_t pool(buffer, BUFFER_SIZE, queue_pool_options_t{ .use_free_block_bitmap = bitmap, .use_lock_free_block_stack = block_stack }, BLOCK_SIZE);
+            pool.init();
+
+            std::array<pool_t::spsc_queue_t, PAIRS_COUNT> queues;
+            for (auto& q : queues)
+                if (!pool.try_make_spsc_queue(&q)) ++accounting_fails;
+
+            auto expected_byte = [](std::size_t pair, std::size_t index) { return (byte_t)((index * 31 + pair * 7) % 251); };
+            std::vector<std::thread> threads;
+            for (std::size_t pair = 0; pair < PAIRS_COUNT; ++pair) {
+                threads.emplace_back([&, pair]() { //producer
+                    std::minstd_rand rng((unsigned)pair);
+                    byte_t chunk[MAX_CHUNK];
+                    for (std::size_t sent = 0; sent < BYTES_PER_PAIR; ) {
+                        std::size_t chunk_length = std::min<std::size_t>(1 + rng() % MAX_CHUNK, BYTES_PER_PAIR - sent);
+                        for (std::size_t t = 0; t < chunk_length; ++t) chunk[t] = expected_byte(pair, sent + t);
+                        if (pool.size(queues[pair]) < MAX_ELEMENTS_IN_QUEUE && pool.try_enqueue_bytes(&queues[pair], chunk, chunk_length))
+                            sent += chunk_length;
+                        else
+                            std::this_thread::yield();
+                    }
+                    });
+                threads.emplace_back([&, pair]() { //consumer
+                    std::minstd_rand rng((unsigned)pair + 100);
+                    byte_t chunk[MAX_CHUNK * 2];
+                    for (std::size_t received = 0; received < BYTES_PER_PAIR; ) {
+                        auto length = pool.try_dequeue_bytes(&queues[pair], chunk, 1 + rng() % sizeof(chunk));
+                        for (std::size_t t = 0; t < length; ++t)
+                            if (chunk[t] != expected_byte(pair, received + t)) { ++value_fails; break; }
+                        received += length;
+                        if (!length) std::this_thread::yield();
+                    }
+                    });
+            }
+            //regular queues used meanwhile (under the lock, unless they share the block stack) - their block counters must not be affected by the spsc queues taking/returning blocks without the lock
+            std::array<pool_t::queue_handle_t, REGULAR_QUEUES_COUNT> regular_queues;
+            for (auto& q : regular_queues) q = pool.make_queue();
+            threads.emplace_back([&]() {
+                std::minstd_rand rng(12345);
+                byte_t chunk[MAX_CHUNK];
+                for (std::size_t op_ = 0; op_ < REGULAR_OPERATIONS_COUNT; ++op_) {
+                    auto& q = regular_queues[rng() % REGULAR_QUEUES_COUNT];
+                    std::unique_lock guard(pool, std::defer_lock);
+                    if (!block_stack) guard.lock();
+                    if (rng() % 2 && pool.size(q) < MAX_ELEMENTS_IN_REGULAR_QUEUE) pool.try_enqueue_bytes(&q, chunk, 1 + rng() % MAX_CHUNK);
+                    else pool.try_dequeue_bytes(&q, chunk, 1 + rng() % MAX_CHUNK);
+                }
+                });
+            for (auto& t : threads) t.join();
+
+            for (auto& q : queues) {
+                if (pool.size(q) != 0) ++accounting_fails;
+                pool.destroy_queue(&q);
+            }
+            pool.flush_block_stack();
+            if (!Helper{}.validate_blocks_accounting(pool, regular_queues) || !Helper{}.validate_free_block_bitmap(pool)) ++accounting_fails;
+            for (auto& q : regular_queues) pool.destroy_queue(&q);
+            std::array<pool_t::queue_handle_t, 1> no_queues{};
+            if (pool.free_blocks() != pool.get_total_blocks_count() || !Helper{}.validate_blocks_accounting(pool, no_queues) || !Helper{}.validate_free_block_bitmap(pool)) ++accounting_fails;
+            std::cout << "block_stack=" << block_stack << ", bitmap=" << bitmap << ")... transferred " << PAIRS_COUNT << "x" << BYTES_PER_PAIR << " bytes\n";
+        }
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+        if (accounting_fails) std::cout << ERR_MSG("!ACCOUNTING FAILS: " << accounting_fails) << "\n";
+    }
+
+    void QueuePoolTest::test_concurrent_regular_queues() {
+        std::cout << "\n---------------------------------\nCONCURRENT REGULAR QUEUES...\n";
+
+        //scaling from 1 to N threads is measured only in benchmark builds (`make bench`) - the default run just checks correctness with a fixed number of threads
+#ifdef QUEUE_POOL_BENCHMARKS
+        constexpr std::size_t MIN_THREADS_COUNT = 1, MAX_THREADS_COUNT = 8, OPERATIONS_PER_THREAD = 200000;
+#else
+        constexpr std::size_t MIN_THREADS_COUNT = 4, MAX_THREADS_COUNT = 4, OPERATIONS_PER_THREAD = 30000;
+#endif
+        constexpr std::size_t BUFFER_SIZE = 1 << 16, BLOCK_SIZE = 32, QUEUES_PER_THREAD = 8, MAX_CHUNK = 80, MAX_ELEMENTS_IN_QUEUE = 400;
+
+        std::atomic<int> value_fails = 0;
+        std::atomic<int> accounting_fails = 0;
+
+        using pool_t = queue_pool_t<wide16_memory_policy>;
+        for (bool big_segments : {false, true}) for (bool bitmap : {false, true}) for (bool use_magazines : {false, true}) {
+            [[maybe_unused]] double single_thread_throughput = 0;
+            for (std::size_t threads_count = MIN_THREADS_COUNT; threads_count <= MAX_THREADS_COUNT; threads_count *= 2) {
+                std::vector<byte_t> buffer(BUFFER_SIZE);
+                pool_t pool(buffer.data(), BUFFER_SIZE, queue_pool_options_t{ .use_multiblock_segments = big_segments, .use_free_block_bitmap = bitmap, .use_lock_free_block_stack = true }, BLOCK_SIZE);
+                pool.init();
+
+                //every thread creates, grows, shrinks and destroys its own queues (a contiguous range of the arrays), without ever taking the pool's lock
+                std::array<pool_t::queue_handle_t, MAX_THREADS_COUNT * QUEUES_PER_THREAD> queues;
+                std::array<pool_t::queue_counters_t, MAX_THREADS_COUNT * QUEUES_PER_THREAD> counters{};
+                for (auto& q : queues) q = pool.make_queue();
+                [[maybe_unused]] auto start = std::chrono::steady_clock::now();
+                std::vector<std::thread> threads;
+                for (std::size_t thread_index = 0; thread_index < threads_count; ++thread_index) {
+                    threads.emplace_back([&, thread_index]() {
+                        pool_t::block_magazine_t magazine;
+                        auto magazine_ptr = use_magazines ? &magazine : nullptr;
+                        std::minstd_rand rng((unsigned)thread_index);
+                        auto my_queues = std::span(queues).subspan(thread_index * QUEUES_PER_THREAD, QUEUES_PER_THREAD);
+                        auto my_counters = std::span(counters).subspan(thread_index * QUEUES_PER_THREAD, QUEUES_PER_THREAD);
+                        std::array<std::deque<byte_t>, QUEUES_PER_THREAD> std_queues{};
+
+                        byte_t chunk[MAX_CHUNK];
+                        for (std::size_t op_ = 0; op_ < OPERATIONS_PER_THREAD; ++op_) {
+                            auto queue_index = rng() % QUEUES_PER_THREAD;
+                            auto& q = my_queues[queue_index];
+                            auto c = &my_counters[queue_index];
+                            auto& std_q = std_queues[queue_index];
+                            std::size_t chunk_length = 1 + rng() % MAX_CHUNK;
+
+                            if (!(rng() % 300)) { //destroy
+                                pool.destroy_queue(&q, c);
+                                q = pool.make_queue();
+                                std_q.clear();
+                            }
+                            else if (rng() % 2) { //enqueue
+                                if (std_q.size() + chunk_length > MAX_ELEMENTS_IN_QUEUE) continue;
+                                for (std::size_t t = 0; t < chunk_length; ++t) chunk[t] = (byte_t)rng();
+                                if (rng() % 4) {
+                                    if (pool.try_enqueue_bytes(&q, chunk, chunk_length, c, magazine_ptr)) std_q.insert(std_q.end(), chunk, chunk + chunk_length);
+                                }
+                                else if (pool.try_enqueue_byte(&q, chunk[0], c, magazine_ptr)) std_q.push_back(chunk[0]);
+                            }
+                            else { //dequeue
+                                bool single_byte = !(rng() % 4);
+                                auto length = single_byte ? (buffersize_t)pool.try_dequeue_byte(&q, chunk, c, magazine_ptr) : pool.try_dequeue_bytes(&q, chunk, chunk_length, c, magazine_ptr);
+                                if (length != std::min<std::size_t>(single_byte ? 1 : chunk_length, std_q.size())) ++accounting_fails;
+                                for (std::size_t t = 0; t < length; ++t, std_q.pop_front())
+                                    if (chunk[t] != std_q.front()) { ++value_fails; break; }
+                            }
+                            if (pool.size(*c) != std_q.size()) ++accounting_fails;
+                        }
+                        for (std::size_t t = 0; t < QUEUES_PER_THREAD; ++t)
+                            if (pool.size(my_queues[t]) != std_queues[t].size()) ++accounting_fails;
+                        pool.flush_magazine(&magazine);
+                        });
+                }
+                for (auto& t : threads) t.join();
+#ifdef QUEUE_POOL_BENCHMARKS
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                double throughput = threads_count * OPERATIONS_PER_THREAD / elapsed.count() / 1e6;
+                if (threads_count == MIN_THREADS_COUNT) single_thread_throughput = throughput;
+                std::cout << "big_segments=" << big_segments << ", bitmap=" << bitmap << ", magazines=" << use_magazines << ", threads=" << threads_count << ")... " 
+                    << throughput << " Mops/s (" << (throughput / single_thread_throughput) << "x of " << MIN_THREADS_COUNT << " thread)\n";
+#endif
+
+                pool.flush_block_stack();
+                if (!Helper{}.validate_blocks_accounting(pool, queues, &counters) || !Helper{}.validate_free_block_bitmap(pool)) ++accounting_fails;
+                for (std::size_t t = 0; t < queues.size(); ++t) pool.destroy_queue(&queues[t], &counters[t]);
+                pool.flush_block_stack();
+                if (pool.free_blocks() != pool.get_total_blocks_count() || !Helper{}.validate_free_block_bitmap(pool)) ++accounting_fails;
+            }
+            std::cout << "big_segments=" << big_segments << ", bitmap=" << bitmap << ", magazines=" << use_magazines << ")... " << MAX_THREADS_COUNT << "x" << OPERATIONS_PER_THREAD << " operations\n";
+        }
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+        if (accounting_fails) std::cout << ERR_MSG("!ACCOUNTING FAILS: " << accounting_fails) << "\n";
+    }
+
+    void QueuePoolTest::test_spsc_magazines() {
+        std::cout << "\n---------------------------------\nSPSC MAGAZINES...\n";
+
+        //throughput is measured only in benchmark builds (`make bench`) - the default run just checks correctness on a smaller load
+#ifdef QUEUE_POOL_BENCHMARKS
+        constexpr std::size_t MAX_PAIRS_COUNT = 8, BYTES_PER_PAIR = 100000;
+#else
+        constexpr std::size_t MAX_PAIRS_COUNT = 2, BYTES_PER_PAIR = 20000;
+#endif
+        constexpr std::size_t BUFFER_SIZE = 1 << 16, BLOCK_SIZE = 16, MAX_CHUNK = 64, MAX_ELEMENTS_IN_QUEUE = 2000;
+
+        std::atomic<int> value_fails = 0;
+        int accounting_fails = 0;
+
+        using pool_t = queue_pool_t<wide16_memory_policy>;
+        auto expected_byte = [](std::size_t pair, std::size_t index) { return (byte_t)((index * 13 + pair * 5) % 241); };
+        for (std::size_t pairs_count = 1; pairs_count <= MAX_PAIRS_COUNT; pairs_count *= 2) {
+            for (bool block_stack : {false, true}) for (bool use_magazines : {false, true}) {
+                std::vector<byte_t> buffer(BUFFER_SIZE);
+                pool_t pool(buffer.data(), BUFFER_SIZE, queue_pool_options_t{ .use_lock_free_block_stack = block_stack }, BLOCK_SIZE);
+                pool.init();
+
+                std::vector<pool_t::spsc_queue_t> queues(pairs_count);
+                for (auto& q : queues)
+                    if (!pool.try_make_spsc_queue(&q)) ++accounting_fails;
+
+                [[maybe_unused]] auto start = std::chrono::steady_clock::now();
+                std::vector<std::thread> threads;
+                for (std::size_t pair = 0; pair < pairs_count; ++pair) {
+                    threads.emplace_back([&, pair]() { //producer
+                        pool_t::block_magazine_t magazine;
+                        auto magazine_ptr = use_magazines ? &magazine : nullptr;
+                        std::minstd_rand rng((unsigned)pair);
+                        byte_t chunk[MAX_CHUNK];
+                        for (std::size_t sent = 0; sent < BYTES_PER_PAIR; ) {
+                            std::size_t chunk_length = std::min<std::size_t>(1 + rng() % MAX_CHUNK, BYTES_PER_PAIR - sent);
+                            for (std::size_t t = 0; t < chunk_length; ++t) chunk[t] = expected_byte(pair, sent + t);
+                            if (pool.size(queues[pair]) < MAX_ELEMENTS_IN_QUEUE && pool.try_enqueue_bytes(&queues[pair], chunk, chunk_length, magazine_ptr))
+                                sent += chunk_length;
+                            else
+                                std::this_thread::yield();
+                        }
+                        pool.flush_magazine(&magazine);
+                        });
+                    threads.emplace_back([&, pair]() { //consumer
+                        pool_t::block_magazine_t magazine;
+                        auto magazine_ptr = use_magazines ? &magazine : nullptr;
+                        std::minstd_rand rng((unsigned)pair + 100);
+                        byte_t chunk[MAX_CHUNK * 2];
+                        for (std::size_t received = 0; received < BYTES_PER_PAIR; ) {
+                            auto length = pool.try_dequeue_bytes(&queues[pair], chunk, 1 + rng() % sizeof(chunk), magazine_ptr);
+                            for (std::size_t t = 0; t < length; ++t)
+                                if (chunk[t] != expected_byte(pair, received + t)) { ++value_fails; break; }
+                            received += length;
+                            if (!length) std::this_thread::yield();
+                        }
+                        pool.flush_magazine(&magazine);
+                        });
+                }
+                for (auto& t : threads) t.join();
+#ifdef QUEUE_POOL_BENCHMARKS
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                std::cout << "pairs=" << pairs_count << ", block_stack=" << block_stack << ", magazines=" << use_magazines << ")... " << (pairs_count * BYTES_PER_PAIR / elapsed.count() / 1e6) << " MB/s\n";
+#endif
+
+                for (auto& q : queues) {
+                    if (pool.size(q) != 0) ++accounting_fails;
+                    pool.destroy_queue(&q);
+                }
+                if (pool.free_blocks() != pool.get_total_blocks_count()) ++accounting_fails;
+            }
+        }
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+        if (accounting_fails) std::cout << ERR_MSG("!ACCOUNTING FAILS: " << accounting_fails) << "\n";
+    }
+
+    void QueuePoolTest::test_spsc_wait() {
+        std::cout << "\n---------------------------------\nSPSC WAIT...\n";
+#ifndef QUEUE_POOL_FUTEX_SUPPORTED
+        std::cout << "not supported on this platform\n";
+#else
+        constexpr std::size_t BUFFER_SIZE = 8192, BLOCK_SIZE = 32, BURSTS_COUNT = 200, MAX_CHUNK = 64, MAX_CHUNKS_PER_BURST = 8;
+
+        std::atomic<int> value_fails = 0;
+        int accounting_fails = 0, timeout_fails = 0;
+
+        using pool_t = queue_pool_t<standard_memory_policy>;
+        byte_t buffer[BUFFER_SIZE];
+        pool_t pool(buffer, BUFFER_SIZE, queue_pool_options_t{}, BLOCK_SIZE);
+        pool.init();
+        pool_t::spsc_queue_t q;
+        if (!pool.try_make_spsc_queue(&q)) ++accounting_fails;
+
+        byte_t out[MAX_CHUNK];
+        auto wait_start = std::chrono::steady_clock::now();
+        if (pool.dequeue_wait(&q, out, sizeof(out), std::chrono::milliseconds(5)) != 0) ++value_fails;
+        if (std::chrono::steady_clock::now() - wait_start < std::chrono::milliseconds(5)) ++timeout_fails;
+
+        auto expected_byte = [](std::size_t index) { return (byte_t)((index * 17) % 253); };
+        std::atomic<std::size_t> total_sent = 0;
+        std::atomic<bool> producer_finished = false;
+        std::thread producer([&]() {
+            std::minstd_rand rng(1);
+            std::size_t sent = 0;
+            std::array<std::array<byte_t, MAX_CHUNK>, MAX_CHUNKS_PER_BURST> chunks;
+            std::array<std::span<const byte_t>, MAX_CHUNKS_PER_BURST> spans;
+            for (std::size_t burst = 0; burst < BURSTS_COUNT; ++burst) {
+                std::size_t chunks_count = 1 + rng() % MAX_CHUNKS_PER_BURST;
+                for (std::size_t c = 0; c < chunks_count; ++c) {
+                    std::size_t chunk_length = 1 + rng() % MAX_CHUNK;
+                    for (std::size_t t = 0; t < chunk_length; ++t) chunks[c][t] = expected_byte(sent + t);
+                    if (burst % 2) { //alternate between a single batch and separate enqueues
+                        spans[c] = std::span<const byte_t>(chunks[c].data(), chunk_length);
+                        sent += chunk_length;
+                    }
+                    else if (pool.try_enqueue_bytes(&q, chunks[c].data(), chunk_length)) sent += chunk_length;
+                }
+                if (burst % 2 && pool.try_enqueue_batch(&q, std::span(spans.data(), chunks_count)) != chunks_count) ++value_fails;
+                if (rng() % 4 == 0) std::this_thread::sleep_for(std::chrono::microseconds(200)); //let the consumer fall asleep
+            }
+            total_sent = sent;
+            producer_finished = true;
+            });
+
+        std::size_t received = 0;
+        for (;;) {
+            auto length = pool.dequeue_wait(&q, out, 1 + received % sizeof(out), std::chrono::milliseconds(100));
+            for (std::size_t t = 0; t < length; ++t)
+                if (out[t] != expected_byte(received + t)) { ++value_fails; break; }
+            received += length;
+            if (!length && producer_finished && pool.size(q) == 0) break;
+        }
+        producer.join();
+        if (received != total_sent) ++value_fails;
+
+        pool.destroy_queue(&q);
+        if (pool.free_blocks() != pool.get_total_blocks_count()) ++accounting_fails;
+        std::cout << "received " << received << " bytes in " << BURSTS_COUNT << " bursts\n";
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+        if (timeout_fails) std::cout << ERR_MSG("!TIMEOUT FAILS: " << timeout_fails) << "\n";
+        if (accounting_fails) std::cout << ERR_MSG("!ACCOUNTING FAILS: " << accounting_fails) << "\n";
+#endif
+    }
+
+    using async_pool_t = async_queue_pool_t<standard_memory_policy>;
+    static byte_t async_expected_byte(std::size_t connection, std::size_t index) { return (byte_t)((index * 7 + connection * 3) % 251); }
+
+    static async_pool_t::task_t async_producer(async_pool_t& pool, async_pool_t::async_queue_t* q, std::size_t connection, std::size_t bytes_count, std::size_t max_chunk, int* value_fails) {
+        std::minstd_rand rng((unsigned)connection);
+        std::vector<byte_t> chunk(max_chunk);
+        for (std::size_t sent = 0; sent < bytes_count; ) {
+            std::size_t chunk_length = std::min<std::size_t>(1 + rng() % max_chunk, bytes_count - sent);
+            for (std::size_t t = 0; t < chunk_length; ++t) chunk[t] = async_expected_byte(connection, sent + t);
+            if (!co_await pool.async_enqueue(q, std::span<const byte_t>(chunk.data(), chunk_length))) ++*value_fails;
+            sent += chunk_length;
+        }
+    }
+    static async_pool_t::task_t async_consumer(async_pool_t& pool, async_pool_t::async_queue_t* q, std::size_t connection, std::size_t bytes_count, std::size_t max_chunk, int* value_fails, std::size_t* finished_count) {
+        std::minstd_rand rng((unsigned)connection + 1000);
+        std::vector<byte_t> chunk(max_chunk);
+        for (std::size_t received = 0; received < bytes_count; ) {
+            std::size_t chunk_length = std::min<std::size_t>(1 + rng() % max_chunk, bytes_count - received);
+            if (co_await pool.async_dequeue(q, std::span<byte_t>(chunk.data(), chunk_length)) != chunk_length) { ++*value_fails; break; }
+            for (std::size_t t = 0; t < chunk_length; ++t)
+                if (chunk[t] != async_expected_byte(connection, received + t)) { ++*value_fails; break; }
+            received += chunk_length;
+        }
+        ++*finished_count;
+    }
+    //waits for data that never comes, counting the destruction of its frame
+    static async_pool_t::task_t async_abandoned_consumer(async_pool_t& pool, async_pool_t::async_queue_t* q, std::size_t* destroyed_frames_count) {
+        struct frame_guard_t {
+            std::size_t* destroyed_frames_count;
+            ~frame_guard_t() { ++*destroyed_frames_count; }
+        } guard{ destroyed_frames_count };
+        byte_t b;
+        co_await pool.async_dequeue(q, std::span<byte_t>(&b, 1));
+    }
+
+    void QueuePoolTest::test_async() {
+        std::cout << "\n---------------------------------\nASYNC...\n";
+
+        constexpr std::size_t BUFFER_SIZE = 8192, BLOCK_SIZE = 32, CONNECTIONS_COUNT = 64, BYTES_PER_CONNECTION = 3000, MAX_PRODUCER_CHUNK = 64, MAX_CONSUMER_CHUNK = 16;
+
+        int value_fails = 0, accounting_fails = 0;
+
+        byte_t buffer[BUFFER_SIZE];
+        async_pool_t pool(buffer, BUFFER_SIZE, queue_pool_options_t{}, BLOCK_SIZE);
+        pool.init();
+
+        std::vector<async_pool_t::async_queue_t> queues(CONNECTIONS_COUNT);
+        std::size_t finished_count = 0;
+        for (std::size_t c = 0; c < CONNECTIONS_COUNT; ++c) {
+            queues[c] = pool.make_queue();
+            pool.spawn(async_consumer(pool, &queues[c], c, BYTES_PER_CONNECTION, MAX_CONSUMER_CHUNK, &value_fails, &finished_count));
+            pool.spawn(async_producer(pool, &queues[c], c, BYTES_PER_CONNECTION, MAX_PRODUCER_CHUNK, &value_fails));
+        }
+        auto resumes = pool.run();
+        if (finished_count != CONNECTIONS_COUNT || pool.has_enqueue_waiters()) ++accounting_fails;
+        for (auto& q : queues) {
+            if (pool.size(q) != 0) ++accounting_fails;
+            pool.destroy_queue(&q);
+        }
+        if (pool.get_pool().free_blocks() != pool.get_pool().get_total_blocks_count()) ++accounting_fails;
+
+        //waiting consumer gets resumed with 0 once its queue is destroyed
+        auto q = pool.make_queue();
+        std::size_t destroyed_finished_count = 0;
+        int destroyed_fails = 0;
+        pool.spawn(async_consumer(pool, &q, 0, 10, 10, &destroyed_fails, &destroyed_finished_count));
+        pool.run();
+        pool.destroy_queue(&q);
+        pool.run();
+        if (destroyed_fails == 0 || destroyed_finished_count != 1) ++accounting_fails;
+
+        //frames of coroutines still waiting for data get destroyed together with the pool
+        std::size_t destroyed_frames_count = 0;
+        {
+            byte_t abandoned_buffer[512];
+            async_pool_t abandoned_pool(abandoned_buffer, sizeof(abandoned_buffer), queue_pool_options_t{}, BLOCK_SIZE);
+            abandoned_pool.init();
+            auto abandoned_q1 = abandoned_pool.make_queue(), abandoned_q2 = abandoned_pool.make_queue();
+            abandoned_pool.spawn(async_abandoned_consumer(abandoned_pool, &abandoned_q1, &destroyed_frames_count));
+            abandoned_pool.spawn(async_abandoned_consumer(abandoned_pool, &abandoned_q1, &destroyed_frames_count));
+            abandoned_pool.spawn(async_abandoned_consumer(abandoned_pool, &abandoned_q2, &destroyed_frames_count));
+            abandoned_pool.run();
+            if (destroyed_frames_count != 0) ++accounting_fails;
+        }
+        if (destroyed_frames_count != 3) ++accounting_fails;
+
+        std::cout << "connections=" << CONNECTIONS_COUNT << ")... transferred " << CONNECTIONS_COUNT * BYTES_PER_CONNECTION << " bytes, resumes: " << resumes << "\n";
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+        if (accounting_fails) std::cout << ERR_MSG("!ACCOUNTING FAILS: " << accounting_fails) << "\n";
+    }
+
+    void QueuePoolTest::test_sharded_pool() {
+        std::cout << "\n---------------------------------\nSHARDED POOL...\n";
+
+        constexpr std::size_t SHARDS_COUNT = 4, BUFFER_SIZE = 1 << 14, BLOCK_SIZE = 32, THREADS_COUNT = 4, QUEUES_PER_THREAD = 8, OPERATIONS_COUNT = 20000, MAX_ELEMENTS_IN_QUEUE = 200;
+
+        std::atomic<int> value_fails = 0, emptiness_fails = 0;
+        int accounting_fails = 0;
+
+        using pool_t = sharded_queue_pool_t<SHARDS_COUNT, wide16_memory_policy>;
+        std::vector<byte_t> buffer(BUFFER_SIZE);
+        for (bool big_segments : {false, true}) {
+            pool_t pool(buffer.data(), BUFFER_SIZE, queue_pool_options_t{ .use_multiblock_segments = big_segments, .use_free_block_bitmap = big_segments }, BLOCK_SIZE);
+            pool.init();
+            buffersize_t total_blocks = pool.free_blocks();
+
+            std::vector<std::thread> threads;
+            for (std::size_t thread_index = 0; thread_index < THREADS_COUNT; ++thread_index) {
+                threads.emplace_back([&, thread_index]() {
+                    std::minstd_rand rng((unsigned)thread_index);
+                    std::array<pool_t::queue_handle_t, QUEUES_PER_THREAD> queues;
+                    std::array<std::deque<byte_t>, QUEUES_PER_THREAD> reference;
+                    for (auto& q : queues) {
+                        q = pool.make_queue();
+                        if (q.get_shard_index() != pool_t::get_thread_shard_index()) ++value_fails;
+                    }
+                    for (std::size_t op = 0; op < OPERATIONS_COUNT; ++op) {
+                        auto i = rng() % QUEUES_PER_THREAD;
+                        if (rng() % 2 && reference[i].size() < MAX_ELEMENTS_IN_QUEUE) {
+                            byte_t b = (byte_t)rng();
+                            if (pool.try_enqueue_byte(&queues[i], b)) reference[i].push_back(b);
+                        }
+                        else {
+                            byte_t b;
+                            bool dequeued = pool.try_dequeue_byte(&queues[i], &b);
+                            if (dequeued != !reference[i].empty()) ++emptiness_fails;
+                            else if (dequeued) {
+                                if (b != reference[i].front()) ++value_fails;
+                                reference[i].pop_front();
+                            }
+                        }
+                        if (pool.size(queues[i]) != reference[i].size()) ++value_fails;
+                    }
+                    for (auto& q : queues) pool.destroy_queue(&q);
+                    });
+            }
+            for (auto& t : threads) t.join();
+            if (pool.free_blocks() != total_blocks || pool.used_blocks() != 0) ++accounting_fails;
+
+            //shard 0 runs out while another shard still has free blocks - a queue growing in shard 0 borrows some of them
+            auto grower = pool.make_queue(0);
+            if (!pool.try_enqueue_byte(&grower, 1)) ++accounting_fails;
+            auto filler = pool.make_queue(0);
+            while (pool.get_shard(0).free_blocks() > 0 && pool.try_enqueue_byte(&filler, 42));
+            if (pool.get_shard(0).free_blocks() != 0 || pool.get_shard(1).free_blocks() == 0) ++accounting_fails;
+            std::array<byte_t, 3 * BLOCK_SIZE> data;
+            for (std::size_t t = 0; t < data.size(); ++t) data[t] = (byte_t)(t + 2);
+            if (!pool.try_enqueue_bytes(&grower, data.data(), data.size()) || grower.get_shard_index() != 0 || filler.get_shard_index() != 0) ++accounting_fails;
+            std::array<byte_t, data.size() + 1> out;
+            if (pool.try_dequeue_bytes(&grower, out.data(), out.size()) != out.size() || out[0] != 1 || !std::equal(data.begin(), data.end(), out.begin() + 1)) ++value_fails;
+            byte_t b;
+            if (!pool.try_dequeue_byte(&filler, &b) || b != 42) ++value_fails;
+            pool.destroy_queue(&grower);
+            pool.destroy_queue(&filler);
+            if (pool.free_blocks() != total_blocks || pool.used_blocks() != 0) ++accounting_fails;
+            std::cout << "(multiblock segments=" << big_segments << ", shards=" << SHARDS_COUNT << ", threads=" << THREADS_COUNT << ")... blocks: " << total_blocks << "\n";
+        }
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+        if (emptiness_fails) std::cout << ERR_MSG("!EMPTINESS FAILS: " << emptiness_fails) << "\n";
+        if (accounting_fails) std::cout << ERR_MSG("!ACCOUNTING FAILS: " << accounting_fails) << "\n";
+    }
+
+    void QueuePoolTest::test_persistent_pool() {
+        std::cout << "\n---------------------------------\nPERSISTENT POOL...\n";
+#ifndef QUEUE_POOL_MMAP_SUPPORTED
+        std::cout << "not supported on this platform\n";
+#else
+        constexpr std::size_t FILE_SIZE = 4096, BLOCK_SIZE = 24, QUEUES_COUNT = 10, RESTARTS_COUNT = 6, OPERATIONS_PER_RUN = 5000, MAX_ELEMENTS_IN_QUEUE = 150, MAX_CHUNK = 40, SYNC_BATCH = 64;
+
+        int value_fails = 0;
+        int accounting_fails = 0;
+        int persistence_fails = 0;
+
+        using pool_t = queue_pool_t<standard_memory_policy>;
+        using persistent_pool_t = persistent_queue_pool_t<standard_memory_policy>;
+        struct retagged_memory_policy : standard_memory_policy {
+            using standard_memory_policy::standard_memory_policy;
+            static constexpr std::uint64_t get_policy_tag() { return make_policy_tag("retagged_memory_policy"); }
+        };
+        auto path = (std::filesystem::temp_directory_path() / "queue_pool_persistence_test.bin").string();
+        for (bool big_segments : {false, true}) for (bool bitmap : {false, true}) {
+            std::array<std::deque<byte_t>, QUEUES_COUNT> std_queues{};
+            {
+                persistent_pool_t pool;
+                if (!pool.create(path.c_str(), FILE_SIZE, QUEUES_COUNT, queue_pool_options_t{ .use_multiblock_segments = big_segments, .use_free_block_bitmap = bitmap }, BLOCK_SIZE)) {
+                    ++persistence_fails;
+                    continue;
+                }
+                for (segment_id_t t = 0; t < QUEUES_COUNT; ++t) pool.make_queue(t);
+            }
+            //every run of the "process" takes over the queues left by the previous one
+            for (std::size_t run = 0; run < RESTARTS_COUNT; ++run) {
+                persistent_pool_t pool;
+                if (!pool.attach(path.c_str(), BLOCK_SIZE) || !pool.was_closed_cleanly()) {
+                    ++persistence_fails;
+                    break;
+                }
+                pool.set_sync_batch(SYNC_BATCH);
+                std::array<pool_t::queue_handle_t, QUEUES_COUNT> handles;
+                for (std::size_t t = 0; t < QUEUES_COUNT; ++t) {
+                    handles[t] = *pool.get_queue((segment_id_t)t);
+                    if (pool.size((segment_id_t)t) != std_queues[t].size()) ++persistence_fails;
+                }
+                if (!Helper{}.validate_blocks_accounting(pool.get_pool(), handles) || !Helper{}.validate_free_block_bitmap(pool.get_pool())) ++persistence_fails;
+
+                for (std::size_t op_ = 0; op_ < OPERATIONS_PER_RUN; ++op_) {
+                    auto queue_index = (segment_id_t)(std::rand() % QUEUES_COUNT);
+                    auto& std_q = std_queues[queue_index];
+                    byte_t chunk[MAX_CHUNK];
+                    std::size_t count = 1 + std::rand() % MAX_CHUNK;
+
+                    if (!(std::rand() % 300)) { //recreate
+                        pool.make_queue(queue_index);
+                        std_q.clear();
+                    }
+                    else if (std::rand() % 2) { //enqueue
+                        if (std_q.size() + count > MAX_ELEMENTS_IN_QUEUE) continue;
+                        for (std::size_t t = 0; t < count; ++t) chunk[t] = (byte_t)std::rand();
+                        if (pool.try_enqueue_bytes(queue_index, chunk, count)) std_q.insert(std_q.end(), chunk, chunk + count);
+                    }
+                    else { //dequeue
+                        auto dequeued = pool.try_dequeue_bytes(queue_index, chunk, count);
+                        if (dequeued != std::min(count, std_q.size())) ++accounting_fails;
+                        for (std::size_t t = 0; t < dequeued && !std_q.empty(); ++t, std_q.pop_front())
+                            if (chunk[t] != std_q.front()) ++value_fails;
+                    }
+                    if (pool.get_unsynced_operations_count() >= SYNC_BATCH) ++accounting_fails;
+                }
+            }
+
+            {
+                //superblock must reject a pool it doesn't describe
+                persistent_pool_t pool;
+                if (pool.attach(path.c_str(), BLOCK_SIZE * 2) || pool.attach((path + ".missing").c_str(), BLOCK_SIZE)) ++persistence_fails;
+                //same header/block sizes, but a different header encoding or block alignment
+                persistent_queue_pool_t<retagged_memory_policy> retagged_pool;
+                persistent_queue_pool_t<aligned_memory_policy<standard_memory_policy, 8>> aligned_pool;
+                if (retagged_pool.attach(path.c_str(), BLOCK_SIZE) || aligned_pool.attach(path.c_str(), BLOCK_SIZE)) ++persistence_fails;
+                //the data is all there after the last restart too
+                if (!pool.attach(path.c_str(), BLOCK_SIZE)) ++persistence_fails;
+                else for (segment_id_t t = 0; t < QUEUES_COUNT; ++t) {
+                    byte_t chunk[MAX_ELEMENTS_IN_QUEUE];
+                    auto dequeued = pool.try_dequeue_bytes(t, chunk, MAX_ELEMENTS_IN_QUEUE);
+                    if (dequeued != std_queues[t].size() || !std::equal(chunk, chunk + dequeued, std_queues[t].begin())) ++value_fails;
+                }
+            }
+        }
+        std::filesystem::remove(path);
+
+        std::cout << "\n*TEST FINISHED!\n";
+        if (value_fails) std::cout << ERR_MSG("!VALUE FAILS: " << value_fails) << "\n";
+        if (accounting_fails) std::cout << ERR_MSG("!ACCOUNTING FAILS: " << accounting_fails) << "\n";
+        if (persistence_fails) std::cout << ERR_MSG("!PERSISTENCE FAILS: " << persistence_fails) << "\n";
+#endif
+    }
+
     void QueuePoolTest::test_header_correctness(){
         std::cout << "\n----------------------------------------\nHEADER CORRECTNESS...\n";
 
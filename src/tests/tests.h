@@ -21,6 +21,26 @@ namespace tests{
 
         void test_queue_randomized();
         void test_queue_randomized_with_destroy();
+        void test_queue_randomized_bulk();
+        void test_fd_io();
+        void test_coalescing();
+        void test_compaction();
+        void test_wide_memory_policy();
+        void test_side_table_memory_policy();
+        void test_aligned_memory_policy();
+        void test_uncounted_queues();
+        void test_fat_handles();
+        void test_ready_bitmap();
+        void test_typed_queue_view();
+        void test_messages();
+        void test_drr_scheduler();
+        void test_spsc();
+        void test_concurrent_regular_queues();
+        void test_spsc_magazines();
+        void test_spsc_wait();
+        void test_async();
+        void test_sharded_pool();
+        void test_persistent_pool();
 
         void test_header_correctness();
     private:
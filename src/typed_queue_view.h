@@ -0,0 +1,79 @@
+#ifndef TYPED_QUEUE_VIEW__guard___j5h4g6f5d4s9a8d7f6g5h4j3k2
+#define TYPED_QUEUE_VIEW__guard___j5h4g6f5d4s9a8d7f6g5h4j3k2
+
+#include<span>
+#include<type_traits>
+
+#include "queue_pool.h"
+
+
+
+namespace markussecundus::queue_pooling{
+
+/// <summary>
+/// View of a queue of a `queue_pool_t` as a queue of fixed-size records of type `T`.
+///
+/// A record is copied straight between the object and the blocks - one memcpy per segment it occupies
+/// (i.e. 2 if it straddles a block boundary, for records smaller than a block), with the queue's headers decoded once per call, not per byte.
+/// Batch variants move any number of records with a single call to the pool.
+///
+/// The view is just a pointer to the pool, the handle and (optionally) the queue's counters - cheap to create whenever needed.
+/// The queue must only hold whole records, i.e. not be accessed as bytes in the meantime.
+/// </summary>
+template<typename T, memory_policies::memory_policy TMemoryPolicy = memory_policies::standard_memory_policy>
+    requires std::is_trivially_copyable_v<T>
+class typed_queue_view_t {
+public:
+    using pool_t = queue_pool_t<TMemoryPolicy>;
+
+    /// <summary>
+    /// Counters of the queue, if the caller keeps them, get updated by the view's operations and make `size()` O(1).
+    /// </summary>
+    typed_queue_view_t(pool_t* pool_, typename pool_t::queue_handle_t* handle_, typename pool_t::queue_counters_t* counters_ = nullptr) 
+        : pool(pool_), handle(handle_), counters(counters_) {}
+
+    /// <summary>
+    /// How many records the queue holds.
+    /// Runs in O(1) time with counters, O(segments) otherwise.
+    /// </summary>
+    buffersize_t size() { return (counters ? pool->size(*counters) : pool->size(*handle)) / sizeof(T); }
+    bool empty() { return size() == 0; }
+
+    /// <summary>
+    /// Enqueues a record.
+    /// </summary>
+    /// <returns>`false` if out of memory (nothing gets enqueued then)</returns>
+    bool push(const T& record) { return pool->try_enqueue_bytes(handle, reinterpret_cast<const byte_t*>(&record), sizeof(T), counters); }
+    /// <summary>
+    /// Dequeues a record.
+    /// </summary>
+    /// <returns>`false` if the queue is empty</returns>
+    bool pop(T& out_record) {
+        if (empty()) return false;
+        pool->try_dequeue_bytes(handle, reinterpret_cast<byte_t*>(&out_record), sizeof(T), counters);
+        return true;
+    }
+    /// <summary>
+    /// Enqueues all the records at once.
+    /// </summary>
+    /// <returns>`false` if out of memory (nothing gets enqueued then)</returns>
+    bool push_n(std::span<const T> records) { return pool->try_enqueue_bytes(handle, reinterpret_cast<const byte_t*>(records.data()), records.size_bytes(), counters); }
+    /// <summary>
+    /// Dequeues as many records as there are, up to `out_records.size()`.
+    /// </summary>
+    /// <returns>How many records were dequeued</returns>
+    buffersize_t pop_n(std::span<T> out_records) {
+        auto count = std::min<buffersize_t>(out_records.size(), size());
+        pool->try_dequeue_bytes(handle, reinterpret_cast<byte_t*>(out_records.data()), count * sizeof(T), counters);
+        return count;
+    }
+
+private:
+    pool_t* pool;
+    typename pool_t::queue_handle_t* handle;
+    typename pool_t::queue_counters_t* counters;
+};
+
+}
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef BITMAP__guard____fds5g4df9g8fd4g6fd5s4g98rt4h6gf5
+#define BITMAP__guard____fds5g4df9g8fd4g6fd5s4g98rt4h6gf5
+
+#include<algorithm>
+#include<bit>
+#include<cstddef>
+#include<cstdint>
+#include<cstring>
+
+#include "math_utils.h"
+
+namespace markussecundus::utils::bitmaps{
+
+    /// <summary>
+    /// View of a packed array of bits living in some externally provided memory.
+    /// All searches are done a whole 64bit word at a time.
+    ///
+    /// Memory doesn't need to be aligned - words are accessed through memcpy, which compiles into plain unaligned loads/stores.
+    /// Bits beyond `bits_count` in the last word are never set by any operation, so they don't need special treatment by searches.
+    /// </summary>
+    class bitmap_view_t {
+    public:
+        using word_t = std::uint64_t;
+        static constexpr std::size_t BITS_PER_WORD = sizeof(word_t) * 8;
+
+        /// <summary>
+        /// How many bytes of memory are needed to hold a bitmap of given length.
+        /// </summary>
+        static constexpr std::size_t get_required_bytes(std::size_t bits_count) { return math::divide_round_up(bits_count, BITS_PER_WORD) * sizeof(word_t); }
+
+        bitmap_view_t() : bitmap_view_t(nullptr, 0) {}
+        bitmap_view_t(unsigned char* data_, std::size_t bits_count_) : data(data_), bits_count(bits_count_) {}
+
+        bool is_valid() const { return (bool)data; }
+        std::size_t size() const { return bits_count; }
+
+        /// <summary>
+        /// Sets all the bits to 0.
+        /// </summary>
+        void clear() { std::memset(data, 0, get_required_bytes(bits_count)); }
+
+        bool get(std::size_t index) const { return (load_word(index / BITS_PER_WORD) >> (index % BITS_PER_WORD)) & 1; }
+        void set(std::size_t index, bool value) {
+            auto word_index = index / BITS_PER_WORD;
+            word_t mask = word_t(1) << (index % BITS_PER_WORD);
+            auto word = load_word(word_index);
+            store_word(word_index, value ? (word | mask) : (word & ~mask));
+        }
+
+        /// <summary>
+        /// Sets a contiguous range of bits to the same value, one word at a time.
+        /// </summary>
+        void set_range(std::size_t first, std::size_t count, bool value) {
+            auto end = std::min(first + count, bits_count);
+            while (first < end) {
+                auto word_index = first / BITS_PER_WORD;
+                auto bit_begin = first % BITS_PER_WORD;
+                auto bit_end = std::min<std::size_t>(BITS_PER_WORD, bit_begin + (end - first));
+                word_t mask = (bit_end - bit_begin == BITS_PER_WORD) ? ~word_t(0) : (((word_t(1) << (bit_end - bit_begin)) - 1) << bit_begin);
+                auto word = load_word(word_index);
+                store_word(word_index, value ? (word | mask) : (word & ~mask));
+                first += bit_end - bit_begin;
+            }
+        }
+
+        /// <summary>
+        /// Finds the first bit set to 1 on position >= `from`.
+        /// </summary>
+        /// <returns>Index of the bit, `size()` if there is none</returns>
+        std::size_t find_first_set(std::size_t from) const { return find_first(from, false); }
+        /// <summary>
+        /// Finds the first bit set to 0 on position >= `from`.
+        /// </summary>
+        /// <returns>Index of the bit, `size()` if there is none</returns>
+        std::size_t find_first_clear(std::size_t from) const { return find_first(from, true); }
+
+        /// <summary>
+        /// Finds the first run of at least `length` consecutive bits set to 1, starting on position >= `from`.
+        /// </summary>
+        /// <returns>Index of the run's first bit, `size()` if there is none</returns>
+        std::size_t find_set_run(std::size_t length, std::size_t from) const {
+            while (from < bits_count) {
+                auto run_begin = find_first_set(from);
+                if (run_begin >= bits_count) break;
+                auto run_end = find_first_clear(run_begin);
+                if (run_end - run_begin >= length) return run_begin;
+                from = run_end;
+            }
+            return bits_count;
+        }
+
+    private:
+        unsigned char* data;
+        std::size_t bits_count;
+
+        word_t load_word(std::size_t word_index) const {
+            word_t ret;
+            std::memcpy(&ret, data + word_index * sizeof(word_t), sizeof(word_t));
+            return ret;
+        }
+        void store_word(std::size_t word_index, word_t value) { std::memcpy(data + word_index * sizeof(word_t), &value, sizeof(word_t)); }
+
+        std::size_t find_first(std::size_t from, bool inverted) const {
+            if (from >= bits_count) return bits_count;
+            auto words_count = math::divide_round_up(bits_count, BITS_PER_WORD);
+            auto word_index = from / BITS_PER_WORD;
+            //mask out the bits before `from` in the first word
+            word_t word = (inverted ? ~load_word(word_index) : load_word(word_index)) & (~word_t(0) << (from % BITS_PER_WORD));
+            for (;;) {
+                if (word)
+                    return std::min(word_index * BITS_PER_WORD + std::countr_zero(word), bits_count);
+                if (++word_index >= words_count)
+                    return bits_count;
+                word = inverted ? ~load_word(word_index) : load_word(word_index);
+            }
+        }
+    };
+}
+
+#endif
@@ -130,6 +130,26 @@ namespace markussecundus::utils::linked_lists{
             if (!b_is_single) prepend_list(b_remainder, a);
         }
 
+        /// <summary>
+        /// Splits a list in front of one of its nodes in O(1) time - inverse of `prepend_list()`.
+        /// E.g. if the list is 1->2->3->4 and `b` is 3, then the results are lists 1->2 and 3->4.
+        ///
+        /// If both arguments are the same node or don't belong to the same list, then the behaviour is undefined!
+        /// </summary>
+        /// <param name="a">Head of the list to be split - becomes head of its first part</param>
+        /// <param name="b">Node where the second part starts</param>
+        /// <returns>Head of the second part (`b`)</returns>
+        TNode split_list(TNode a, TNode b) {
+            TNode a_last = p::get_last(b);
+            TNode b_last = p::get_last(a);
+
+            p::set_next(a_last, a);
+            p::set_last(a, a_last);
+            p::set_next(b_last, b);
+            p::set_last(b, b_last);
+            return b;
+        }
+
         /// <summary>
         /// Extracts the provided node from its list, decreasing its length by 1.
         /// The extracted node gets initialized to a valid single-node linked list.
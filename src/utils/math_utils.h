@@ -1,15 +1,25 @@
 #ifndef MATH_UTILS__guard____gfdsf94sd9g4ds9rg52v6dfs5g4f6d51fg1dfs6
 #define MATH_UTILS__guard____gfdsf94sd9g4ds9rg52v6dfs5g4f6d51fg1dfs6
 
+#include<concepts>
 #include<cstddef>
+#include<cstdint>
 
 namespace markussecundus::utils::math{
 
     template<std::convertible_to<std::int64_t> TNumber>
-    TNumber divide_round_up(TNumber a, TNumber divider){
+    constexpr TNumber divide_round_up(TNumber a, TNumber divider){
         return a / divider + !!(a % divider);
     }
 
+    /// <summary>
+    /// Smallest multiple of `multiple_of` that is >= `a`.
+    /// </summary>
+    template<std::convertible_to<std::int64_t> TNumber>
+    constexpr TNumber round_up(TNumber a, TNumber multiple_of) {
+        return divide_round_up(a, multiple_of) * multiple_of;
+    }
+
 
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,27 @@
+#ifndef MEMORY_UTILS__guard____h4g9f8d4s6a5d4f9g8h4j6k5l4d9f8g4h6
+#define MEMORY_UTILS__guard____h4g9f8d4s6a5d4f9g8h4j6k5l4d9f8g4h6
+
+#include<cstring>
+
+namespace markussecundus::utils::memory{
+
+    /// <summary>
+    /// Reads a value from an address that doesn't need to be aligned for `T` - memcpy compiles into a single load wherever the platform allows it.
+    /// </summary>
+    template<typename T>
+    T load_unaligned(const void* ptr) {
+        T ret;
+        std::memcpy(&ret, ptr, sizeof(T));
+        return ret;
+    }
+
+    /// <summary>
+    /// Writes a value to an address that doesn't need to be aligned for `T` - memcpy compiles into a single store wherever the platform allows it.
+    /// </summary>
+    template<typename T>
+    void store_unaligned(void* ptr, T value) {
+        std::memcpy(ptr, &value, sizeof(T));
+    }
+
+}
+#endif